@@ -0,0 +1,78 @@
+#include "Test.h"
+#include <stdio.h>
+
+// class_addMethods_np() must behave like a sequence of class_addMethod() calls.
+
+@interface Base : Test
+- (int)existing;
+@end
+@implementation Base
+- (int)existing { return 1; }
+@end
+
+@interface Sub : Base
+- (int)overridden;
+@end
+@implementation Sub
+- (int)overridden { return 2; }
+@end
+
+@interface SubSub : Sub
+@end
+@implementation SubSub
+@end
+
+static int other(id self, SEL _cmd)
+{
+	return 43;
+}
+
+int main(void)
+{
+	id base = [Base new];
+	id sub = [Sub new];
+	id subsub = [SubSub new];
+	// Make sure that all of the dtables exist before adding methods.
+	assert(call(base, @selector(existing)) == 1);
+	assert(call(sub, @selector(overridden)) == 2);
+	assert(call(subsub, @selector(overridden)) == 2);
+
+	enum { count = 100 };
+	SEL names[count + 3];
+	IMP imps[count + 3];
+	const char *types[count + 3];
+	char name[32];
+	for (int i=0 ; i<count ; i++)
+	{
+		snprintf(name, sizeof(name), "bulkAdded%d", i);
+		names[i] = sel_registerName(name);
+		imps[i] = (IMP)added;
+		types[i] = "i@:";
+	}
+	// Methods that the class already has are skipped.
+	names[count] = @selector(existing);
+	// Subclasses keep their overrides.
+	names[count + 1] = @selector(overridden);
+	// Duplicates in the list are skipped, keeping the first.
+	names[count + 2] = names[0];
+	for (int i=count ; i<count + 3 ; i++)
+	{
+		imps[i] = (IMP)other;
+		types[i] = "i@:";
+	}
+	assert(class_addMethods_np([Base class], count + 3, names, imps, types) == count + 1);
+	for (int i=0 ; i<count ; i++)
+	{
+		assert(call(base, names[i]) == 42);
+		assert(call(sub, names[i]) == 42);
+		assert(call(subsub, names[i]) == 42);
+	}
+	assert(call(base, @selector(existing)) == 1);
+	assert(call(subsub, @selector(existing)) == 1);
+	assert(call(base, @selector(overridden)) == 43);
+	assert(call(sub, @selector(overridden)) == 2);
+	assert(call(subsub, @selector(overridden)) == 2);
+	// Adding the same methods again does nothing.
+	assert(class_addMethods_np([Base class], count, names, imps, types) == 0);
+	return 0;
+}
@@ -0,0 +1,68 @@
+#include "Test.h"
+
+// Objects with more associations than fit in one group of references have
+// them indexed by a hash table.  Check lookups, replacement and removal for
+// many keys, including small integer keys that are adjacent in memory.
+
+#define KEYS 200
+
+static char keys[KEYS];
+
+static void check(id holder, id value)
+{
+	@autoreleasepool
+	{
+		for (uintptr_t i=0 ; i<KEYS ; i++)
+		{
+			assert(objc_getAssociatedObject(holder, &keys[i]) == value);
+			assert(objc_getAssociatedObject(holder, (void*)(i + 1)) == value);
+		}
+		assert(objc_getAssociatedObject(holder, (void*)(KEYS + 1)) == nil);
+	}
+}
+
+int main(void)
+{
+	id holder = [Test new];
+	id value = [Counted new];
+	for (uintptr_t i=0 ; i<KEYS ; i++)
+	{
+		objc_setAssociatedObject(holder, &keys[i], value, OBJC_ASSOCIATION_RETAIN);
+		objc_setAssociatedObject(holder, (void*)(i + 1), value,
+		                         OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+	}
+	assert(object_getRetainCount_np(value) == 2 * KEYS + 1);
+	check(holder, value);
+
+	// Replacing values must not add new references.
+	id other = [Counted new];
+	for (uintptr_t i=0 ; i<KEYS ; i++)
+	{
+		objc_setAssociatedObject(holder, &keys[i], other, OBJC_ASSOCIATION_RETAIN);
+		objc_setAssociatedObject(holder, (void*)(i + 1), other,
+		                         OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+	}
+	assert(object_getRetainCount_np(value) == 1);
+	assert(object_getRetainCount_np(other) == 2 * KEYS + 1);
+	check(holder, other);
+
+	// The list can be refilled after it has been cleared.
+	objc_removeAssociatedObjects(holder);
+	assert(object_getRetainCount_np(other) == 1);
+	check(holder, nil);
+	for (uintptr_t i=0 ; i<KEYS ; i++)
+	{
+		objc_setAssociatedObject(holder, &keys[i], value, OBJC_ASSOCIATION_RETAIN);
+		objc_setAssociatedObject(holder, (void*)(i + 1), value,
+		                         OBJC_ASSOCIATION_ASSIGN);
+	}
+	check(holder, value);
+	assert(object_getRetainCount_np(value) == KEYS + 1);
+
+	[holder release];
+	assert(object_getRetainCount_np(value) == 1);
+	[value release];
+	[other release];
+	assert(deallocCount == 2);
+	return 0;
+}
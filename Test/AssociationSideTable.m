@@ -0,0 +1,75 @@
+#include "Test.h"
+
+// With the association side table enabled, associated objects are stored
+// without creating a hidden class for the object, and are released when the
+// object is destroyed.
+
+static char key1, key2;
+
+static Class rawClass(id obj)
+{
+	return *(Class*)obj;
+}
+
+int main(void)
+{
+	assert(objc_setAssociationSideTable_np(YES) == NO);
+
+	id holder = [Test new];
+	Class cls = rawClass(holder);
+	id value = [Counted new];
+	objc_setAssociatedObject(holder, &key1, value, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+	assert(rawClass(holder) == cls);
+	assert(object_getRetainCount_np(value) == 2);
+	@autoreleasepool
+	{
+		assert(objc_getAssociatedObject(holder, &key1) == value);
+	}
+	assert(objc_getAssociatedObject(holder, &key2) == nil);
+	objc_setAssociatedObject(holder, &key2, value, OBJC_ASSOCIATION_ASSIGN);
+	assert(objc_getAssociatedObject(holder, &key2) == value);
+	// More keys than fit in one reference list.
+	for (uintptr_t i=1 ; i<=20 ; i++)
+	{
+		objc_setAssociatedObject(holder, (void*)i, value, OBJC_ASSOCIATION_RETAIN);
+	}
+	assert(object_getRetainCount_np(value) == 22);
+	for (uintptr_t i=1 ; i<=20 ; i++)
+	{
+		assert(objc_getAssociatedObject(holder, (void*)i) == value);
+	}
+	assert(rawClass(holder) == cls);
+	// Destroying the holder releases its associations.
+	[holder release];
+	assert(object_getRetainCount_np(value) == 1);
+	[value release];
+	assert(deallocCount == 1);
+
+	// Removing all associations.
+	holder = [Test new];
+	value = [Counted new];
+	objc_setAssociatedObject(holder, &key1, value, OBJC_ASSOCIATION_RETAIN);
+	[value release];
+	objc_removeAssociatedObjects(holder);
+	assert(deallocCount == 2);
+	assert(objc_getAssociatedObject(holder, &key1) == nil);
+
+	// Objects that have used the side table keep using it after it is
+	// disabled.
+	assert(objc_setAssociationSideTable_np(NO) == YES);
+	value = [Counted new];
+	objc_setAssociatedObject(holder, &key2, value, OBJC_ASSOCIATION_RETAIN);
+	[value release];
+	assert(objc_getAssociatedObject(holder, &key2) == value);
+	assert(rawClass(holder) == cls);
+	[holder release];
+	assert(deallocCount == 3);
+
+	// Classes still store associations in the class.
+	objc_setAssociationSideTable_np(YES);
+	value = [Counted new];
+	objc_setAssociatedObject([Counted class], &key1, value, OBJC_ASSOCIATION_RETAIN);
+	[value release];
+	assert(objc_getAssociatedObject([Counted class], &key1) == value);
+	return 0;
+}
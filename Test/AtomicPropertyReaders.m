@@ -0,0 +1,172 @@
+#include "Test.h"
+#include <pthread.h>
+
+// Atomic object properties read by several threads while other threads
+// replace their values.  Values of classes that use the runtime's reference
+// count are read without locks; values of classes with their own -retain are
+// read with the property lock held.  Build with -DBENCHMARK to measure how
+// reads of an atomic property scale with the number of reading threads.
+
+#define READERS 6
+#define WRITERS 2
+#define ITERATIONS 20000
+
+static const int live = 0x1234;
+static int created;
+static int destroyed;
+
+@interface Tracked : Test
+{
+	@public
+	int magic;
+}
+@end
+@implementation Tracked
++ (id)new
+{
+	Tracked *obj = [super new];
+	obj->magic = live;
+	__atomic_add_fetch(&created, 1, __ATOMIC_RELAXED);
+	return obj;
+}
+- (void)dealloc
+{
+	magic = 0;
+	__atomic_add_fetch(&destroyed, 1, __ATOMIC_RELAXED);
+	[super dealloc];
+}
+@end
+
+// Overriding -retain and -release stops the runtime using its own reference
+// count.
+@interface CustomRetain : Tracked
+{
+	int refs;
+}
+@end
+@implementation CustomRetain
+- (id)retain
+{
+	__atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+	return self;
+}
+- (void)release
+{
+	if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) < 0)
+	{
+		[self dealloc];
+	}
+}
+@end
+
+@interface Holder : Test
+{
+	id value;
+}
+@property (atomic, retain) id value;
+@end
+@implementation Holder
+@synthesize value;
+@end
+
+static Holder *holder;
+
+static void *reader(void *arg)
+{
+	for (int i=0 ; i<ITERATIONS ; i++)
+	{
+		@autoreleasepool
+		{
+			Tracked *v = holder.value;
+			assert(v != nil);
+			assert(v->magic == live);
+		}
+	}
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	for (int i=0 ; i<ITERATIONS / 4 ; i++)
+	{
+		Tracked *v = (i & 1) ? [CustomRetain new] : [Tracked new];
+		holder.value = v;
+		[v release];
+	}
+	return NULL;
+}
+
+#ifdef BENCHMARK
+#include "Benchmark.h"
+#define BENCH_ITERATIONS 1000000
+
+static void *benchReader(void *arg)
+{
+	for (int i=0 ; i<BENCH_ITERATIONS ; i+=100)
+	{
+		@autoreleasepool
+		{
+			for (int j=0 ; j<100 ; j++)
+			{
+				(void)holder.value;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void runBenchmarks(const char *name, Class cls)
+{
+	id v = [cls new];
+	holder.value = v;
+	[v release];
+	for (int threadCount=1 ; threadCount<=BENCH_MAX_THREADS ; threadCount*=2)
+	{
+		runBenchmark(name, benchReader, threadCount, BENCH_ITERATIONS);
+	}
+}
+#endif
+
+int main(void)
+{
+	holder = [Holder new];
+	id v = [Tracked new];
+	holder.value = v;
+	[v release];
+
+	pthread_t threads[READERS + WRITERS];
+	for (int i=0 ; i<READERS ; i++)
+	{
+		pthread_create(&threads[i], NULL, reader, NULL);
+	}
+	for (int i=0 ; i<WRITERS ; i++)
+	{
+		pthread_create(&threads[READERS + i], NULL, writer, NULL);
+	}
+	for (int i=0 ; i<READERS + WRITERS ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	// Every value except the current one has been destroyed.
+	assert(destroyed == created - 1);
+	v = [Tracked new];
+	holder.value = v;
+	assert(destroyed == created - 1);
+	@autoreleasepool
+	{
+		assert(holder.value == v);
+		assert(object_getRetainCount_np(v) == 3);
+	}
+	assert(object_getRetainCount_np(v) == 2);
+	[v release];
+	holder.value = nil;
+	assert(destroyed == created);
+#ifdef BENCHMARK
+	runBenchmarks("Fast reference count", [Tracked class]);
+	runBenchmarks("Custom -retain", [CustomRetain class]);
+	holder.value = nil;
+#endif
+	[holder release];
+	return 0;
+}
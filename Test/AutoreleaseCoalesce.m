@@ -0,0 +1,60 @@
+#include "Test.h"
+
+// Repeated autoreleases of the same object are stored in the pool as a single
+// run.  Check that the run holds the right number of references and that they
+// are all released when the pool is popped.
+
+#define REPEATS 10000
+
+int main(void)
+{
+	unsigned long allocated, allocatedBefore;
+	@autoreleasepool
+	{
+		id obj = [Counted new];
+		[[Test new] autorelease];
+		objc_arc_autorelease_page_stats_np(&allocatedBefore, NULL, NULL);
+		for (int i=0 ; i<REPEATS ; i++)
+		{
+			[[obj retain] autorelease];
+		}
+		[obj autorelease];
+		// The run should fit in the page that is already allocated.
+		objc_arc_autorelease_page_stats_np(&allocated, NULL, NULL);
+		assert(allocated == allocatedBefore);
+		assert(objc_arc_autorelease_count_np() == REPEATS + 2);
+		assert(objc_arc_autorelease_count_for_object_np(obj) == REPEATS + 1);
+		assert(object_getRetainCount_np(obj) == REPEATS);
+
+		// Consuming an autoreleased return value removes one reference from
+		// the run.
+		assert(objc_retainAutoreleasedReturnValue(obj) == obj);
+		assert(objc_arc_autorelease_count_for_object_np(obj) == REPEATS);
+		[obj release];
+	}
+	assert(deallocCount == 1);
+
+	// Runs are not merged across autorelease pools or other objects.
+	@autoreleasepool
+	{
+		id a = [Counted new];
+		id b = [Counted new];
+		[[a retain] autorelease];
+		@autoreleasepool
+		{
+			[[a retain] autorelease];
+			[[a retain] autorelease];
+			[[b retain] autorelease];
+			[[a retain] autorelease];
+			assert(objc_arc_autorelease_count_for_object_np(a) == 4);
+		}
+		assert(deallocCount == 1);
+		assert(object_getRetainCount_np(a) == 1);
+		assert(objc_arc_autorelease_count_for_object_np(a) == 1);
+		[a autorelease];
+		[b autorelease];
+		assert(objc_arc_autorelease_count_for_object_np(a) == 2);
+	}
+	assert(deallocCount == 3);
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include "Test.h"
+
+// Per-thread autorelease pool statistics: pool depth, pages, high-water marks
+// and the classes that are autoreleased most often.
+
+@interface Frequent : Test
+@end
+@implementation Frequent
+@end
+
+@interface Rare : Test
+@end
+@implementation Rare
+@end
+
+#define FREQUENT 5000
+#define RARE 3
+
+int main(void)
+{
+	unsigned long depth, pages, peakDepth, peakPages, autoreleases;
+	Class classes[4];
+	unsigned long counts[4];
+
+	assert(objc_arc_set_autorelease_instrumentation_np(YES) == NO);
+	objc_arc_reset_autorelease_pool_stats_np();
+	@autoreleasepool
+	{
+		for (int i=0 ; i<RARE ; i++)
+		{
+			[[Rare new] autorelease];
+		}
+		@autoreleasepool
+		{
+			// Distinct objects, so that they aren't stored as one run.
+			for (int i=0 ; i<FREQUENT ; i++)
+			{
+				[[Frequent new] autorelease];
+			}
+			objc_arc_autorelease_pool_stats_np(&depth, &pages, &peakDepth,
+			                                   &peakPages, &autoreleases);
+			assert(depth == 2);
+			assert(pages > 1);
+			assert(peakDepth == 2);
+			assert(peakPages == pages);
+			assert(autoreleases == FREQUENT + RARE);
+		}
+		objc_arc_autorelease_pool_stats_np(&depth, &pages, &peakDepth,
+		                                   &peakPages, NULL);
+		assert(depth == 1);
+		assert(pages < peakPages);
+		assert(peakDepth == 2);
+	}
+	objc_arc_autorelease_pool_stats_np(&depth, NULL, &peakDepth, NULL, NULL);
+	assert(depth == 0);
+	assert(peakDepth == 2);
+
+	assert(objc_arc_autoreleased_classes_np(classes, counts, 4) == 2);
+	assert(classes[0] == [Frequent class]);
+	assert(counts[0] == FREQUENT);
+	assert(classes[1] == [Rare class]);
+	assert(counts[1] == RARE);
+	assert(objc_arc_autoreleased_classes_np(classes, counts, 1) == 1);
+	assert(classes[0] == [Frequent class]);
+
+	// Resetting clears the counts and sets the peaks to the current values.
+	objc_arc_reset_autorelease_pool_stats_np();
+	objc_arc_autorelease_pool_stats_np(NULL, &pages, &peakDepth, &peakPages,
+	                                   &autoreleases);
+	assert(peakDepth == 0);
+	assert(peakPages == pages);
+	assert(autoreleases == 0);
+	assert(objc_arc_autoreleased_classes_np(classes, counts, 4) == 0);
+
+	// Autoreleases aren't recorded while instrumentation is disabled.
+	assert(objc_arc_set_autorelease_instrumentation_np(NO) == YES);
+	@autoreleasepool
+	{
+		[[Rare new] autorelease];
+		objc_arc_autorelease_pool_stats_np(&depth, NULL, &peakDepth, NULL,
+		                                   &autoreleases);
+		assert(depth == 1);
+		assert(peakDepth == 1);
+		assert(autoreleases == 0);
+	}
+
+	// Popping a pool also pops the pools pushed after it.
+	void *outer = objc_autoreleasePoolPush();
+	objc_autoreleasePoolPush();
+	[[Rare new] autorelease];
+	objc_autoreleasePoolPush();
+	objc_arc_autorelease_pool_stats_np(&depth, NULL, NULL, NULL, NULL);
+	assert(depth == 3);
+	objc_autoreleasePoolPop(outer);
+	objc_arc_autorelease_pool_stats_np(&depth, NULL, NULL, NULL, NULL);
+	assert(depth == 0);
+
+	// Pools pushed with nothing autoreleased between them share a token.
+	outer = objc_autoreleasePoolPush();
+	void *inner = objc_autoreleasePoolPush();
+	assert(inner == outer);
+	objc_autoreleasePoolPop(inner);
+	objc_arc_autorelease_pool_stats_np(&depth, NULL, NULL, NULL, NULL);
+	assert(depth == 1);
+	objc_autoreleasePoolPop(outer);
+	objc_arc_autorelease_pool_stats_np(&depth, NULL, NULL, NULL, NULL);
+	assert(depth == 0);
+	return 0;
+}
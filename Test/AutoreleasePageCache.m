@@ -0,0 +1,43 @@
+#include "Test.h"
+
+// Enough objects to fill several autorelease pool pages.
+#define OBJECTS (4 * 4096 / sizeof(void*))
+
+static void fillPool(void)
+{
+	@autoreleasepool
+	{
+		for (int i=0 ; i<OBJECTS ; i++)
+		{
+			[[Test new] autorelease];
+		}
+		assert(objc_arc_autorelease_count_np() >= OBJECTS);
+	}
+}
+
+int main(void)
+{
+	unsigned long allocated, reused, cached;
+	objc_arc_set_autorelease_page_cache_limit_np(4);
+	fillPool();
+	objc_arc_autorelease_page_stats_np(&allocated, &reused, &cached);
+	assert(allocated >= 4);
+	assert(cached > 0);
+	assert(cached <= 4);
+
+	// Draining and refilling the pool should reuse the cached pages.
+	unsigned long allocatedBefore = allocated;
+	unsigned long reusedBefore = reused;
+	fillPool();
+	objc_arc_autorelease_page_stats_np(&allocated, &reused, &cached);
+	assert(reused > reusedBefore);
+	assert(allocated - allocatedBefore < allocatedBefore);
+
+	// With no cache, every page is allocated.
+	assert(objc_arc_set_autorelease_page_cache_limit_np(0) == 4);
+	fillPool();
+	fillPool();
+	objc_arc_autorelease_page_stats_np(NULL, NULL, &cached);
+	assert(cached == 0);
+	return 0;
+}
@@ -0,0 +1,43 @@
+// Timing for tests that measure the runtime's throughput when built with
+// -DBENCHMARK.  Tests include this only in that configuration, so that the
+// normal test suite checks behaviour without printing timings.
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_MAX_THREADS 64
+
+static double benchmarkNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Runs `fn` on `threadCount` threads at once and reports the total rate of
+ * operations on stderr, where each thread performs `operations` operations.
+ * Each thread is passed its index as the argument.  Thread 0 is the calling
+ * thread, so objects that it allocated beforehand are owned by one of the
+ * threads taking part.
+ */
+static void runBenchmark(const char *name, void *(*fn)(void*),
+                         int threadCount, double operations)
+{
+	pthread_t threads[BENCH_MAX_THREADS];
+	assert(threadCount <= BENCH_MAX_THREADS);
+	double start = benchmarkNow();
+	for (intptr_t i=1 ; i<threadCount ; i++)
+	{
+		pthread_create(&threads[i], NULL, fn, (void*)i);
+	}
+	fn(NULL);
+	for (int i=1 ; i<threadCount ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	double elapsed = benchmarkNow() - start;
+	fprintf(stderr, "%s, %d threads: %f seconds, %f million operations per second\n",
+			name, threadCount, elapsed,
+			operations * threadCount / elapsed / 1000000);
+}
@@ -0,0 +1,178 @@
+#include "Test.h"
+#include <pthread.h>
+
+// Biased reference counting, where the thread that allocates an object can
+// retain and release it without atomic operations.  Build with -DBENCHMARK to
+// compare the cost of retain and release with and without biasing.
+
+static int deallocs;
+
+@interface Biased : Test
+@end
+@implementation Biased
+- (void)dealloc
+{
+	__atomic_fetch_add(&deallocs, 1, __ATOMIC_RELAXED);
+	[super dealloc];
+}
+@end
+
+static id passed;
+
+// Release the object that the main thread passed, which the main thread
+// retained and still owns.
+static void *releasePassed(void *arg)
+{
+	objc_release(passed);
+	objc_release(passed);
+	return NULL;
+}
+
+#define SHARED_RETAINS 1000
+
+// Retain the object that the main thread passed many times, so that its
+// shared count fills up if the test suite has made the inline count small.
+static void *retainPassedMany(void *arg)
+{
+	for (int i=0 ; i<SHARED_RETAINS ; i++)
+	{
+		assert(objc_retain(passed) == passed);
+	}
+	return NULL;
+}
+
+// Release those references in a single run from an autorelease pool.
+static void *releasePassedMany(void *arg)
+{
+	@autoreleasepool
+	{
+		for (int i=0 ; i<SHARED_RETAINS ; i++)
+		{
+			objc_autorelease(passed);
+		}
+	}
+	return NULL;
+}
+
+// Allocate an object, retain it, and exit while it still owns it.
+static void *allocateAndExit(void *arg)
+{
+	passed = [Biased new];
+	objc_retain(passed);
+	return NULL;
+}
+
+static void runThread(void *(*fn)(void*))
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, fn, NULL);
+	pthread_join(thread, NULL);
+}
+
+#ifdef BENCHMARK
+#include "Benchmark.h"
+#define BENCH_ITERATIONS 10000000
+#define BENCH_THREADS 8
+
+static id benchObject;
+
+static void *retainRelease(void *arg)
+{
+	id obj = benchObject;
+	for (int i=0 ; i<BENCH_ITERATIONS ; i++)
+	{
+		objc_retain(obj);
+		objc_release(obj);
+	}
+	return NULL;
+}
+
+static void runBenchmarkFor(const char *name, Class cls, int threadCount)
+{
+	// The allocating thread takes part, so that the owner of a biased object
+	// uses its fast path while the other threads use atomic operations.
+	benchObject = [cls new];
+	runBenchmark(name, retainRelease, threadCount, BENCH_ITERATIONS);
+	[benchObject release];
+}
+#endif
+
+int main(void)
+{
+	objc_arc_set_biased_refcount_np([Biased class], YES);
+
+	// The owner retains and releases without giving up ownership.
+	id obj = [Biased new];
+	for (int i=0 ; i<3 ; i++)
+	{
+		assert(objc_retain(obj) == obj);
+	}
+	assert(object_getRetainCount_np(obj) == 4);
+	for (int i=0 ; i<3 ; i++)
+	{
+		objc_release(obj);
+	}
+	assert(object_getRetainCount_np(obj) == 1);
+	assert(deallocs == 0);
+	[obj release];
+	assert(deallocs == 1);
+
+	// Weak references work as for other objects.
+	obj = [Biased new];
+	id weak = nil;
+	objc_storeWeak(&weak, obj);
+	id loaded = objc_loadWeakRetained(&weak);
+	assert(loaded == obj);
+	objc_release(loaded);
+	[obj release];
+	assert(deallocs == 2);
+	assert(objc_loadWeakRetained(&weak) == nil);
+	objc_destroyWeak(&weak);
+
+	// If another thread releases references that the owner retained, the
+	// object is deallocated once the owner merges the counts.
+	void *pool = objc_autoreleasePoolPush();
+	passed = [Biased new];
+	objc_retain(passed);
+	runThread(releasePassed);
+	objc_autoreleasePoolPop(pool);
+	assert(deallocs == 3);
+
+	// If the owner has exited, the thread that releases the last reference
+	// deallocates the object.
+	runThread(allocateAndExit);
+	objc_release(passed);
+	assert(deallocs == 3);
+	assert(object_getRetainCount_np(passed) == 1);
+	objc_release(passed);
+	assert(deallocs == 4);
+
+	// References held by other threads survive moving to and from the
+	// overflow table.
+	passed = [Biased new];
+	runThread(retainPassedMany);
+	assert(object_getRetainCount_np(passed) == SHARED_RETAINS + 1);
+	runThread(releasePassedMany);
+	assert(object_getRetainCount_np(passed) == 1);
+	assert(deallocs == 4);
+	objc_release(passed);
+	assert(deallocs == 5);
+
+	// Objects allocated after biasing is disabled are not biased.
+	objc_arc_set_biased_refcount_np([Biased class], NO);
+	obj = [Biased new];
+	objc_retain(obj);
+	objc_release(obj);
+	[obj release];
+	assert(deallocs == 6);
+#ifdef BENCHMARK
+	for (int threads=1 ; threads<=BENCH_THREADS ; threads*=2)
+	{
+		objc_arc_set_biased_refcount_np([Biased class], NO);
+		runBenchmarkFor("Atomic", [Biased class], threads);
+		objc_arc_set_biased_refcount_np([Biased class], YES);
+		runBenchmarkFor("Biased", [Biased class], threads);
+	}
+#endif
+	return 0;
+}
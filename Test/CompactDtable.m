@@ -0,0 +1,88 @@
+#include "Test.h"
+#include <stdio.h>
+
+// Classes that add only a few methods to their superclass can use compact
+// dtables, which defer to the superclass for anything that they don't
+// override.  Check that dispatch sees changes to the superclass and that
+// classes keep working after they have grown too large for a compact dtable.
+
+@interface Base : Test
+- (int)base;
+- (int)replaced;
+@end
+@implementation Base
+- (int)base { return 1; }
+- (int)replaced { return 1; }
+@end
+
+@interface Small : Base
+- (int)small;
+@end
+@implementation Small
+- (int)small { return 2; }
+@end
+
+@interface SmallSub : Small
+@end
+@implementation SmallSub
+- (int)base { return 3; }
+@end
+
+static int replacement(id self, SEL _cmd)
+{
+	return 7;
+}
+
+int main(void)
+{
+	id base = [Base new];
+	id small = [Small new];
+	id sub = [SmallSub new];
+	assert(call(small, @selector(base)) == 1);
+	assert(call(small, @selector(small)) == 2);
+	assert(call(sub, @selector(base)) == 3);
+	assert(call(sub, @selector(small)) == 2);
+
+	// Methods added to the superclass after the subclass dtables have been
+	// created must be visible in the subclasses.
+	SEL addedToBase = sel_registerName("addedToBase");
+	assert(class_addMethod([Base class], addedToBase, (IMP)added, "i@:"));
+	assert(call(small, addedToBase) == 42);
+	assert(call(sub, addedToBase) == 42);
+
+	// Replacing an inherited method must be visible in subclasses, but
+	// overrides must not be replaced.
+	const char *types = method_getTypeEncoding(
+			class_getInstanceMethod([Base class], @selector(replaced)));
+	class_replaceMethod([Base class], @selector(replaced), (IMP)replacement, types);
+	class_replaceMethod([Base class], @selector(base), (IMP)replacement, types);
+	assert(call(base, @selector(replaced)) == 7);
+	assert(call(small, @selector(replaced)) == 7);
+	assert(call(sub, @selector(replaced)) == 7);
+	assert(call(small, @selector(base)) == 7);
+	assert(call(sub, @selector(base)) == 3);
+
+	// Add enough methods to force the subclasses to use sparse dtables.
+	char name[32];
+	for (int i=0 ; i<100 ; i++)
+	{
+		snprintf(name, sizeof(name), "added%d", i);
+		assert(class_addMethod([Small class], sel_registerName(name), (IMP)added, "i@:"));
+	}
+	for (int i=0 ; i<100 ; i++)
+	{
+		snprintf(name, sizeof(name), "added%d", i);
+		assert(call(small, sel_registerName(name)) == 42);
+		assert(call(sub, sel_registerName(name)) == 42);
+	}
+	assert(call(small, @selector(small)) == 2);
+	assert(call(sub, @selector(small)) == 2);
+	assert(call(sub, @selector(base)) == 3);
+	assert(call(sub, addedToBase) == 42);
+
+	SEL late = sel_registerName("addedLate");
+	assert(class_addMethod([Base class], late, (IMP)added, "i@:"));
+	assert(call(small, late) == 42);
+	assert(call(sub, late) == 42);
+	return 0;
+}
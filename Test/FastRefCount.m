@@ -85,7 +85,11 @@ int main()
 
 const long refcount_shift = 1;
 const size_t weak_mask = ((size_t)1)<<((sizeof(size_t)*8)-refcount_shift);
-const size_t refcount_mask = ~weak_mask;
+const size_t biased_mask = weak_mask >> 1;
+const size_t overflow_mask = weak_mask >> 2;
+const size_t assoc_mask = weak_mask >> 3;
+const size_t refcount_flags = weak_mask | biased_mask | overflow_mask | assoc_mask;
+const size_t refcount_mask = ~refcount_flags;
 const size_t refcount_max = refcount_mask - 1;
 
 size_t get_refcount(id obj)
@@ -97,7 +101,7 @@ size_t get_refcount(id obj)
 void set_refcount(id obj, size_t count)
 {
 	size_t *refCount = ((size_t*)obj) - 1;
-	*refCount = (*refCount & weak_mask) | (count & refcount_mask);
+	*refCount = (*refCount & refcount_flags) | (count & refcount_mask);
 }
 
 void direct_saturation_test()
@@ -122,26 +126,30 @@ void direct_saturation_test()
 		assert(objc_loadWeakRetained(&weak) == obj);
 		assert(object_getRetainCount_np(obj) == refcount_max);
 		
-		// This retain should cause the count to saturate.
+		// This retain fills the inline count.
 		assert(objc_retain_fast_np(obj) == obj);
 		assert(object_getRetainCount_np(obj) == refcount_max + 1);
+		assert(get_refcount(obj) == refcount_max);
 		
-		// A saturated count is no longer affected by retains or releases.
+		// This one moves references to the overflow table.
+		assert(objc_retain_fast_np(obj) == obj);
+		assert(object_getRetainCount_np(obj) == refcount_max + 2);
+		assert(get_refcount(obj) < refcount_max);
+		
+		// Retains and releases still affect the count.
 		assert(objc_release_fast_no_destroy_np(obj) == NO);
 		assert(object_getRetainCount_np(obj) == refcount_max + 1);
 		assert(objc_retain_fast_np(obj) == obj);
-		assert(object_getRetainCount_np(obj) == refcount_max + 1);
+		assert(object_getRetainCount_np(obj) == refcount_max + 2);
 		
-		// Nor should any weak refs be deleted.
+		// No weak refs should be deleted.
 		assert(objc_delete_weak_refs(obj) == NO);
 		assert(objc_loadWeakRetained(&weak) == obj);
-		assert(object_getRetainCount_np(obj) == refcount_max + 1);
+		assert(object_getRetainCount_np(obj) == refcount_max + 3);
 		
-		// Cleanup (can skip this if it becomes an issue)
+		// The overflow table still holds references to the object, so it is
+		// leaked rather than disposed.
 		objc_destroyWeak(&weak);
-		set_refcount(obj, 0);
-		objc_release_fast_no_destroy_np(obj);
-		object_dispose(obj);
 	}
 	
 	{
@@ -151,17 +159,13 @@ void direct_saturation_test()
 		assert(objc_retain_fast_np(obj) == obj);
 		assert(object_getRetainCount_np(obj) == refcount_max + 1);
 		
-		// Check we can init a weak ref to an object with a saturated count.
+		// Check we can init a weak ref to an object with a full inline count.
 		id weak;
 		assert(objc_initWeak(&weak, obj) == obj);
 		assert(weak != nil);
 		assert(objc_loadWeakRetained(&weak) == obj);
-		assert(object_getRetainCount_np(obj) == refcount_max + 1);
+		assert(object_getRetainCount_np(obj) == refcount_max + 2);
 		
-		// Cleanup (can skip this if it becomes an issue)
 		objc_destroyWeak(&weak);
-		set_refcount(obj, 0);
-		objc_release_fast_no_destroy_np(obj);
-		object_dispose(obj);
 	}
 }
@@ -0,0 +1,57 @@
+#include "Test.h"
+#include <stdlib.h>
+
+// Selectors listed in the hot selector profile (HotSelectors.txt), typed or
+// not, must be registered before anything else and must share a dtable leaf,
+// even though they are interleaved with other selectors in this file.
+// Malformed lines in the profile must be skipped.
+
+@interface Hot : Test
+- (int)hotOne;
+- (int)cold;
+- (int)hotTwo;
+- (int)hotThree: (int)x;
+@end
+@implementation Hot
+- (int)hotOne { return 1; }
+- (int)cold { return 0; }
+- (int)hotTwo { return 2; }
+- (int)hotThree: (int)x { return x; }
+@end
+
+int main(void)
+{
+	if (getenv("LIBOBJC_HOT_SELECTORS") == NULL)
+	{
+		return 77;
+	}
+	// Typed entries count once for the untyped selector, unless an earlier
+	// line registered it, and once for the typed one.
+	assert(sel_getHotSelectorCount_np() == 7);
+	SEL hot[] = {
+		sel_registerName("hotOne"),
+		sel_registerName("hotTwo"),
+		sel_registerName("hotThree:"),
+		sel_registerTypedName_np("hotTyped", "i@:"),
+		sel_registerTypedName_np("hotThree:", "i@:i"),
+		sel_registerName("hotUnused")
+	};
+	assert(sel_countDtableLeaves_np(hot, 6) == 1);
+	assert(sel_getHotSelectorCount_np() == 7);
+	// The selector on the malformed line was not registered from the profile,
+	// so it is in a later leaf.
+	SEL malformed[] = { hot[0], sel_registerName("hotMalformed") };
+	assert(sel_countDtableLeaves_np(malformed, 2) == 2);
+	// Unregistered selectors are ignored.
+	struct { const char *name; const char *types; } unregistered = { "hotOne", NULL };
+	SEL mixed[] = { hot[0], (SEL)&unregistered, NULL };
+	assert(sel_countDtableLeaves_np(mixed, 3) == 1);
+	assert(sel_countDtableLeaves_np(mixed + 1, 2) == 0);
+	assert(sel_countDtableLeaves_np(NULL, 0) == 0);
+	id obj = [Hot new];
+	assert([obj hotOne] == 1);
+	assert([obj hotTwo] == 2);
+	assert([obj hotThree: 3] == 3);
+	assert([obj cold] == 0);
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include "Test.h"
+#include "../objc/hooks.h"
+
+// Method caches record selectors that a class does not respond to.  Check that
+// these entries are discarded when the method is added later, whether directly
+// or to a superclass.
+
+@interface Missing : Test
+@end
+@implementation Missing
+@end
+
+@interface MissingSub : Missing
+@end
+@implementation MissingSub
+@end
+
+static int forwarded;
+
+static int forwardedMethod(id self, SEL _cmd)
+{
+	forwarded++;
+	return 0;
+}
+
+static IMP forward(id receiver, SEL selector)
+{
+	return (IMP)forwardedMethod;
+}
+
+int main(void)
+{
+	__objc_msg_forward2 = forward;
+	id obj = [Missing new];
+	id sub = [MissingSub new];
+	SEL direct = sel_registerName("addedDirectly");
+	SEL inherited = sel_registerName("addedToSuperclass");
+	SEL typed = sel_registerTypedName_np("addedWithTypes", "i@:");
+	for (int i=0 ; i<10 ; i++)
+	{
+		assert(!class_respondsToSelector([Missing class], direct));
+		assert(!class_respondsToSelector([MissingSub class], inherited));
+		assert(!class_respondsToSelector([Missing class], typed));
+		assert(call(obj, direct) == 0);
+		assert(call(sub, inherited) == 0);
+		assert(call(obj, typed) == 0);
+	}
+	assert(forwarded > 0);
+
+	assert(class_addMethod([Missing class], direct, (IMP)added, "i@:"));
+	assert(class_respondsToSelector([Missing class], direct));
+	assert(call(obj, direct) == 42);
+
+	assert(class_addMethod([Missing class], inherited, (IMP)added, "i@:"));
+	assert(class_respondsToSelector([MissingSub class], inherited));
+	assert(call(sub, inherited) == 42);
+
+	assert(class_addMethod([Missing class], typed, (IMP)added, "i@:"));
+	assert(class_respondsToSelector([Missing class], typed));
+	assert(call(obj, typed) == 42);
+
+	forwarded = 0;
+	assert(call(obj, sel_registerName("stillMissing")) == 0);
+	assert(forwarded > 0);
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include "Test.h"
+#include <pthread.h>
+
+// Atomic property accesses from several threads at once, and the contention
+// counters for the locks that protect them.  Build with -DBENCHMARK to report
+// the throughput of a contended atomic property and its lock statistics.
+
+#define THREADS 8
+#define ITERATIONS 20000
+
+@interface Holder : Test
+{
+	id value;
+}
+@property (atomic, retain) id value;
+@end
+@implementation Holder
+@synthesize value;
+@end
+
+static Holder *holder;
+static id values[2];
+
+static void *stress(void *arg)
+{
+	for (int i=0 ; i<ITERATIONS ; i++)
+	{
+		@autoreleasepool
+		{
+			holder.value = values[i & 1];
+			id v = holder.value;
+			assert((v == values[0]) || (v == values[1]));
+		}
+	}
+	return NULL;
+}
+
+#ifdef BENCHMARK
+#include "Benchmark.h"
+#define BENCH_ITERATIONS 1000000
+
+static void *bench(void *arg)
+{
+	for (int i=0 ; i<BENCH_ITERATIONS ; i++)
+	{
+		@autoreleasepool
+		{
+			holder.value = values[i & 1];
+		}
+	}
+	return NULL;
+}
+#endif
+
+static void runThreads(void *(*fn)(void*), int threadCount)
+{
+	pthread_t threads[threadCount];
+	for (int i=0 ; i<threadCount ; i++)
+	{
+		pthread_create(&threads[i], NULL, fn, NULL);
+	}
+	for (int i=0 ; i<threadCount ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+}
+
+int main(void)
+{
+	holder = [Holder new];
+	values[0] = [Test new];
+	values[1] = [Test new];
+	Ivar ivar = class_getInstanceVariable([Holder class], "value");
+	const void *addr = (char*)holder + ivar_getOffset(ivar);
+	unsigned lock = objc_propertyLockForAddress_np(addr);
+	assert(lock == objc_propertyLockForAddress_np(addr));
+
+	objc_resetPropertyLockStats_np();
+	assert(objc_propertyLockStats_np(NULL, NULL, NULL, 16) == 0);
+	runThreads(stress, THREADS);
+
+	// Only the lock for the property can have been contended.
+	unsigned locks[16];
+	unsigned long contended[16];
+	unsigned long waits[16];
+	unsigned count = objc_propertyLockStats_np(locks, contended, waits, 16);
+	assert(count <= 1);
+	if (count == 1)
+	{
+		assert(locks[0] == lock);
+		assert(contended[0] > 0);
+	}
+	assert(objc_propertyLockStats_np(locks, contended, waits, 0) == 0);
+	objc_resetPropertyLockStats_np();
+	assert(objc_propertyLockStats_np(locks, contended, waits, 16) == 0);
+
+	holder.value = nil;
+	assert(object_getRetainCount_np(values[0]) == 1);
+	assert(object_getRetainCount_np(values[1]) == 1);
+#ifdef BENCHMARK
+	for (int threadCount=1 ; threadCount<=BENCH_MAX_THREADS ; threadCount*=2)
+	{
+		objc_resetPropertyLockStats_np();
+		runBenchmark("Atomic property sets", bench, threadCount,
+		             BENCH_ITERATIONS);
+		count = objc_propertyLockStats_np(locks, contended, waits, 1);
+		fprintf(stderr, "Property lock contended %lu times, waited %lu times\n",
+				count ? contended[0] : 0, count ? waits[0] : 0);
+	}
+	holder.value = nil;
+#endif
+	[values[0] release];
+	[values[1] release];
+	[holder release];
+	return 0;
+}
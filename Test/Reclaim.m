@@ -0,0 +1,53 @@
+#include "Test.h"
+#include <stdio.h>
+
+// With LIBOBJC_RECLAIM set, replaced runtime hash table arrays are freed once
+// every thread has passed through a quiescent state, while superseded dtables
+// and method caches are kept until their class is freed.  Check that dispatch
+// keeps working as they are replaced.
+
+@interface Base : Test
+- (int)value;
+@end
+@implementation Base
+- (int)value { return 1; }
+@end
+
+@interface Sub : Base
+@end
+@implementation Sub
+@end
+
+int main(void)
+{
+	id base = [Base new];
+	id sub = [Sub new];
+	const char *types = method_getTypeEncoding(
+			class_getInstanceMethod([Base class], @selector(value)));
+	char name[32];
+	for (int i=0 ; i<200 ; i++)
+	{
+		void *pool = objc_autoreleasePoolPush();
+		// Adding methods grows the subclass dtable and overriding inherited
+		// ones invalidates its method cache.
+		snprintf(name, sizeof(name), "reclaim%d", i);
+		SEL sel = sel_registerName(name);
+		assert(class_addMethod([Base class], sel, (IMP)added, types));
+		assert(call(sub, sel) == 42);
+		assert(call(sub, @selector(value)) == 1);
+		if (i % 2)
+		{
+			assert(class_addMethod([Sub class], sel, (IMP)added, types));
+		}
+		assert(call(base, sel) == 42);
+		assert(call(sub, sel) == 42);
+		objc_autoreleasePoolPop(pool);
+		objc_threadQuiescent_np();
+	}
+	for (int i=0 ; i<200 ; i++)
+	{
+		snprintf(name, sizeof(name), "reclaim%d", i);
+		assert(call(sub, sel_registerName(name)) == 42);
+	}
+	return 0;
+}
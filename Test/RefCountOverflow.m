@@ -0,0 +1,64 @@
+#include "Test.h"
+
+// When an object's inline reference count fills up, references are moved to
+// an overflow table instead of the count saturating.  The test suite runs
+// this with LIBOBJC_REFCOUNT_INLINE_MAX set to a small value so that the
+// overflow table is used, but it must also pass without it.
+
+#define RETAINS 1000
+
+int main(void)
+{
+	id obj = [Counted new];
+	id weak;
+	objc_initWeak(&weak, obj);
+	for (int i=0 ; i<RETAINS ; i++)
+	{
+		assert(objc_retain(obj) == obj);
+		assert(object_getRetainCount_np(obj) == i + 2);
+	}
+	assert(objc_loadWeak(&weak) == obj);
+	for (int i=RETAINS ; i>0 ; i--)
+	{
+		objc_release(obj);
+		assert(object_getRetainCount_np(obj) == i);
+	}
+	assert(deallocCount == 0);
+	assert(objc_loadWeak(&weak) == obj);
+	objc_release(obj);
+	assert(deallocCount == 1);
+	assert(objc_loadWeak(&weak) == nil);
+	objc_destroyWeak(&weak);
+
+	// Repeated autoreleases are released together when the pool is popped,
+	// which may move references back from the overflow table several at a
+	// time.
+	obj = [Counted new];
+	@autoreleasepool
+	{
+		for (int i=0 ; i<RETAINS ; i++)
+		{
+			[[obj retain] autorelease];
+		}
+		assert(object_getRetainCount_np(obj) == RETAINS + 1);
+		[obj autorelease];
+		assert(deallocCount == 1);
+	}
+	assert(deallocCount == 2);
+
+	// Releasing most of the references at once must not deallocate the
+	// object while some remain.
+	obj = [Counted new];
+	@autoreleasepool
+	{
+		for (int i=0 ; i<RETAINS ; i++)
+		{
+			[[obj retain] autorelease];
+		}
+	}
+	assert(deallocCount == 2);
+	assert(object_getRetainCount_np(obj) == 1);
+	objc_release(obj);
+	assert(deallocCount == 3);
+	return 0;
+}
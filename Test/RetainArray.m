@@ -0,0 +1,85 @@
+#include "Test.h"
+
+// Bulk retain, release and strong stores for arrays containing a mixture of
+// objects that use the runtime's reference count, objects that implement
+// their own, repeated objects and nil.
+
+static int manualRetains;
+static int manualReleases;
+
+@interface Manual : Test
+{
+	int refs;
+}
+@end
+@implementation Manual
+- (id)retain
+{
+	manualRetains++;
+	refs++;
+	return self;
+}
+- (void)release
+{
+	manualReleases++;
+	if (refs-- == 0)
+	{
+		deallocCount++;
+		object_dispose(self);
+	}
+}
+@end
+
+#define COUNT 8
+
+int main(void)
+{
+	id a = [Counted new];
+	id b = [Counted new];
+	id m = [Manual new];
+	id objects[COUNT] = { a, a, a, nil, b, m, m, b };
+	objc_retainArray_np(objects, COUNT);
+	assert(objects[0] == a);
+	assert(objects[5] == m);
+	assert(object_getRetainCount_np(a) == 4);
+	assert(object_getRetainCount_np(b) == 3);
+	assert(manualRetains == 2);
+	objc_releaseArray_np(objects, COUNT);
+	assert(object_getRetainCount_np(a) == 1);
+	assert(object_getRetainCount_np(b) == 1);
+	assert(manualReleases == 2);
+	assert(deallocCount == 0);
+
+	// The last references are dropped by releasing the array.
+	id last[3] = { a, b, m };
+	objc_releaseArray_np(last, 3);
+	assert(deallocCount == 3);
+
+	// Strong stores retain the new values before releasing the old ones, so
+	// an object moving between elements must survive.
+	id dest[COUNT] = { nil };
+	id src[COUNT];
+	for (int i=0 ; i<COUNT ; i++)
+	{
+		src[i] = [Counted new];
+	}
+	objc_storeStrongArray_np(dest, src, COUNT);
+	for (int i=0 ; i<COUNT ; i++)
+	{
+		assert(dest[i] == src[i]);
+		assert(object_getRetainCount_np(src[i]) == 2);
+		objc_release(src[i]);
+		src[i] = dest[(i + 1) % COUNT];
+	}
+	deallocCount = 0;
+	objc_storeStrongArray_np(dest, src, COUNT);
+	assert(deallocCount == 0);
+	for (int i=0 ; i<COUNT ; i++)
+	{
+		assert(object_getRetainCount_np(dest[i]) == 1);
+		src[i] = nil;
+	}
+	objc_storeStrongArray_np(dest, src, COUNT);
+	assert(deallocCount == COUNT);
+	return 0;
+}
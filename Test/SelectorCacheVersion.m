@@ -0,0 +1,70 @@
+#include "Test.h"
+
+// Cached slots from objc_slot_lookup_selector_version must be invalidated when
+// the method for their selector changes, but not when unrelated methods do.
+
+@interface Base : Test
+- (int)hot;
+- (int)unrelated;
+@end
+@implementation Base
+- (int)hot { return 1; }
+- (int)unrelated { return 1; }
+@end
+
+@interface Sub : Base
+@end
+@implementation Sub
+@end
+
+static int replacement(id self, SEL _cmd)
+{
+	return 2;
+}
+
+int main(void)
+{
+#if defined(__powerpc__) && !defined(__powerpc64__)
+	// Slots are never cacheable without 64-bit atomics.
+	return 77;
+#else
+	id obj = [Sub new];
+	SEL hot = @selector(hot);
+	SEL unrelated = @selector(unrelated);
+	_Atomic(uint64_t) *counter = objc_selector_cache_version(hot);
+	// Counters are shared between some selectors, so only test independence
+	// if these two don't share one.
+	BOOL shared = counter == objc_selector_cache_version(unrelated);
+	assert(counter == objc_selector_cache_version(hot));
+
+	uint64_t version;
+	struct objc_slot2 *slot = objc_slot_lookup_selector_version(&obj, hot, &version);
+	assert(slot->method(obj, hot) == 1);
+	assert(version != 0);
+	assert(version == *counter);
+
+	// Overriding an unrelated inherited method invalidates everything cached
+	// against the global counter, but not the slot for this selector.
+	uint64_t global = objc_method_cache_version;
+	const char *types = method_getTypeEncoding(class_getInstanceMethod([Base class], unrelated));
+	assert(class_addMethod([Sub class], unrelated, (IMP)replacement, types));
+	assert(objc_method_cache_version != global);
+	if (!shared)
+	{
+		assert(version == *counter);
+	}
+
+	// Overriding the method for this selector must invalidate the slot.
+	assert(class_addMethod([Sub class], hot, (IMP)replacement, types));
+	assert(version != *counter);
+	slot = objc_slot_lookup_selector_version(&obj, hot, &version);
+	assert(slot->method(obj, hot) == 2);
+	assert(version == *counter);
+
+	// Nil receivers give uncacheable slots.
+	id nilObj = nil;
+	objc_slot_lookup_selector_version(&nilObj, hot, &version);
+	assert(version == 0);
+	return 0;
+#endif
+}
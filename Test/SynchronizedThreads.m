@@ -0,0 +1,153 @@
+#include "Test.h"
+#include <pthread.h>
+
+// @synchronized from several threads at once, on a shared object and on
+// objects that are deallocated after being locked.  Locking an object must not
+// change its class.  Build with -DBENCHMARK to compare @synchronized with a
+// pthread mutex, for fresh objects and for a contended shared object.
+
+int objc_sync_enter(id);
+int objc_sync_exit(id);
+#define OBJC_SYNC_NOT_OWNING_THREAD_ERROR -1
+
+#define THREADS 8
+#define ITERATIONS 20000
+
+static id shared;
+static long counter;
+
+static void *stress(void *arg)
+{
+	for (int i=0 ; i<ITERATIONS ; i++)
+	{
+		@synchronized(shared)
+		{
+			// Recursive locking by the same thread must not deadlock.
+			@synchronized(shared)
+			{
+				counter++;
+			}
+		}
+		id obj = [Test new];
+		Class cls = object_getClass(obj);
+		@synchronized(obj)
+		{
+			assert(object_getClass(obj) == cls);
+		}
+		assert(object_getClass(obj) == cls);
+		[obj release];
+	}
+	return NULL;
+}
+
+static void *exitOther(void *arg)
+{
+	assert(objc_sync_exit(shared) == OBJC_SYNC_NOT_OWNING_THREAD_ERROR);
+	return NULL;
+}
+
+#ifdef BENCHMARK
+#include "Benchmark.h"
+#define BENCH_ITERATIONS 1000000
+
+static pthread_mutex_t benchMutex = PTHREAD_MUTEX_INITIALIZER;
+static BOOL benchPthread;
+
+static void *benchFresh(void *arg)
+{
+	for (int i=0 ; i<BENCH_ITERATIONS ; i++)
+	{
+		id obj = [Test new];
+		if (benchPthread)
+		{
+			pthread_mutex_t mutex;
+			pthread_mutex_init(&mutex, NULL);
+			pthread_mutex_lock(&mutex);
+			pthread_mutex_unlock(&mutex);
+			pthread_mutex_destroy(&mutex);
+		}
+		else
+		{
+			objc_sync_enter(obj);
+			objc_sync_exit(obj);
+		}
+		[obj release];
+	}
+	return NULL;
+}
+
+static void *benchShared(void *arg)
+{
+	for (int i=0 ; i<BENCH_ITERATIONS ; i++)
+	{
+		if (benchPthread)
+		{
+			pthread_mutex_lock(&benchMutex);
+			counter++;
+			pthread_mutex_unlock(&benchMutex);
+		}
+		else
+		{
+			objc_sync_enter(shared);
+			counter++;
+			objc_sync_exit(shared);
+		}
+	}
+	return NULL;
+}
+
+static void runBenchmarks(const char *name, void *(*fn)(void*), BOOL usePthread)
+{
+	benchPthread = usePthread;
+	for (int threadCount=1 ; threadCount<=BENCH_MAX_THREADS ; threadCount*=2)
+	{
+		runBenchmark(name, fn, threadCount, BENCH_ITERATIONS);
+	}
+}
+#endif
+
+int main(void)
+{
+	shared = [Test new];
+	pthread_t threads[THREADS];
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_create(&threads[i], NULL, stress, NULL);
+	}
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	assert(counter == THREADS * ITERATIONS);
+
+	// Classes can be locked too.
+	@synchronized([Test class])
+	{
+		@synchronized(shared)
+		{
+		}
+	}
+
+	// Exiting a monitor that was never entered is an error.
+	assert(objc_sync_exit(shared) == OBJC_SYNC_NOT_OWNING_THREAD_ERROR);
+	// So is exiting one that another thread has entered, and doing so must not
+	// release the monitor.
+	objc_sync_enter(shared);
+	objc_sync_enter(shared);
+	pthread_t thread;
+	pthread_create(&thread, NULL, exitOther, NULL);
+	pthread_join(thread, NULL);
+	assert(objc_sync_exit(shared) == 0);
+	assert(objc_sync_exit(shared) == 0);
+	assert(objc_sync_exit(shared) == OBJC_SYNC_NOT_OWNING_THREAD_ERROR);
+	assert(objc_sync_enter(nil) == 0);
+	assert(objc_sync_exit(nil) == 0);
+#ifdef BENCHMARK
+	runBenchmarks("Fresh objects, @synchronized", benchFresh, NO);
+	runBenchmarks("Fresh objects, pthread mutex", benchFresh, YES);
+	runBenchmarks("Shared object, @synchronized", benchShared, NO);
+	runBenchmarks("Shared object, pthread mutex", benchShared, YES);
+#endif
+	[shared release];
+	return 0;
+}
@@ -48,4 +48,35 @@ __attribute__((objc_root_class))
 @interface NSAutoreleasePool : Test
 @end
 
+/**
+ * Class whose instances increment `deallocCount` when they are deallocated.
+ */
+@interface Counted : Test
+@end
+extern int deallocCount;
+
+typedef int(*IntIMP)(id, SEL);
+
+/**
+ * Sends a message that takes no arguments and returns an int.  Where there is
+ * an assembly objc_msgSend(), checks that it finds the same method as the C
+ * lookup path.
+ */
+static inline int call(id receiver, SEL sel)
+{
+	int result = ((IntIMP)objc_msg_lookup(receiver, sel))(receiver, sel);
+#ifdef __GNUSTEP_MSGSEND__
+	assert(((IntIMP)objc_msgSend)(receiver, sel) == result);
+#endif
+	return result;
+}
+
+/**
+ * Implementation for tests to add as a method at run time.
+ */
+static inline int added(id self, SEL _cmd)
+{
+	return 42;
+}
+
 
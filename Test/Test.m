@@ -62,6 +62,16 @@
 + (void)_TrivialAllocInit{}
 @end
 
+int deallocCount;
+
+@implementation Counted
+- (void)dealloc
+{
+	deallocCount++;
+	[super dealloc];
+}
+@end
+
 @implementation NSAutoreleasePool
 - (void)_ARCCompatibleAutoreleasePool {}
 + (void)addObject:(id)anObject
@@ -0,0 +1,72 @@
+#include "Test.h"
+#include "../objc/hooks.h"
+#include <stdio.h>
+
+// Sends with a selector whose types don't match the method's may be cached
+// if the mismatch hook tolerates them.  Check that these sends keep calling
+// the right method once the class gains a method with the correct types and
+// that implementations substituted by the hook are not cached.
+
+@interface Mismatch : Test
+- (int)value;
+@end
+@implementation Mismatch
+- (int)value { return 1; }
+@end
+
+static int hookCalls;
+static BOOL substitute;
+
+static int substituted(id self, SEL _cmd)
+{
+	return 2;
+}
+
+static IMP mismatch(Class cls, SEL selector, struct objc_slot2 *result)
+{
+	hookCalls++;
+	return substitute ? (IMP)substituted : result->method;
+}
+
+int main(void)
+{
+	_objc_selector_type_mismatch2 = mismatch;
+	// Add enough methods that the class has its own method cache.
+	char name[32];
+	for (int i=0 ; i<64 ; i++)
+	{
+		snprintf(name, sizeof(name), "filler%d", i);
+		assert(class_addMethod([Mismatch class], sel_registerName(name), (IMP)added, "i@:"));
+	}
+	id obj = [Mismatch new];
+	SEL wrong = sel_registerTypedName_np("value", "i@:i");
+	for (int i=0 ; i<10 ; i++)
+	{
+		assert(call(obj, wrong) == 1);
+	}
+	assert(hookCalls > 0);
+	uint64_t version;
+	// Callers must not cache the slot, because adding the method with the
+	// correct types would not invalidate it.
+	IMP value = method_getImplementation(
+			class_getInstanceMethod([Mismatch class], @selector(value)));
+	assert(objc_slot_lookup_version(&obj, wrong, &version)->method == value);
+	assert(version == 0);
+
+	// Hooks that substitute a different implementation are called every time.
+	SEL substitutedSel = sel_registerTypedName_np("value", "i@:@");
+	substitute = YES;
+	hookCalls = 0;
+	for (int i=0 ; i<10 ; i++)
+	{
+		assert(call(obj, substitutedSel) == 2);
+	}
+	assert(hookCalls >= 10);
+	substitute = NO;
+
+	// Adding a method with the correct types must replace the cached method.
+	assert(class_addMethod([Mismatch class], wrong, (IMP)added, "i@:i"));
+	assert(call(obj, wrong) == 42);
+	assert(call(obj, @selector(value)) == 1);
+	return 0;
+}
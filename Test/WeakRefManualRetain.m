@@ -0,0 +1,85 @@
+#include "Test.h"
+#include "../objc/hooks.h"
+
+// Objects that don't use the fast reference count record that they have been
+// weakly referenced in their class, so that deallocating instances of classes
+// that have never been weakly referenced can skip the weak reference table.
+// Check that weak references to them are still cleared.
+
+@interface Manual : Counted
+{
+	int refs;
+}
+@end
+@implementation Manual
+- (id)retain
+{
+	refs++;
+	return self;
+}
+- (void)release
+{
+	if (refs-- == 0)
+	{
+		objc_delete_weak_refs(self);
+		[self dealloc];
+	}
+}
+@end
+
+@interface NeverWeak : Manual
+@end
+@implementation NeverWeak
+@end
+
+@interface Associated : Manual
+@end
+@implementation Associated
+@end
+
+static id weakLoad(id obj)
+{
+	return obj;
+}
+
+int main(void)
+{
+	_objc_weak_load = weakLoad;
+	id obj = [Manual new];
+	id weak;
+	objc_initWeak(&weak, obj);
+	id loaded = objc_loadWeakRetained(&weak);
+	assert(loaded == obj);
+	[loaded release];
+	[obj release];
+	assert(deallocCount == 1);
+	assert(objc_loadWeakRetained(&weak) == nil);
+	objc_destroyWeak(&weak);
+
+	// Instances of a class that has never been weakly referenced are
+	// deallocated without touching the weak reference table.
+	[[NeverWeak new] release];
+	assert(deallocCount == 2);
+
+	// Changing the class of a weakly referenced object must not lose track of
+	// its weak references.
+	obj = [Manual new];
+	objc_initWeak(&weak, obj);
+	object_setClass(obj, [NeverWeak class]);
+	[obj release];
+	assert(deallocCount == 3);
+	assert(objc_loadWeakRetained(&weak) == nil);
+	objc_destroyWeak(&weak);
+
+	// Nor must giving it associated objects, which moves it to a hidden class.
+	static char key;
+	obj = [Associated new];
+	objc_initWeak(&weak, obj);
+	objc_setAssociatedObject(obj, &key, obj, OBJC_ASSOCIATION_ASSIGN);
+	assert(*(Class*)obj != [Associated class]);
+	[obj release];
+	assert(deallocCount == 4);
+	assert(objc_loadWeakRetained(&weak) == nil);
+	objc_destroyWeak(&weak);
+	return 0;
+}
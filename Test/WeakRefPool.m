@@ -0,0 +1,69 @@
+#include "Test.h"
+
+// Weak reference records are allocated from pools and reused once the last
+// weak reference to an object goes away.
+
+#define OBJECTS 1000
+
+static id objects[OBJECTS];
+static id weak[OBJECTS];
+
+static void storeWeakRefs(void)
+{
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		objc_storeWeak(&weak[i], objects[i]);
+	}
+}
+
+static void destroyWeakRefs(void)
+{
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		objc_destroyWeak(&weak[i]);
+	}
+}
+
+int main(void)
+{
+	unsigned long live, peak;
+	objc_arc_weak_ref_stats_np(&live, &peak);
+	unsigned long liveBefore = live;
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		objects[i] = [Test new];
+	}
+	storeWeakRefs();
+	objc_arc_weak_ref_stats_np(&live, &peak);
+	assert(live == liveBefore + OBJECTS);
+	assert(peak >= live);
+	// A second weak reference to the same object shares its record.
+	id extra = nil;
+	objc_storeWeak(&extra, objects[0]);
+	objc_arc_weak_ref_stats_np(&live, NULL);
+	assert(live == liveBefore + OBJECTS);
+	objc_destroyWeak(&extra);
+
+	destroyWeakRefs();
+	unsigned long peakBefore = peak;
+	objc_arc_weak_ref_stats_np(&live, &peak);
+	assert(live == liveBefore);
+	assert(peak == peakBefore);
+
+	// Reusing freed records does not need any more memory.
+	storeWeakRefs();
+	objc_arc_weak_ref_stats_np(&live, &peak);
+	assert(live == liveBefore + OBJECTS);
+	assert(peak == peakBefore);
+
+	// Deallocating the objects frees their records.
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		[objects[i] release];
+		assert(objc_loadWeakRetained(&weak[i]) == nil);
+	}
+	destroyWeakRefs();
+	objc_arc_weak_ref_stats_np(&live, NULL);
+	assert(live == liveBefore);
+	return 0;
+}
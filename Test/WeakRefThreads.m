@@ -0,0 +1,182 @@
+#include "Test.h"
+#include <pthread.h>
+
+// Weak references from several threads at once, to objects that are shared
+// between threads and to objects that are deallocated while they are weakly
+// referenced, including while other threads are loading from the same weak
+// variable.  Build with -DBENCHMARK to measure how weak loads and stores
+// scale with the number of threads.
+
+#define THREADS 8
+#define ITERATIONS 20000
+
+static id shared[4];
+
+static void *stress(void *arg)
+{
+	id weak = nil;
+	id copy;
+	for (int i=0 ; i<ITERATIONS ; i++)
+	{
+		id s = shared[i % 4];
+		objc_storeWeak(&weak, s);
+		id loaded = objc_loadWeakRetained(&weak);
+		assert(loaded == s);
+		objc_release(loaded);
+		objc_copyWeak(&copy, &weak);
+		assert(objc_loadWeak(&copy) == s);
+		objc_destroyWeak(&copy);
+
+		id obj = [Test new];
+		objc_storeWeak(&weak, obj);
+		objc_copyWeak(&copy, &weak);
+		loaded = objc_loadWeakRetained(&weak);
+		assert(loaded == obj);
+		objc_release(loaded);
+		[obj release];
+		assert(objc_loadWeakRetained(&weak) == nil);
+		assert(objc_loadWeakRetained(&copy) == nil);
+		objc_destroyWeak(&copy);
+	}
+	objc_destroyWeak(&weak);
+	return NULL;
+}
+
+@interface Checked : Test
+{
+	@public
+	int alive;
+}
+@end
+@implementation Checked
+- (void)dealloc
+{
+	alive = 0;
+	[super dealloc];
+}
+@end
+
+static id racedWeak;
+static BOOL racing;
+
+// Load from a weak variable while another thread repeatedly stores objects to
+// it and deallocates them.
+static void *racingLoad(void *arg)
+{
+	while (__atomic_load_n(&racing, __ATOMIC_RELAXED))
+	{
+		Checked *obj = objc_loadWeakRetained(&racedWeak);
+		if (obj != nil)
+		{
+			assert(obj->alive == 42);
+			objc_release(obj);
+		}
+	}
+	return NULL;
+}
+
+#ifdef BENCHMARK
+#include "Benchmark.h"
+#define BENCH_ITERATIONS 1000000
+
+static id benchObjects[BENCH_MAX_THREADS];
+static id benchWeak;
+static enum
+{
+	PerThread,
+	Shared,
+	SharedLoadOnly
+} benchMode;
+
+static void *bench(void *arg)
+{
+	if (benchMode == SharedLoadOnly)
+	{
+		for (int i=0 ; i<BENCH_ITERATIONS ; i++)
+		{
+			objc_release(objc_loadWeakRetained(&benchWeak));
+		}
+		return NULL;
+	}
+	id obj = (benchMode == Shared) ? benchObjects[0] : benchObjects[(intptr_t)arg];
+	id weak = nil;
+	for (int i=0 ; i<BENCH_ITERATIONS ; i++)
+	{
+		objc_storeWeak(&weak, obj);
+		objc_release(objc_loadWeakRetained(&weak));
+		objc_release(objc_loadWeakRetained(&weak));
+		objc_storeWeak(&weak, nil);
+	}
+	return NULL;
+}
+
+static void runBenchmarks(const char *name, int mode)
+{
+	benchMode = mode;
+	// Each iteration of the load and store benchmarks does two stores and two
+	// loads.
+	int operations = (mode == SharedLoadOnly) ? 1 : 4;
+	for (int threadCount=1 ; threadCount<=BENCH_MAX_THREADS ; threadCount*=2)
+	{
+		runBenchmark(name, bench, threadCount,
+		             (double)operations * BENCH_ITERATIONS);
+	}
+}
+#endif
+
+int main(void)
+{
+	for (int i=0 ; i<4 ; i++)
+	{
+		shared[i] = [Test new];
+	}
+	pthread_t threads[THREADS];
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_create(&threads[i], NULL, stress, NULL);
+	}
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	// All of the threads have dropped their weak references, so the shared
+	// objects can be deallocated normally.
+	id weak;
+	objc_initWeak(&weak, shared[0]);
+	for (int i=0 ; i<4 ; i++)
+	{
+		[shared[i] release];
+	}
+	assert(objc_loadWeakRetained(&weak) == nil);
+	objc_destroyWeak(&weak);
+
+	racing = YES;
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_create(&threads[i], NULL, racingLoad, NULL);
+	}
+	for (int i=0 ; i<ITERATIONS ; i++)
+	{
+		Checked *obj = [Checked new];
+		obj->alive = 42;
+		objc_storeWeak(&racedWeak, obj);
+		[obj release];
+	}
+	__atomic_store_n(&racing, NO, __ATOMIC_RELAXED);
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	objc_destroyWeak(&racedWeak);
+#ifdef BENCHMARK
+	for (int i=0 ; i<BENCH_MAX_THREADS ; i++)
+	{
+		benchObjects[i] = [Test new];
+	}
+	objc_storeWeak(&benchWeak, benchObjects[0]);
+	runBenchmarks("Per-thread objects", PerThread);
+	runBenchmarks("Shared object", Shared);
+	runBenchmarks("Shared weak variable, loads only", SharedLoadOnly);
+#endif
+	return 0;
+}
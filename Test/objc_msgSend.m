@@ -97,6 +97,47 @@ __attribute__((objc_root_class))
 + nothing { return 0; }
 @end
 
+#ifdef BENCHMARK
+// Classes for measuring polymorphic sends, where a call site sees several
+// receiver classes.
+#ifdef __has_attribute
+#if __has_attribute(objc_root_class)
+__attribute__((objc_root_class))
+#endif
+#endif
+@interface BenchRoot { id isa; } @end
+@implementation BenchRoot
++ (void)initialize {}
++ nothing { return 0; }
++ inherited { return 0; }
+@end
+@interface BenchA : BenchRoot @end
+@implementation BenchA
++ nothing { return 0; }
+@end
+@interface BenchB : BenchRoot @end
+@implementation BenchB
++ nothing { return 0; }
+@end
+@interface BenchC : BenchRoot @end
+@implementation BenchC
++ nothing { return 0; }
+@end
+@interface BenchD : BenchRoot @end
+@implementation BenchD
++ nothing { return 0; }
+@end
+
+static inline uint64_t cycles(void)
+{
+#if __has_builtin(__builtin_readcyclecounter)
+	return __builtin_readcyclecounter();
+#else
+	return 0;
+#endif
+}
+#endif // BENCHMARK
+
 int forwardcalls;
 void fwdMany(id self,
              SEL _cmd,
@@ -258,6 +299,53 @@ int main(void)
 	times[2] = ((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC;
 	fprintf(stderr, "Direct IMP call took %f seconds. \n", times[2]);
 	printf("%f\t%f\t%f\n", times[0], times[1], times[2]);
+	// Sends that hit in the method cache.  Build with -DMETHOD_CACHE=OFF to
+	// compare against walking the dtable on every send.
+	Class receivers[5] = {
+		objc_getClass("BenchA"),
+		objc_getClass("BenchB"),
+		objc_getClass("BenchC"),
+		objc_getClass("BenchD"),
+		objc_getClass("BenchRoot")
+	};
+	for (int i=0 ; i<5 ; i++)
+	{
+		objc_msgSend(receivers[i], @selector(nothing));
+		objc_msgSend(receivers[i], @selector(inherited));
+	}
+	uint64_t cycles1 = cycles();
+	c1 = clock();
+	for (int i=0 ; i<iterations ; i++)
+	{
+		objc_msgSend(receivers[4], @selector(nothing));
+	}
+	c2 = clock();
+	uint64_t cycles2 = cycles();
+	fprintf(stderr, "Monomorphic objc_msgSend() took %f seconds (%f cycles per send). \n",
+			((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC,
+			(double)(cycles2 - cycles1) / iterations);
+	cycles1 = cycles();
+	c1 = clock();
+	for (int i=0 ; i<iterations ; i++)
+	{
+		objc_msgSend(receivers[i & 3], @selector(nothing));
+	}
+	c2 = clock();
+	cycles2 = cycles();
+	fprintf(stderr, "Polymorphic objc_msgSend() took %f seconds (%f cycles per send). \n",
+			((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC,
+			(double)(cycles2 - cycles1) / iterations);
+	cycles1 = cycles();
+	c1 = clock();
+	for (int i=0 ; i<iterations ; i++)
+	{
+		objc_msgSend(receivers[i & 3], @selector(inherited));
+	}
+	c2 = clock();
+	cycles2 = cycles();
+	fprintf(stderr, "Polymorphic inherited objc_msgSend() took %f seconds (%f cycles per send). \n",
+			((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC,
+			(double)(cycles2 - cycles1) / iterations);
 #endif // BENCHMARK
 	return 0;
 #endif // __GNUSTEP_MSGSEND__
@@ -0,0 +1,105 @@
+#include "Test.h"
+#include "../objc/hooks.h"
+#include "../objc/message.h"
+#include <string.h>
+
+typedef struct { int a,b,c,d,e; } s;
+
+@interface Base : Test
+{
+	@public
+	int ivar;
+}
+- (int)value;
+- (int)add: (int)a : (int)b;
+- (double)scale: (double)d;
+- (s)sret;
++ (int)classValue;
+@end
+@implementation Base
+- (int)value { return 1; }
+- (int)add: (int)a : (int)b
+{
+	assert(ivar == 42);
+	return a + b;
+}
+- (double)scale: (double)d { return d * 2; }
+- (s)sret
+{
+	assert(ivar == 42);
+	s st = {1,2,3,4,5};
+	return st;
+}
++ (int)classValue { return 10; }
+@end
+
+@interface Sub : Base @end
+@implementation Sub
+- (int)value { return 2; }
+- (int)add: (int)a : (int)b { return 0; }
+- (double)scale: (double)d { return 0; }
++ (int)classValue { return 20; }
+@end
+
+static int lateMethod(id self, SEL _cmd)
+{
+	assert(((Base*)self)->ivar == 42);
+	return 3;
+}
+
+static id forwardedReceiver;
+
+static int forwarded(id self, SEL _cmd)
+{
+	forwardedReceiver = self;
+	return 4;
+}
+
+static IMP forward(id receiver, SEL sel)
+{
+	return (IMP)forwarded;
+}
+
+int main(void)
+{
+#ifdef __GNUSTEP_MSGSENDSUPER__
+	__objc_msg_forward2 = forward;
+	Sub *obj = [Sub new];
+	obj->ivar = 42;
+	struct objc_super sup = { obj, [Base class] };
+	// Repeat each send so that both the slow path and the cached fast path
+	// are tested.
+	for (int i=0 ; i<3 ; i++)
+	{
+		assert(((int(*)(struct objc_super*, SEL))objc_msgSendSuper)(&sup,
+				@selector(value)) == 1);
+		assert(((int(*)(struct objc_super*, SEL, int, int))objc_msgSendSuper)(&sup,
+				@selector(add::), 2, 3) == 5);
+		assert(((double(*)(struct objc_super*, SEL, double))objc_msgSendSuper)(&sup,
+				@selector(scale:), 1.5) == 3.0);
+		s ret = ((s(*)(struct objc_super*, SEL))objc_msgSendSuper_stret)(&sup,
+				@selector(sret));
+		assert(ret.a == 1);
+		assert(ret.e == 5);
+	}
+	assert([obj value] == 2);
+
+	// Class methods.
+	struct objc_super metaSup = { (id)[Sub class], object_getClass([Base class]) };
+	assert(((int(*)(struct objc_super*, SEL))objc_msgSendSuper)(&metaSup,
+			@selector(classValue)) == 10);
+
+	// Methods added after the first send must be found.
+	SEL late = sel_registerName("late");
+	assert(((int(*)(struct objc_super*, SEL))objc_msgSendSuper)(&sup, late) == 4);
+	assert(forwardedReceiver == obj);
+	assert(class_addMethod([Base class], late, (IMP)lateMethod, "i@:"));
+	assert(((int(*)(struct objc_super*, SEL))objc_msgSendSuper)(&sup, late) == 3);
+
+	// Messages to nil return 0.
+	struct objc_super nilSup = { nil, [Base class] };
+	assert(((int(*)(struct objc_super*, SEL))objc_msgSendSuper)(&nilSup,
+			@selector(value)) == 0);
+#endif
+	return 0;
+}
@@ -5,10 +5,14 @@
 #define _LIBCPP_DISABLE_EXTERN_TEMPLATE  1
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <vector>
+#include <algorithm>
 #include <tsl/robin_map.h>
 #import "lock.h"
+#include "spinlock.h"
+#include "pool.hh"
 #import "objc/runtime.h"
 #ifdef EMBEDDED_BLOCKS_RUNTIME
 #import "objc/blocks_private.h"
@@ -21,6 +25,7 @@
 #import "class.h"
 #import "selector.h"
 #import "visibility.h"
+#import "reclaim.h"
 #import "objc/hooks.h"
 #import "objc/objc-arc.h"
 #include "objc/message.h"
@@ -97,13 +102,22 @@ extern "C"
 - (void)release;
 @end
 
-#define POOL_SIZE (4096 / sizeof(void*) - (2 * sizeof(void*)))
+/**
+ * The number of entries in an autorelease pool page: as many as fit in a page
+ * after the two pointers at the start, with one bit each for `runCounts`.
+ */
+#define POOL_SIZE ((4096 - 2 * sizeof(void*)) * 8 / (8 * sizeof(void*) + 1))
 /**
  * Structure used for ARC-managed autorelease pools.  This structure should be
  * exactly one page in size, so that it can be quickly allocated.  This does
  * not correspond directly to an autorelease pool.  The 'pool' returned by
  * objc_autoreleasePoolPush() may be an interior pointer to one of these
  * structures.
+ *
+ * Repeated autoreleases of the same object are stored as a run: the object,
+ * followed by an entry holding the number of references (at least two) with
+ * the corresponding bit set in `runCounts`.  Bits are cleared when the count
+ * entries are removed, so all bits above the insert point are always clear.
  */
 struct arc_autorelease_pool
 {
@@ -120,14 +134,103 @@ struct arc_autorelease_pool
 	 * The remainder of the page, an array of object pointers.  
 	 */
 	id pool[POOL_SIZE];
+	/**
+	 * Bitmap of the entries in `pool` that hold the reference count for a run
+	 * of autoreleases of the object in the previous entry.
+	 */
+	uint8_t runCounts[(POOL_SIZE + 7) / 8];
 };
+static_assert(sizeof(struct arc_autorelease_pool) <= 4096,
+              "Autorelease pool pages must fit in a page");
 
 struct arc_tls
 {
 	struct arc_autorelease_pool *pool;
 	id returnRetained;
+	/**
+	 * The entry in `pool` for the most recently autoreleased object, if
+	 * autoreleasing it again may extend its run, or NULL.  Cleared whenever a
+	 * pool is pushed or an entry is removed, so that runs never span pools.
+	 */
+	id *runStart;
+	/**
+	 * Pages that have been drained and are kept for reuse, linked through
+	 * their `previous` fields.
+	 */
+	struct arc_autorelease_pool *freePages;
+	/** The number of pages in `freePages`. */
+	unsigned freePageCount;
+	/** The number of pages that this thread has allocated. */
+	unsigned long pagesAllocated;
+	/** The number of times that this thread has reused a cached page. */
+	unsigned long pagesReused;
+	/**
+	 * The tag that identifies this thread as the owner of objects that use
+	 * biased reference counting.  Tags are never reused.
+	 */
+	uintptr_t biasedTag;
+	/** Set while this thread is in the table of biased object owners. */
+	BOOL biasedRegistered;
+	/**
+	 * Biased objects that other threads have passed to this thread so that it
+	 * can merge their reference counts.  Protected by the owner table lock.
+	 */
+	id *biasedQueue;
+	/** The number of objects in `biasedQueue`. */
+	size_t biasedQueueCount;
+	/** The number of objects that `biasedQueue` has space for. */
+	size_t biasedQueueCapacity;
+	/** The number of autorelease pools that this thread has pushed. */
+	unsigned long poolDepth;
+	/** The number of pages in this thread's autorelease pool stack. */
+	unsigned long poolPages;
+	/**
+	 * The values returned by objc_autoreleasePoolPush() for each of the
+	 * `poolDepth` pools that this thread has pushed, outermost first.
+	 */
+	void **poolTokens;
+	/** The number of entries that `poolTokens` has space for. */
+	unsigned long poolTokenCapacity;
+	/** The largest value of `poolDepth` since the statistics were reset. */
+	unsigned long peakPoolDepth;
+	/** The largest value of `poolPages` since the statistics were reset. */
+	unsigned long peakPoolPages;
+	/**
+	 * The number of objects that this thread has autoreleased since the
+	 * statistics were reset.  Only updated while instrumentation is enabled.
+	 */
+	unsigned long autoreleaseCount;
+	/**
+	 * The number of objects of each class that this thread has autoreleased
+	 * since the statistics were reset, or NULL if instrumentation has not
+	 * been enabled while this thread autoreleased anything.
+	 */
+	tsl::robin_map<Class, unsigned long> *autoreleasedClasses;
+	/**
+	 * The hazard record used by the lock-free atomic property getter, or NULL
+	 * if this thread has not read an atomic property.
+	 */
+	struct PropertyHazard *propertyHazard;
 };
 
+/**
+ * The maximum number of drained autorelease pool pages that each thread keeps
+ * for reuse.
+ */
+static unsigned autoreleasePageCacheLimit = 4;
+
+/**
+ * Set if autorelease calls should be recorded in the per-thread statistics.
+ * Pool depths and page counts are always recorded, because they are only
+ * updated on slow paths.
+ */
+static BOOL autoreleaseInstrumentation;
+
+/**
+ * The most recently allocated biased reference counting owner tag.
+ */
+static uintptr_t lastBiasedTag;
+
 /**
  * Type-safe wrapper around calloc.
  */
@@ -145,13 +248,137 @@ static inline struct arc_tls* getARCThreadData(void)
 	auto tls = static_cast<struct arc_tls*>(arc_tls_load(ARCThreadKey));
 	if (NULL == tls)
 	{
+		reclaim_register_thread_once();
 		tls = new_zeroed<struct arc_tls>();
+		tls->biasedTag = __atomic_add_fetch(&lastBiasedTag, 1, __ATOMIC_RELAXED);
 		arc_tls_store(ARCThreadKey, tls);
 	}
 	return tls;
 #endif
 }
 static inline void release(id obj);
+static void unregisterBiasedThread(struct arc_tls *tls);
+
+/**
+ * Pushes a new page onto the autorelease pool stack for this thread, reusing
+ * a previously drained page if there is one.
+ */
+static inline struct arc_autorelease_pool *pushPoolPage(struct arc_tls *tls)
+{
+	struct arc_autorelease_pool *pool = tls->freePages;
+	if (NULL != pool)
+	{
+		tls->freePages = pool->previous;
+		tls->freePageCount--;
+		tls->pagesReused++;
+	}
+	else
+	{
+		pool = new_zeroed<struct arc_autorelease_pool>();
+		tls->pagesAllocated++;
+	}
+	pool->previous = tls->pool;
+	pool->insert = pool->pool;
+	tls->pool = pool;
+	if (++tls->poolPages > tls->peakPoolPages)
+	{
+		tls->peakPoolPages = tls->poolPages;
+	}
+	return pool;
+}
+
+/**
+ * Disposes of a drained page, keeping it for reuse if this thread has not
+ * already cached as many pages as it is allowed.
+ */
+static inline void freePoolPage(struct arc_tls *tls,
+                                struct arc_autorelease_pool *pool)
+{
+	if (tls->freePageCount < __atomic_load_n(&autoreleasePageCacheLimit, __ATOMIC_RELAXED))
+	{
+		pool->previous = tls->freePages;
+		tls->freePages = pool;
+		tls->freePageCount++;
+		return;
+	}
+	free(pool);
+}
+
+/**
+ * Returns whether `entry` in `pool` holds the reference count for a run,
+ * rather than an object.
+ */
+static inline bool isRunCount(struct arc_autorelease_pool *pool, id *entry)
+{
+	size_t i = entry - pool->pool;
+	return pool->runCounts[i / 8] & (1 << (i % 8));
+}
+
+static inline void setRunCount(struct arc_autorelease_pool *pool,
+                               id *entry,
+                               bool isCount)
+{
+	size_t i = entry - pool->pool;
+	if (isCount)
+	{
+		pool->runCounts[i / 8] |= (1 << (i % 8));
+	}
+	else
+	{
+		pool->runCounts[i / 8] &= ~(1 << (i % 8));
+	}
+}
+
+/**
+ * Adds a reference to `obj` to the run at the top of the autorelease pool, if
+ * `obj` was the last object autoreleased in the current pool.  Returns NO if
+ * a new entry is needed.
+ */
+static inline BOOL extendAutoreleaseRun(struct arc_tls *tls, id obj)
+{
+	id *run = tls->runStart;
+	if ((NULL == run) || (*run != obj))
+	{
+		return NO;
+	}
+	struct arc_autorelease_pool *pool = tls->pool;
+	id *count = run + 1;
+	if (count < pool->insert)
+	{
+		*count = (id)((uintptr_t)*count + 1);
+		return YES;
+	}
+	// Runs can't span pages.
+	if (count >= &pool->pool[POOL_SIZE])
+	{
+		return NO;
+	}
+	*count = (id)(uintptr_t)2;
+	setRunCount(pool, count, true);
+	pool->insert++;
+	return YES;
+}
+
+static inline void releaseMany(id obj, uintptr_t count);
+
+/**
+ * Removes the top entry from the current autorelease pool page, which must
+ * not be empty, and releases the references that it holds.
+ */
+static inline void releaseTopOfPool(struct arc_tls *tls)
+{
+	struct arc_autorelease_pool *pool = tls->pool;
+	tls->runStart = NULL;
+	id *entry = --pool->insert;
+	uintptr_t count = 1;
+	if (isRunCount(pool, entry))
+	{
+		setRunCount(pool, entry, false);
+		count = (uintptr_t)*entry;
+		entry = --pool->insert;
+	}
+	releaseMany(*entry, count);
+}
 
 /**
  * Empties objects from the autorelease pool, stating at the head of the list
@@ -188,21 +415,20 @@ static void emptyPool(struct arc_tls *tls, void *stop)
 		{
 			while (tls->pool->insert > tls->pool->pool)
 			{
-				tls->pool->insert--;
 				// This may autorelease some other objects, so we have to work in
 				// the case where the autorelease pool is extended during a -release.
-				release(*tls->pool->insert);
+				releaseTopOfPool(tls);
 			}
-			void *old = tls->pool;
+			struct arc_autorelease_pool *old = tls->pool;
 			tls->pool = tls->pool->previous;
-			free(old);
+			tls->poolPages--;
+			freePoolPage(tls, old);
 		}
 		if (NULL == tls->pool) break;
 		while ((stop == NULL || (tls->pool->insert > stop)) &&
 		       (tls->pool->insert > tls->pool->pool))
 		{
-			tls->pool->insert--;
-			release(*tls->pool->insert);
+			releaseTopOfPool(tls);
 		}
 	} while (tls->pool != stopPool);
 	//fprintf(stderr, "New insert: %p.  Stop: %p\n", tls->pool->insert, stop);
@@ -211,6 +437,7 @@ static void emptyPool(struct arc_tls *tls, void *stop)
 #ifdef arc_tls_store
 static TLS_CALLBACK(cleanupPools)(struct arc_tls* tls)
 {
+	unregisterBiasedThread(tls);
 	if (tls->returnRetained)
 	{
 		release(tls->returnRetained);
@@ -224,6 +451,21 @@ static TLS_CALLBACK(cleanupPools)(struct arc_tls* tls)
 	if (tls->returnRetained)
 	{
 		cleanupPools(tls);
+		return;
+	}
+	while (NULL != tls->freePages)
+	{
+		struct arc_autorelease_pool *pool = tls->freePages;
+		tls->freePages = pool->previous;
+		free(pool);
+	}
+	delete tls->autoreleasedClasses;
+	free(tls->poolTokens);
+	// Releasing objects may have allocated more biased objects.
+	unregisterBiasedThread(tls);
+	if (NULL != tls->propertyHazard)
+	{
+		tls->propertyHazard->inUse.store(false, std::memory_order_release);
 	}
 	free(tls);
 }
@@ -245,22 +487,778 @@ static const long refcount_shift = 1;
  */
 static const size_t weak_mask = ((size_t)1)<<((sizeof(size_t)*8)-refcount_shift);
 /**
- * All of the bits other than the top bit are the real reference count.
+ * The next bit indicates that the object uses biased reference counting (see
+ * below).  This is set when the object is allocated and never changes.
  */
-static const size_t refcount_mask = ~weak_mask;
+static const size_t biased_mask = weak_mask >> 1;
+/**
+ * The next bit indicates that some of the object's references are stored in
+ * the overflow table (see below), because the inline count filled up.
+ */
+static const size_t overflow_mask = weak_mask >> 2;
+/**
+ * The next bit indicates that the object has associated objects in the side
+ * table in associate.mm.  Like the weak flag, this is set and never cleared.
+ */
+static const size_t assoc_mask = weak_mask >> 3;
+/**
+ * The flag bits in the reference count, which are preserved by all updates.
+ */
+static const size_t refcount_flags =
+	weak_mask | biased_mask | overflow_mask | assoc_mask;
+static const int refcount_flag_bits = 4;
+/**
+ * All of the bits other than the flag bits are the real reference count.  If
+ * they are all set, the object is being deallocated.
+ */
+static const size_t refcount_mask = ~refcount_flags;
 static const size_t refcount_max = refcount_mask - 1;
+/**
+ * The largest value stored in the inline reference count before references
+ * are moved to the overflow table.  Builds with the tests enabled can lower
+ * this with the `LIBOBJC_REFCOUNT_INLINE_MAX` environment variable, so that
+ * the overflow table is used.  Otherwise it is a constant, so that retains do
+ * not need to load it.
+ */
+#ifdef TEST_HOOKS
+static size_t refcount_inline_max = refcount_max;
+#else
+static const size_t refcount_inline_max = refcount_max;
+#endif
+
+/*
+ * Biased reference counting.
+ *
+ * Instances of classes that opt in with objc_arc_set_biased_refcount_np()
+ * have two more words before the reference count: the tag of the thread that
+ * owns them, which is initially the thread that allocated them, and the number
+ * of references that the owner holds.  The owner retains and releases by
+ * updating its count without atomic operations.  Other threads update a signed
+ * count in the real reference count bits, which may become negative while the
+ * object has an owner.  The lowest two bits of this field are flags.
+ *
+ * When the owner's count reaches zero, the owner merges it into the shared
+ * count and gives up ownership.  The first time that another thread would
+ * make the shared count negative, it instead passes a reference to the owner,
+ * which merges the counts the next time that it pops an autorelease pool or
+ * exits.  If the owner has already exited, the other thread merges the counts
+ * itself.
+ *
+ * The shared count has fewer bits than the normal reference count, which
+ * matters on 32-bit targets.  When it would overflow, references are moved to
+ * the overflow table as for other objects, and are moved back before the
+ * shared count would reach zero.
+ */
+/**
+ * Flag indicating that a reference has been passed to the owner.
+ */
+static const uintptr_t biased_queued = 1;
+/**
+ * Flag indicating that the counts have been merged and the object no longer
+ * has an owner.  The shared count is then the number of references.
+ */
+static const uintptr_t biased_merged = 2;
+static const uintptr_t biased_state_mask = biased_queued | biased_merged;
+static const int biased_count_shift = 2;
+
+/**
+ * Returns the shared count of a biased object from its reference count word.
+ */
+static inline intptr_t biasedSharedCount(uintptr_t refCountVal)
+{
+	// Shift out the flag bits and shift back to sign extend the count.
+	return ((intptr_t)(refCountVal << refcount_flag_bits)) >>
+	       (refcount_flag_bits + biased_count_shift);
+}
+
+/**
+ * Returns a reference count word for a biased object with the flag bits from
+ * `refCountVal` and the specified shared count and state.
+ */
+static inline uintptr_t biasedRefCount(uintptr_t refCountVal,
+                                       intptr_t count,
+                                       uintptr_t state)
+{
+	return (refCountVal & refcount_flags) |
+	       ((((uintptr_t)count << biased_count_shift) | state) & refcount_mask);
+}
+
+/**
+ * Returns the largest shared count that a biased object stores inline before
+ * moving references to the overflow table.
+ */
+static inline intptr_t biasedSharedMax()
+{
+	intptr_t max = refcount_mask >> (biased_count_shift + 1);
+	return std::min(max, (intptr_t)refcount_inline_max);
+}
+
+/**
+ * Returns whether `delta` can be added to the shared count in the reference
+ * count word `refCountVal` without moving references to or from the overflow
+ * table.
+ */
+static inline BOOL biasedSharedCountFits(uintptr_t refCountVal, intptr_t delta)
+{
+	intptr_t wanted = biasedSharedCount(refCountVal) + delta;
+	return (wanted <= biasedSharedMax()) &&
+	       ((wanted > 0) || !(refCountVal & overflow_mask));
+}
+
+static BOOL rebalanceBiasedOverflow(id obj, intptr_t delta);
+
+/**
+ * The number of bytes allocated before a biased object.  The owner and its
+ * count are preceded by padding, so that the object is as aligned as objects
+ * with only a reference count before them.
+ */
+static const size_t biased_header_size = sizeof(uintptr_t) +
+	((2 * sizeof(uintptr_t) + OBJECT_ALLOCATION_ALIGNMENT - 1) &
+	 ~(size_t)(OBJECT_ALLOCATION_ALIGNMENT - 1));
+
+static inline uintptr_t *biasedOwner(id obj)
+{
+	return ((uintptr_t*)obj) - 3;
+}
+
+static inline uintptr_t *biasedCount(id obj)
+{
+	return ((uintptr_t*)obj) - 2;
+}
+
+/**
+ * Returns YES if the calling thread owns the biased object `obj`.
+ */
+static inline BOOL isBiasedOwner(id obj)
+{
+	uintptr_t owner = __atomic_load_n(biasedOwner(obj), __ATOMIC_ACQUIRE);
+	if (owner == 0)
+	{
+		return NO;
+	}
+	struct arc_tls *tls = getARCThreadData();
+	return (NULL != tls) && (owner == tls->biasedTag);
+}
+
+/**
+ * Called when `obj`'s reference count has been set to the deallocating value
+ * `refCountVal`.  Returns YES if the object should now be deallocated.
+ */
+static inline BOOL finishReleasingLastReference(id obj, uintptr_t refCountVal)
+{
+	if ((refCountVal & weak_mask) == weak_mask)
+	{
+		return objc_delete_weak_refs(obj);
+	}
+	return YES;
+}
+
+/**
+ * Merges the biased count of `obj` into its shared count, along with
+ * `extra`, which is negative to drop references.  `biased` is the owner's
+ * count, which the caller must already have cleared along with the owner.
+ * If `dequeued` is set, then this is merging a reference that was passed to
+ * the owner.  Returns YES if the object should now be deallocated.
+ */
+static BOOL mergeBiased(id obj, intptr_t biased, intptr_t extra, BOOL dequeued)
+{
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
+	uintptr_t updated;
+	BOOL shouldFree;
+	while (true)
+	{
+		if ((refCountVal & refcount_mask) == refcount_mask)
+		{
+			return NO;
+		}
+		if (!biasedSharedCountFits(refCountVal, biased + extra) &&
+		    rebalanceBiasedOverflow(obj, biased + extra))
+		{
+			refCountVal = __sync_fetch_and_add(refCount, 0);
+			continue;
+		}
+		uintptr_t state = refCountVal & biased_state_mask;
+		if (dequeued)
+		{
+			state &= ~biased_queued;
+		}
+		// A reference that has been passed to the owner and not yet merged is
+		// included in the shared count.
+		intptr_t total = biasedSharedCount(refCountVal) + biased + extra;
+		shouldFree = total <= 0;
+		updated = shouldFree ? (refCountVal | refcount_mask) :
+			biasedRefCount(refCountVal, total, state | biased_merged);
+		uintptr_t newVal =
+			__sync_val_compare_and_swap(refCount, refCountVal, updated);
+		if (newVal == refCountVal)
+		{
+			break;
+		}
+		refCountVal = newVal;
+	}
+	return shouldFree && finishReleasingLastReference(obj, updated);
+}
+
+/**
+ * The table of threads that own biased objects and may have references passed
+ * to them, indexed by tag.
+ */
+struct BiasedOwners
+{
+	ThinLock lock;
+	tsl::robin_map<uintptr_t, struct arc_tls*> threads;
+};
+
+static BiasedOwners &biasedOwners()
+{
+	static BiasedOwners owners;
+	return owners;
+}
+
+static void registerBiasedThread(struct arc_tls *tls)
+{
+	if (tls->biasedRegistered)
+	{
+		return;
+	}
+	BiasedOwners &owners = biasedOwners();
+	std::lock_guard<ThinLock> lock{owners.lock};
+	owners.threads[tls->biasedTag] = tls;
+	tls->biasedRegistered = YES;
+}
+
+/**
+ * Passes a reference to the biased object `obj` to its owner.  If the owner
+ * has exited, merges the counts instead, and returns YES if the object should
+ * now be deallocated.
+ */
+static BOOL passBiasedReference(id obj)
+{
+	uintptr_t owner = __atomic_load_n(biasedOwner(obj), __ATOMIC_ACQUIRE);
+	intptr_t biased = 0;
+	if (owner != 0)
+	{
+		BiasedOwners &owners = biasedOwners();
+		std::lock_guard<ThinLock> lock{owners.lock};
+		auto found = owners.threads.find(owner);
+		if (found != owners.threads.end())
+		{
+			struct arc_tls *tls = found->second;
+			if (tls->biasedQueueCount == tls->biasedQueueCapacity)
+			{
+				tls->biasedQueueCapacity = tls->biasedQueueCapacity ?
+					tls->biasedQueueCapacity * 2 : 16;
+				tls->biasedQueue = static_cast<id*>(realloc(tls->biasedQueue,
+					tls->biasedQueueCapacity * sizeof(id)));
+			}
+			tls->biasedQueue[tls->biasedQueueCount] = obj;
+			__atomic_store_n(&tls->biasedQueueCount, tls->biasedQueueCount + 1,
+			                 __ATOMIC_RELAXED);
+			return NO;
+		}
+		// The owner has exited, so nothing else can update its count.  Tags
+		// are never reused, so no other thread can become the owner.
+		biased = *biasedCount(obj);
+		*biasedCount(obj) = 0;
+		__atomic_store_n(biasedOwner(obj), 0, __ATOMIC_RELAXED);
+	}
+	// If there is no owner, then it has merged (or is merging) its count
+	// itself, and just the passed reference needs to be dropped.
+	return mergeBiased(obj, biased, -1, YES);
+}
+
+/**
+ * Merges the counts of objects whose references have been passed to this
+ * thread, which owns objects with the tag `owner`.
+ */
+static void mergePassedReferences(struct arc_tls *tls, uintptr_t owner)
+{
+	if (__atomic_load_n(&tls->biasedQueueCount, __ATOMIC_RELAXED) == 0)
+	{
+		return;
+	}
+	id *queue;
+	size_t count;
+	{
+		BiasedOwners &owners = biasedOwners();
+		std::lock_guard<ThinLock> lock{owners.lock};
+		queue = tls->biasedQueue;
+		count = tls->biasedQueueCount;
+		tls->biasedQueue = NULL;
+		tls->biasedQueueCount = 0;
+		tls->biasedQueueCapacity = 0;
+	}
+	for (size_t i=0 ; i<count ; i++)
+	{
+		id obj = queue[i];
+		intptr_t biased = 0;
+		if (__atomic_load_n(biasedOwner(obj), __ATOMIC_RELAXED) == owner)
+		{
+			biased = *biasedCount(obj);
+			*biasedCount(obj) = 0;
+			__atomic_store_n(biasedOwner(obj), 0, __ATOMIC_RELEASE);
+		}
+		if (mergeBiased(obj, biased, -1, YES))
+		{
+			[obj dealloc];
+		}
+	}
+	free(queue);
+}
+
+static void unregisterBiasedThread(struct arc_tls *tls)
+{
+	if (!tls->biasedRegistered)
+	{
+		return;
+	}
+	// Give up ownership of every object that this thread owns, so that other
+	// threads can merge their counts once this thread is unregistered.
+	uintptr_t owner = tls->biasedTag;
+	tls->biasedTag = __atomic_add_fetch(&lastBiasedTag, 1, __ATOMIC_RELAXED);
+	{
+		BiasedOwners &owners = biasedOwners();
+		std::lock_guard<ThinLock> lock{owners.lock};
+		owners.threads.erase(owner);
+		tls->biasedRegistered = NO;
+	}
+	// No more references can be passed to this thread, so merge the ones that
+	// have been.
+	mergePassedReferences(tls, owner);
+}
+
+/**
+ * Retains a biased object.
+ */
+static id retain_biased(id obj, BOOL isWeak)
+{
+	if (isBiasedOwner(obj))
+	{
+		(*biasedCount(obj))++;
+		return obj;
+	}
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
+	while (true)
+	{
+		// See the comment in retain_fast().  Objects that still have an owner
+		// can't be deallocating, whatever their shared count.
+		if ((refCountVal & refcount_mask) == refcount_mask)
+		{
+			return isWeak ? nil : obj;
+		}
+		if (!biasedSharedCountFits(refCountVal, 1) &&
+		    rebalanceBiasedOverflow(obj, 1))
+		{
+			refCountVal = __sync_fetch_and_add(refCount, 0);
+			continue;
+		}
+		uintptr_t updated = biasedRefCount(refCountVal,
+		                                   biasedSharedCount(refCountVal) + 1,
+		                                   refCountVal & biased_state_mask);
+		uintptr_t newVal =
+			__sync_val_compare_and_swap(refCount, refCountVal, updated);
+		if (newVal == refCountVal)
+		{
+			return obj;
+		}
+		refCountVal = newVal;
+	}
+}
+
+/**
+ * Drops `count` references to a biased object.  Returns YES if the object
+ * should now be deallocated.
+ */
+static BOOL release_biased_no_destroy(id obj, uintptr_t count)
+{
+	// Drop large numbers of references in steps, so that references moved
+	// back from the overflow table can absorb each step.
+	uintptr_t step = (biasedSharedMax() + 1) / 2;
+	for ( ; count > step ; count -= step)
+	{
+		if (release_biased_no_destroy(obj, step))
+		{
+			return YES;
+		}
+	}
+	if (isBiasedOwner(obj))
+	{
+		uintptr_t *biased = biasedCount(obj);
+		if (*biased > count)
+		{
+			*biased -= count;
+			return NO;
+		}
+		intptr_t remaining = *biased;
+		*biased = 0;
+		__atomic_store_n(biasedOwner(obj), 0, __ATOMIC_RELEASE);
+		return mergeBiased(obj, remaining, -(intptr_t)count, NO);
+	}
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
+	uintptr_t updated;
+	BOOL shouldPass;
+	BOOL shouldFree;
+	while (true)
+	{
+		if ((refCountVal & refcount_mask) == refcount_mask)
+		{
+			return NO;
+		}
+		if (!biasedSharedCountFits(refCountVal, -(intptr_t)count) &&
+		    rebalanceBiasedOverflow(obj, -(intptr_t)count))
+		{
+			refCountVal = __sync_fetch_and_add(refCount, 0);
+			continue;
+		}
+		uintptr_t state = refCountVal & biased_state_mask;
+		intptr_t shared = biasedSharedCount(refCountVal) - (intptr_t)count;
+		shouldPass = NO;
+		shouldFree = NO;
+		if (state & biased_merged)
+		{
+			shouldFree = shared <= 0;
+		}
+		else if ((shared < 0) && !(state & biased_queued))
+		{
+			// Keep one reference to pass to the owner, rather than letting
+			// the shared count become negative.
+			shouldPass = YES;
+			shared++;
+			state |= biased_queued;
+		}
+		updated = shouldFree ? (refCountVal | refcount_mask) :
+			biasedRefCount(refCountVal, shared, state);
+		uintptr_t newVal =
+			__sync_val_compare_and_swap(refCount, refCountVal, updated);
+		if (newVal == refCountVal)
+		{
+			break;
+		}
+		refCountVal = newVal;
+	}
+	if (shouldPass)
+	{
+		return passBiasedReference(obj);
+	}
+	return shouldFree && finishReleasingLastReference(obj, updated);
+}
+
+/**
+ * References to objects whose inline reference count has filled up.  When a
+ * retain would overflow the inline count, half of it is moved here and the
+ * overflow flag is set in the object's reference count.  When a release would
+ * take the inline count below zero with the flag set, references are moved
+ * back.  All updates to the table, and all changes to the overflow flag, are
+ * made with the lock held, so the sum of the two counts is consistent for any
+ * thread holding the lock.
+ */
+struct RefCountOverflow
+{
+	ThinLock lock;
+	tsl::robin_map<const void*, size_t> counts;
+};
+
+static RefCountOverflow &refCountOverflow()
+{
+	static RefCountOverflow overflow;
+	return overflow;
+}
+
+/**
+ * Slow path for retaining an object whose inline reference count is full.
+ */
+static id retainOverflowing(id obj, BOOL isWeak)
+{
+	RefCountOverflow &overflow = refCountOverflow();
+	std::lock_guard<ThinLock> lock{overflow.lock};
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
+	uintptr_t newVal = refCountVal;
+	size_t moved;
+	do {
+		refCountVal = newVal;
+		size_t realCount = refCountVal & refcount_mask;
+		if (realCount == refcount_mask)
+		{
+			return isWeak ? nil : obj;
+		}
+		// Other threads may have released references since the caller
+		// checked, in which case there is room inline.
+		moved = (realCount >= refcount_inline_max) ?
+			(refcount_inline_max + 1) / 2 : 0;
+		uintptr_t updated = (realCount + 1 - moved) |
+			(refCountVal & refcount_flags) | (moved ? overflow_mask : 0);
+		newVal = __sync_val_compare_and_swap(refCount, refCountVal, updated);
+	} while (newVal != refCountVal);
+	if (moved)
+	{
+		overflow.counts[obj] += moved;
+	}
+	return obj;
+}
+
+/**
+ * Slow path for releasing `count` references to an object that has more
+ * references in the overflow table than in its inline count.  Returns YES if
+ * the object should now be deallocated.
+ */
+static BOOL releaseOverflowing(id obj, uintptr_t count)
+{
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	uintptr_t updated;
+	BOOL shouldFree;
+	{
+		RefCountOverflow &overflow = refCountOverflow();
+		std::lock_guard<ThinLock> lock{overflow.lock};
+		auto found = overflow.counts.find(obj);
+		size_t spilled = (found == overflow.counts.end()) ? 0 : found->second;
+		size_t remaining;
+		uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
+		uintptr_t newVal = refCountVal;
+		do {
+			refCountVal = newVal;
+			size_t realCount = refCountVal & refcount_mask;
+			if (realCount == refcount_mask)
+			{
+				return NO;
+			}
+			// The stored count is one less than the number of references.
+			intptr_t total = (intptr_t)(realCount + 1 + spilled - count);
+			shouldFree = total <= 0;
+			uintptr_t flags = refCountVal & (refcount_flags & ~overflow_mask);
+			if (shouldFree)
+			{
+				remaining = 0;
+				updated = flags | refcount_mask;
+			}
+			else
+			{
+				// Move enough references back that the inline count can
+				// absorb a run of releases without coming back here.
+				size_t inlineCount = (refcount_inline_max + 1) / 2;
+				if ((size_t)total < inlineCount)
+				{
+					inlineCount = total;
+				}
+				remaining = total - inlineCount;
+				updated = (inlineCount - 1) | flags |
+					(remaining ? overflow_mask : 0);
+			}
+			newVal = __sync_val_compare_and_swap(refCount, refCountVal, updated);
+		} while (newVal != refCountVal);
+		if (remaining)
+		{
+			overflow.counts[obj] = remaining;
+		}
+		else if (found != overflow.counts.end())
+		{
+			overflow.counts.erase(obj);
+		}
+	}
+	return shouldFree && finishReleasingLastReference(obj, updated);
+}
+
+/**
+ * Moves references to the biased object `obj` between its shared count and
+ * the overflow table, so that adding `delta` to the shared count neither
+ * overflows it nor takes it to zero while references remain in the table.
+ * Returns YES if any references were moved.
+ */
+static BOOL rebalanceBiasedOverflow(id obj, intptr_t delta)
+{
+	RefCountOverflow &overflow = refCountOverflow();
+	std::lock_guard<ThinLock> lock{overflow.lock};
+	auto found = overflow.counts.find(obj);
+	intptr_t spilled = (found == overflow.counts.end()) ? 0 : found->second;
+	intptr_t max = biasedSharedMax();
+	// Leave the shared count half full, so that a run of retains or releases
+	// doesn't come back here.
+	intptr_t half = (max + 1) / 2;
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
+	uintptr_t newVal = refCountVal;
+	intptr_t moved;
+	do {
+		refCountVal = newVal;
+		if ((refCountVal & refcount_mask) == refcount_mask)
+		{
+			return NO;
+		}
+		intptr_t shared = biasedSharedCount(refCountVal);
+		intptr_t wanted = shared + delta;
+		moved = 0;
+		if (wanted > max)
+		{
+			moved = wanted - half;
+		}
+		else if ((wanted <= 0) && (spilled > 0))
+		{
+			moved = -std::min({spilled, half - wanted, max - shared});
+		}
+		if (moved == 0)
+		{
+			return NO;
+		}
+		uintptr_t updated = biasedRefCount(refCountVal, shared - moved,
+		                                   refCountVal & biased_state_mask);
+		updated &= ~overflow_mask;
+		updated |= (spilled + moved > 0) ? overflow_mask : 0;
+		newVal = __sync_val_compare_and_swap(refCount, refCountVal, updated);
+	} while (newVal != refCountVal);
+	if (spilled + moved > 0)
+	{
+		overflow.counts[obj] = spilled + moved;
+	}
+	else
+	{
+		overflow.counts.erase(obj);
+	}
+	return YES;
+}
+
+/**
+ * Returns the number of references to `obj` in the overflow table, given its
+ * reference count word `refCountVal`.
+ */
+static size_t overflowCount(id obj, uintptr_t refCountVal)
+{
+	if (!(refCountVal & overflow_mask))
+	{
+		return 0;
+	}
+	RefCountOverflow &overflow = refCountOverflow();
+	std::lock_guard<ThinLock> lock{overflow.lock};
+	auto found = overflow.counts.find(obj);
+	return (found == overflow.counts.end()) ? 0 : found->second;
+}
+
+extern "C" OBJC_PUBLIC size_t object_getRetainCount_np(id obj)
+{
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
+	size_t realCount = refCountVal & refcount_mask;
+	if (realCount == refcount_mask)
+	{
+		return 0;
+	}
+	if (refCountVal & biased_mask)
+	{
+		// Other threads may be updating the owner's count, so this is only
+		// an estimate, but it is never zero for a live object.
+		intptr_t count = biasedSharedCount(refCountVal);
+		if (!(refCountVal & biased_merged))
+		{
+			count += *biasedCount(obj);
+		}
+		count += overflowCount(obj, refCountVal);
+		return count > 0 ? count : 1;
+	}
+	return realCount + overflowCount(obj, refCountVal) + 1;
+}
+
+extern "C" OBJC_PUBLIC void objc_arc_set_biased_refcount_np(Class cls, BOOL biased)
+{
+	if (biased)
+	{
+		objc_set_class_flag(cls, objc_class_flag_biased_refcount);
+	}
+	else
+	{
+		objc_clear_class_flag(cls, objc_class_flag_biased_refcount);
+	}
+}
+
+PRIVATE extern "C" size_t arc_instance_header_size(Class cls)
+{
+	if (objc_test_class_flag(cls, objc_class_flag_biased_refcount) &&
+	    objc_test_class_flag(cls, objc_class_flag_fast_arc) &&
+	    (NULL != getARCThreadData()))
+	{
+		return biased_header_size;
+	}
+	return sizeof(uintptr_t);
+}
+
+/**
+ * Returns the first class in the superclass chain of `cls` that is not a
+ * hidden class.  Hidden classes are created for individual objects and don't
+ * inherit the flags of the real class, so flags describing an object's
+ * instances must be read from and recorded in the real class.
+ */
+static inline Class realClass(Class cls)
+{
+	while ((Nil != cls) && objc_test_class_flag(cls, objc_class_flag_hidden_class))
+	{
+		cls = cls->super_class;
+	}
+	return cls;
+}
+
+/**
+ * Returns whether an object keeps its reference count in the word before it.
+ */
+static inline BOOL hasInlineRefCount(id obj)
+{
+	if ((obj == nil) || isSmallObject(obj))
+	{
+		return NO;
+	}
+	Class cls = realClass(obj->isa);
+	return objc_test_class_flag(cls, objc_class_flag_fast_arc) &&
+	       !objc_test_class_flag(cls, objc_class_flag_meta) &&
+	       !objc_test_class_flag(cls, objc_class_flag_permanent_instances) &&
+	       !objc_test_class_flag(cls, objc_class_flag_is_block);
+}
 
-extern "C" OBJC_PUBLIC size_t object_getRetainCount_np(id obj)
+PRIVATE extern "C" BOOL arc_mark_has_associations(id obj, BOOL *wasMarked)
 {
+	if (!hasInlineRefCount(obj))
+	{
+		return NO;
+	}
 	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
-	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
-	size_t realCount = refCountVal & refcount_mask;
-	return realCount == refcount_mask ? 0 : realCount + 1;
+	uintptr_t old = __atomic_fetch_or(refCount, assoc_mask, __ATOMIC_SEQ_CST);
+	*wasMarked = (old & assoc_mask) != 0;
+	return YES;
+}
+
+PRIVATE extern "C" BOOL arc_has_associations(id obj)
+{
+	if (!hasInlineRefCount(obj))
+	{
+		return NO;
+	}
+	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	return (__atomic_load_n(refCount, __ATOMIC_ACQUIRE) & assoc_mask) != 0;
+}
+
+PRIVATE extern "C" void arc_init_biased_instance(id obj)
+{
+	struct arc_tls *tls = getARCThreadData();
+	registerBiasedThread(tls);
+	*(((uintptr_t*)obj) - 1) = biased_mask;
+	*biasedCount(obj) = 1;
+	*biasedOwner(obj) = tls->biasedTag;
+}
+
+PRIVATE extern "C" size_t arc_object_header_size(id obj)
+{
+	return (*(((uintptr_t*)obj) - 1) & biased_mask) ?
+		biased_header_size : sizeof(uintptr_t);
 }
 
 static id retain_fast(id obj, BOOL isWeak)
 {
 	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	// The biased flag never changes, so this doesn't need to be atomic with
+	// respect to other updates.
+	if (__atomic_load_n(refCount, __ATOMIC_RELAXED) & biased_mask)
+	{
+		return retain_biased(obj, isWeak);
+	}
 	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
 	uintptr_t newVal = refCountVal;
 	do {
@@ -284,13 +1282,14 @@ static id retain_fast(id obj, BOOL isWeak)
 		{
 			return isWeak ? nil : obj;
 		}
-		// If the reference count is saturated, don't increment it.
-		if (realCount == refcount_max)
+		// If the inline reference count is full, move some of it to the
+		// overflow table.
+		if (realCount >= refcount_inline_max)
 		{
-			return obj;
+			return retainOverflowing(obj, isWeak);
 		}
 		realCount++;
-		realCount |= refCountVal & weak_mask;
+		realCount |= refCountVal & refcount_flags;
 		uintptr_t updated = (uintptr_t)realCount;
 		newVal = __sync_val_compare_and_swap(refCount, refCountVal, updated);
 	} while (newVal != refCountVal);
@@ -302,6 +1301,125 @@ extern "C" OBJC_PUBLIC id objc_retain_fast_np(id obj)
 	return retain_fast(obj, NO);
 }
 
+/**
+ * Hazard pointer for the lock-free atomic property getter.  A thread publishes
+ * the object that it is about to retain here, and setters that have just
+ * replaced that object wait for it to be cleared before releasing it.
+ * Records are never freed, because setters may be scanning them, but the
+ * record of a thread that has exited is reused by the next thread that needs
+ * one.  Records are padded so that publishing a hazard does not invalidate
+ * another thread's cache line.
+ */
+struct alignas(64) PropertyHazard
+{
+	/** The object that the owning thread is retaining, or nil. */
+	id object;
+	/** Set while a thread owns this record. */
+	std::atomic<bool> inUse;
+	/** The next record.  Never modified after the record is published. */
+	PropertyHazard *next;
+};
+
+/**
+ * List of all hazard records.  Records are only ever added at the head.
+ */
+static std::atomic<PropertyHazard*> propertyHazards;
+
+/**
+ * Returns a hazard record for the calling thread, reusing one from a thread
+ * that has exited if possible.
+ */
+static PropertyHazard *acquirePropertyHazard(void)
+{
+	for (PropertyHazard *hazard = propertyHazards.load() ; hazard != NULL ;
+	     hazard = hazard->next)
+	{
+		bool expected = false;
+		if (!hazard->inUse.load(std::memory_order_relaxed) &&
+		    hazard->inUse.compare_exchange_strong(expected, true))
+		{
+			return hazard;
+		}
+	}
+	auto hazard = new PropertyHazard();
+	hazard->inUse.store(true, std::memory_order_relaxed);
+	hazard->next = propertyHazards.load();
+	while (!propertyHazards.compare_exchange_weak(hazard->next, hazard)) {}
+	return hazard;
+}
+
+PRIVATE extern "C" BOOL arc_load_atomic_property(id *addr, id *result)
+{
+	struct arc_tls *tls = getARCThreadData();
+	if (NULL == tls)
+	{
+		return NO;
+	}
+	PropertyHazard *hazard = tls->propertyHazard;
+	if (UNLIKELY(NULL == hazard))
+	{
+		hazard = tls->propertyHazard = acquirePropertyHazard();
+	}
+	id obj = __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+	while (true)
+	{
+		if ((nil == obj) || isSmallObject(obj))
+		{
+			*result = obj;
+			return YES;
+		}
+		// Publish the hazard and then check that the property still holds the
+		// object.  A setter that replaces it after this will see the hazard
+		// and keep the object alive until we clear it, so it is safe to
+		// inspect it and retain it.
+		__atomic_store_n(&hazard->object, obj, __ATOMIC_SEQ_CST);
+		id current = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+		if (current == obj)
+		{
+			break;
+		}
+		obj = current;
+	}
+	BOOL handled = YES;
+	Class cls = obj->isa;
+	if (objc_test_class_flag(cls, objc_class_flag_permanent_instances))
+	{
+		*result = obj;
+	}
+	else if (!objc_test_class_flag(cls, objc_class_flag_is_block) &&
+	         objc_test_class_flag(cls, objc_class_flag_fast_arc))
+	{
+		// The property holds a reference, so the object can only be
+		// deallocating if it has been over-released.  Treat it as a zeroing
+		// weak reference would, rather than resurrecting it.
+		*result = retain_fast(obj, YES);
+	}
+	else
+	{
+		// Retaining other objects may run arbitrary code, which we must not
+		// do while setters are waiting for us.
+		handled = NO;
+	}
+	__atomic_store_n(&hazard->object, nil, __ATOMIC_RELEASE);
+	return handled;
+}
+
+PRIVATE extern "C" void arc_wait_for_atomic_property_readers(id obj)
+{
+	if ((nil == obj) || isSmallObject(obj))
+	{
+		return;
+	}
+	for (PropertyHazard *hazard = propertyHazards.load() ; hazard != NULL ;
+	     hazard = hazard->next)
+	{
+		while (__atomic_load_n(&hazard->object, __ATOMIC_SEQ_CST) == obj)
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
 __attribute__((always_inline))
 static inline BOOL isPersistentObject(id obj)
 {
@@ -335,41 +1453,49 @@ static inline id retain(id obj, BOOL isWeak)
 	return ManualRetainReleaseMessage(obj, retain, id(*)(id, SEL));
 }
 
-extern "C" OBJC_PUBLIC BOOL objc_release_fast_no_destroy_np(id obj)
+/**
+ * Drops `count` references to an object that uses the fast reference count.
+ * Returns YES if the object should now be deallocated.
+ */
+static inline BOOL release_fast_no_destroy(id obj, uintptr_t count)
 {
 	uintptr_t *refCount = ((uintptr_t*)obj) - 1;
+	if (__atomic_load_n(refCount, __ATOMIC_RELAXED) & biased_mask)
+	{
+		return release_biased_no_destroy(obj, count);
+	}
 	uintptr_t refCountVal = __sync_fetch_and_add(refCount, 0);
 	uintptr_t newVal = refCountVal;
-	bool isWeak;
+	uintptr_t updated;
 	bool shouldFree;
 	do {
 		refCountVal = newVal;
 		size_t realCount = refCountVal & refcount_mask;
-		// If the reference count is saturated or deallocating, don't decrement it.
-		if (realCount >= refcount_max)
+		// If the object is deallocating, don't decrement the reference count.
+		if (realCount == refcount_mask)
 		{
 			return NO;
 		}
-		realCount--;
-		isWeak = (refCountVal & weak_mask) == weak_mask;
-		shouldFree = realCount == -1;
-		realCount |= refCountVal & weak_mask;
-		uintptr_t updated = (uintptr_t)realCount;
-		newVal = __sync_val_compare_and_swap(refCount, refCountVal, updated);
-	} while (newVal != refCountVal);
-	
-	if (shouldFree)
-	{
-		if (isWeak)
+		// The stored count is one less than the number of references.
+		shouldFree = realCount < count;
+		// If some references are in the overflow table, then this may not be
+		// the last one.
+		if (shouldFree && (refCountVal & overflow_mask))
 		{
-			if (!objc_delete_weak_refs(obj))
-			{
-				return NO;
-			}
+			return releaseOverflowing(obj, count);
 		}
-		return YES;
-	}
-	return NO;
+		realCount = shouldFree ? refcount_mask : realCount - count;
+		realCount |= refCountVal & refcount_flags;
+		updated = (uintptr_t)realCount;
+		newVal = __sync_val_compare_and_swap(refCount, refCountVal, updated);
+	} while (newVal != refCountVal);
+
+	return shouldFree && finishReleasingLastReference(obj, updated);
+}
+
+extern "C" OBJC_PUBLIC BOOL objc_release_fast_no_destroy_np(id obj)
+{
+	return release_fast_no_destroy(obj, 1);
 }
 
 extern "C" OBJC_PUBLIC void objc_release_fast_np(id obj)
@@ -401,6 +1527,28 @@ static inline void release(id obj)
 	return ManualRetainReleaseMessage(obj, release, void(*)(id, SEL));
 }
 
+/**
+ * Releases an object `count` times, with a single update to the reference
+ * count for objects that use the fast reference count.
+ */
+static inline void releaseMany(id obj, uintptr_t count)
+{
+	if ((count > 1) && !isPersistentObject(obj) &&
+	    !objc_test_class_flag(obj->isa, objc_class_flag_is_block) &&
+	    objc_test_class_flag(obj->isa, objc_class_flag_fast_arc))
+	{
+		if (release_fast_no_destroy(obj, count))
+		{
+			[obj dealloc];
+		}
+		return;
+	}
+	while (count-- > 0)
+	{
+		release(obj);
+	}
+}
+
 static inline void initAutorelease(void)
 {
 	if (Nil == AutoreleasePool)
@@ -428,22 +1576,46 @@ static inline void initAutorelease(void)
 	}
 }
 
+/**
+ * Records an autorelease in the calling thread's statistics.
+ */
+static void recordAutorelease(id obj)
+{
+	struct arc_tls *tls = getARCThreadData();
+	if (NULL == tls)
+	{
+		return;
+	}
+	tls->autoreleaseCount++;
+	if (NULL == tls->autoreleasedClasses)
+	{
+		tls->autoreleasedClasses = new tsl::robin_map<Class, unsigned long>();
+	}
+	(*tls->autoreleasedClasses)[classForObject(obj)]++;
+}
+
 static inline id autorelease(id obj)
 {
 	//fprintf(stderr, "Autoreleasing %p\n", obj);
+	if (UNLIKELY(__atomic_load_n(&autoreleaseInstrumentation, __ATOMIC_RELAXED)))
+	{
+		recordAutorelease(obj);
+	}
 	if (useARCAutoreleasePool)
 	{
 		struct arc_tls *tls = getARCThreadData();
 		if (NULL != tls)
 		{
+			if (extendAutoreleaseRun(tls, obj))
+			{
+				return obj;
+			}
 			struct arc_autorelease_pool *pool = tls->pool;
 			if (NULL == pool || (pool->insert >= &pool->pool[POOL_SIZE]))
 			{
-				pool = new_zeroed<struct arc_autorelease_pool>();
-				pool->previous = tls->pool;
-				pool->insert = pool->pool;
-				tls->pool = pool;
+				pool = pushPoolPage(tls);
 			}
+			tls->runStart = pool->insert;
 			*pool->insert = obj;
 			pool->insert++;
 			return obj;
@@ -471,10 +1643,108 @@ extern "C" OBJC_PUBLIC unsigned long objc_arc_autorelease_count_np(void)
 	     NULL != pool ;
 	     pool = pool->previous)
 	{
-		count += (((intptr_t)pool->insert) - ((intptr_t)pool->pool)) / sizeof(id);
+		for (id *o = pool->pool ; o < pool->insert ; o++)
+		{
+			// The object at the start of a run has already been counted once.
+			count += isRunCount(pool, o) ? (uintptr_t)*o - 1 : 1;
+		}
 	}
 	return count;
 }
+extern "C" OBJC_PUBLIC unsigned objc_arc_set_autorelease_page_cache_limit_np(unsigned limit)
+{
+	return __atomic_exchange_n(&autoreleasePageCacheLimit, limit, __ATOMIC_RELAXED);
+}
+extern "C" OBJC_PUBLIC void objc_arc_autorelease_page_stats_np(unsigned long *allocated,
+                                                               unsigned long *reused,
+                                                               unsigned long *cached)
+{
+	struct arc_tls* tls = getARCThreadData();
+	if (NULL != allocated)
+	{
+		*allocated = tls ? tls->pagesAllocated : 0;
+	}
+	if (NULL != reused)
+	{
+		*reused = tls ? tls->pagesReused : 0;
+	}
+	if (NULL != cached)
+	{
+		*cached = tls ? tls->freePageCount : 0;
+	}
+}
+extern "C" OBJC_PUBLIC BOOL objc_arc_set_autorelease_instrumentation_np(BOOL enabled)
+{
+	return __atomic_exchange_n(&autoreleaseInstrumentation, enabled, __ATOMIC_RELAXED);
+}
+extern "C" OBJC_PUBLIC void objc_arc_autorelease_pool_stats_np(unsigned long *depth,
+                                                               unsigned long *pages,
+                                                               unsigned long *peakDepth,
+                                                               unsigned long *peakPages,
+                                                               unsigned long *autoreleases)
+{
+	struct arc_tls* tls = getARCThreadData();
+	if (NULL != depth)
+	{
+		*depth = tls ? tls->poolDepth : 0;
+	}
+	if (NULL != pages)
+	{
+		*pages = tls ? tls->poolPages : 0;
+	}
+	if (NULL != peakDepth)
+	{
+		*peakDepth = tls ? tls->peakPoolDepth : 0;
+	}
+	if (NULL != peakPages)
+	{
+		*peakPages = tls ? tls->peakPoolPages : 0;
+	}
+	if (NULL != autoreleases)
+	{
+		*autoreleases = tls ? tls->autoreleaseCount : 0;
+	}
+}
+extern "C" OBJC_PUBLIC void objc_arc_reset_autorelease_pool_stats_np(void)
+{
+	struct arc_tls* tls = getARCThreadData();
+	if (!tls) { return; }
+	tls->peakPoolDepth = tls->poolDepth;
+	tls->peakPoolPages = tls->poolPages;
+	tls->autoreleaseCount = 0;
+	if (NULL != tls->autoreleasedClasses)
+	{
+		tls->autoreleasedClasses->clear();
+	}
+}
+extern "C" OBJC_PUBLIC unsigned objc_arc_autoreleased_classes_np(Class *classes,
+                                                                 unsigned long *counts,
+                                                                 unsigned max)
+{
+	struct arc_tls* tls = getARCThreadData();
+	if (!tls || (NULL == tls->autoreleasedClasses)) { return 0; }
+	std::vector<std::pair<Class, unsigned long>> sorted(
+		tls->autoreleasedClasses->begin(), tls->autoreleasedClasses->end());
+	unsigned found = (sorted.size() < max) ? sorted.size() : max;
+	std::partial_sort(sorted.begin(), sorted.begin() + found, sorted.end(),
+		[](const std::pair<Class, unsigned long> &a,
+		   const std::pair<Class, unsigned long> &b)
+		{
+			return a.second > b.second;
+		});
+	for (unsigned i=0 ; i<found ; i++)
+	{
+		if (NULL != classes)
+		{
+			classes[i] = sorted[i].first;
+		}
+		if (NULL != counts)
+		{
+			counts[i] = sorted[i].second;
+		}
+	}
+	return found;
+}
 extern "C" OBJC_PUBLIC unsigned long objc_arc_autorelease_count_for_object_np(id obj)
 {
 	struct arc_tls* tls = getARCThreadData();
@@ -487,7 +1757,15 @@ extern "C" OBJC_PUBLIC unsigned long objc_arc_autorelease_count_for_object_np(id
 	{
 		for (id* o = pool->insert-1 ; o >= pool->pool ; o--)
 		{
-			if (*o == obj)
+			if (isRunCount(pool, o))
+			{
+				o--;
+				if (*o == obj)
+				{
+					count += (uintptr_t)o[1];
+				}
+			}
+			else if (*o == obj)
 			{
 				count++;
 			}
@@ -496,6 +1774,57 @@ extern "C" OBJC_PUBLIC unsigned long objc_arc_autorelease_count_for_object_np(id
 	return count;
 }
 
+/**
+ * Records that the calling thread has pushed an autorelease pool, for which
+ * objc_autoreleasePoolPush() returned `token`.  Returns the token.
+ */
+static void *recordPoolPush(struct arc_tls *tls, void *token)
+{
+	if (tls->poolDepth == tls->poolTokenCapacity)
+	{
+		unsigned long capacity = std::max(16UL, tls->poolTokenCapacity * 2);
+		void **tokens = static_cast<void**>(
+			realloc(tls->poolTokens, capacity * sizeof(void*)));
+		if (NULL == tokens)
+		{
+			return token;
+		}
+		tls->poolTokens = tokens;
+		tls->poolTokenCapacity = capacity;
+	}
+	tls->poolTokens[tls->poolDepth++] = token;
+	if (tls->poolDepth > tls->peakPoolDepth)
+	{
+		tls->peakPoolDepth = tls->poolDepth;
+	}
+	return token;
+}
+
+/**
+ * Records that the calling thread has popped the autorelease pool for which
+ * objc_autoreleasePoolPush() returned `token`.  Popping a pool also pops every
+ * pool pushed after it.  Pushes with nothing autoreleased between them return
+ * the same token, so this pops the innermost pool with this token, as a
+ * correctly nested pop would.  NULL pops every pool.  Unknown tokens don't pop
+ * anything.
+ */
+static void recordPoolPop(struct arc_tls *tls, void *token)
+{
+	if (NULL == token)
+	{
+		tls->poolDepth = 0;
+		return;
+	}
+	for (unsigned long depth=tls->poolDepth ; depth>0 ; depth--)
+	{
+		if (tls->poolTokens[depth-1] == token)
+		{
+			tls->poolDepth = depth - 1;
+			return;
+		}
+	}
+}
+
 extern "C" OBJC_PUBLIC void *objc_autoreleasePoolPush(void)
 {
 	initAutorelease();
@@ -512,22 +1841,22 @@ extern "C" OBJC_PUBLIC void *objc_autoreleasePoolPush(void)
 	{
 		if (NULL != tls)
 		{
+			tls->runStart = NULL;
 			struct arc_autorelease_pool *pool = tls->pool;
 			if (NULL == pool || (pool->insert >= &pool->pool[POOL_SIZE]))
 			{
-				pool = new_zeroed<struct arc_autorelease_pool>();
-				pool->previous = tls->pool;
-				pool->insert = pool->pool;
-				tls->pool = pool;
+				pool = pushPoolPage(tls);
 			}
 			// If there is no autorelease pool allocated for this thread, then
 			// we lazily allocate one the first time something is autoreleased.
-			return (NULL != tls->pool) ? tls->pool->insert : NULL;
+			return recordPoolPush(tls,
+				(NULL != tls->pool) ? tls->pool->insert : NULL);
 		}
 	}
 	initAutorelease();
 	if (0 == NewAutoreleasePool) { return NULL; }
-	return NewAutoreleasePool(AutoreleasePool, SELECTOR(new));
+	void *token = NewAutoreleasePool(AutoreleasePool, SELECTOR(new));
+	return (NULL != tls) ? recordPoolPush(tls, token) : token;
 }
 extern "C" OBJC_PUBLIC void objc_autoreleasePoolPop(void *pool)
 {
@@ -536,10 +1865,14 @@ extern "C" OBJC_PUBLIC void objc_autoreleasePoolPop(void *pool)
 		struct arc_tls* tls = getARCThreadData();
 		if (NULL != tls)
 		{
+			recordPoolPop(tls, pool);
 			if (NULL != tls->pool)
 			{
 				emptyPool(tls, pool);
 			}
+			mergePassedReferences(tls, tls->biasedTag);
+			// Popping a pool is a quiescent state for memory reclamation.
+			reclaim_quiescent_state();
 			return;
 		}
 	}
@@ -550,6 +1883,12 @@ extern "C" OBJC_PUBLIC void objc_autoreleasePoolPop(void *pool)
 		release(tls->returnRetained);
 		tls->returnRetained = nil;
 	}
+	if (tls)
+	{
+		recordPoolPop(tls, pool);
+		mergePassedReferences(tls, tls->biasedTag);
+	}
+	reclaim_quiescent_state();
 }
 
 extern "C" OBJC_PUBLIC id objc_autorelease(id obj)
@@ -576,6 +1915,45 @@ extern "C" OBJC_PUBLIC id objc_autoreleaseReturnValue(id obj)
 	return objc_autorelease(obj);
 }
 
+/**
+ * Removes one reference to `obj` from the top of the autorelease pool without
+ * releasing it.  Returns NO if `obj` was not the last object autoreleased.
+ */
+static inline BOOL removeAutoreleasedObject(struct arc_tls *tls, id obj)
+{
+	struct arc_autorelease_pool *pool = tls->pool;
+	if ((NULL == pool) || (pool->insert == pool->pool))
+	{
+		return NO;
+	}
+	id *top = pool->insert - 1;
+	if (isRunCount(pool, top))
+	{
+		if (top[-1] != obj)
+		{
+			return NO;
+		}
+		uintptr_t count = (uintptr_t)*top - 1;
+		if (count > 1)
+		{
+			*top = (id)count;
+		}
+		else
+		{
+			setRunCount(pool, top, false);
+			pool->insert--;
+		}
+		return YES;
+	}
+	if (*top != obj)
+	{
+		return NO;
+	}
+	pool->insert--;
+	tls->runStart = NULL;
+	return YES;
+}
+
 extern "C" OBJC_PUBLIC id objc_retainAutoreleasedReturnValue(id obj)
 {
 	// If the previous object was released  with objc_autoreleaseReturnValue()
@@ -592,10 +1970,8 @@ extern "C" OBJC_PUBLIC id objc_retainAutoreleasedReturnValue(id obj)
 		// If we're using our own autorelease pool, just pop the object from the top
 		if (useARCAutoreleasePool)
 		{
-			if ((NULL != tls->pool) &&
-			    (*(tls->pool->insert-1) == obj))
+			if (removeAutoreleasedObject(tls, obj))
 			{
-				tls->pool->insert--;
 				return obj;
 			}
 		}
@@ -626,24 +2002,170 @@ extern "C" OBJC_PUBLIC id objc_retainAutoreleaseReturnValue(id obj)
 }
 
 
-extern "C" OBJC_PUBLIC id objc_retainBlock(id b)
+extern "C" OBJC_PUBLIC id objc_retainBlock(id b)
+{
+	return static_cast<id>(_Block_copy(b));
+}
+
+extern "C" OBJC_PUBLIC void objc_release(id obj)
+{
+	if (nil == obj) { return; }
+	release(obj);
+}
+
+extern "C" OBJC_PUBLIC id objc_storeStrong(id *addr, id value)
+{
+	value = objc_retain(value);
+	id oldValue = *addr;
+	*addr = value;
+	objc_release(oldValue);
+	return value;
+}
+
+/**
+ * How instances of a class are retained and released.  The array functions
+ * look this up once for each run of objects of the same class.
+ */
+enum class RefCountKind
+{
+	/** Instances are never retained or released. */
+	Permanent,
+	/** Instances are blocks. */
+	Block,
+	/** Instances use the runtime's reference count. */
+	Fast,
+	/** Instances implement their own -retain and -release. */
+	Message
+};
+
+static inline RefCountKind refCountKind(Class cls)
+{
+	if (objc_test_class_flag(cls, objc_class_flag_permanent_instances))
+	{
+		return RefCountKind::Permanent;
+	}
+	if (UNLIKELY(objc_test_class_flag(cls, objc_class_flag_is_block)))
+	{
+		return RefCountKind::Block;
+	}
+	if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
+	{
+		return RefCountKind::Fast;
+	}
+	return RefCountKind::Message;
+}
+
+extern "C" OBJC_PUBLIC void objc_retainArray_np(id *objects, size_t count)
 {
-	return static_cast<id>(_Block_copy(b));
+	Class lastClass = Nil;
+	RefCountKind kind = RefCountKind::Permanent;
+	IMP retainIMP = nullptr;
+	for (size_t i=0 ; i<count ; i++)
+	{
+		id obj = objects[i];
+		if ((obj == nil) || isSmallObject(obj))
+		{
+			continue;
+		}
+		Class cls = obj->isa;
+		if (cls != lastClass)
+		{
+			lastClass = cls;
+			kind = refCountKind(cls);
+			retainIMP = nullptr;
+		}
+		switch (kind)
+		{
+			case RefCountKind::Permanent:
+				break;
+			case RefCountKind::Block:
+				objects[i] = Block_copy(obj);
+				break;
+			case RefCountKind::Fast:
+				retain_fast(obj, NO);
+				break;
+			case RefCountKind::Message:
+				if (retainIMP == nullptr)
+				{
+					retainIMP = objc_msg_lookup(obj, @selector(retain));
+				}
+				objects[i] = ((id(*)(id, SEL))retainIMP)(obj, @selector(retain));
+				break;
+		}
+	}
 }
 
-extern "C" OBJC_PUBLIC void objc_release(id obj)
+extern "C" OBJC_PUBLIC void objc_releaseArray_np(id *objects, size_t count)
 {
-	if (nil == obj) { return; }
-	release(obj);
+	Class lastClass = Nil;
+	RefCountKind kind = RefCountKind::Permanent;
+	IMP releaseIMP = nullptr;
+	size_t i = 0;
+	while (i < count)
+	{
+		id obj = objects[i];
+		// Adjacent copies of the same object are released together.
+		uintptr_t run = 1;
+		while ((i + run < count) && (objects[i + run] == obj))
+		{
+			run++;
+		}
+		i += run;
+		if ((obj == nil) || isSmallObject(obj))
+		{
+			continue;
+		}
+		Class cls = obj->isa;
+		if (cls != lastClass)
+		{
+			lastClass = cls;
+			kind = refCountKind(cls);
+			releaseIMP = nullptr;
+		}
+		switch (kind)
+		{
+			case RefCountKind::Permanent:
+				break;
+			case RefCountKind::Block:
+				while (run-- > 0)
+				{
+					release(obj);
+				}
+				break;
+			case RefCountKind::Fast:
+				if (release_fast_no_destroy(obj, run))
+				{
+					[obj dealloc];
+				}
+				break;
+			case RefCountKind::Message:
+				if (releaseIMP == nullptr)
+				{
+					releaseIMP = objc_msg_lookup(obj, @selector(release));
+				}
+				while (run-- > 0)
+				{
+					((void(*)(id, SEL))releaseIMP)(obj, @selector(release));
+				}
+				break;
+		}
+	}
 }
 
-extern "C" OBJC_PUBLIC id objc_storeStrong(id *addr, id value)
+extern "C" OBJC_PUBLIC void objc_storeStrongArray_np(id *dest, id *src, size_t count)
 {
-	value = objc_retain(value);
-	id oldValue = *addr;
-	*addr = value;
-	objc_release(oldValue);
-	return value;
+	// Keep the old values until all of the new ones have been retained, in
+	// case an object is in both arrays and only referenced from `dest`.
+	id buffer[64];
+	id *oldValues = (count <= 64) ? buffer : (id*)malloc(count * sizeof(id));
+	memcpy(oldValues, dest, count * sizeof(id));
+	memmove(dest, src, count * sizeof(id));
+	objc_retainArray_np(dest, count);
+	objc_releaseArray_np(oldValues, count);
+	if (oldValues != buffer)
+	{
+		free(oldValues);
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -654,12 +2176,47 @@ static int weakref_class;
 
 namespace {
 
+struct WeakRefShard;
+
+/**
+ * A weak reference record.  Records are allocated from their shard's pool and
+ * are never constructed: fresh pool memory is zeroed and the allocator sets
+ * the other fields.
+ */
 struct WeakRef
 {
-	void *isa = &weakref_class;
-	id obj = nullptr;
-	size_t weak_count = 1;
-	WeakRef(id o) : obj(o) {}
+	void *isa;
+	/**
+	 * The object, or nil once it has been deallocated.  While the record is
+	 * on its shard's free list, this is the next free record.
+	 */
+	id obj;
+	size_t weak_count;
+	/**
+	 * The shard that this record is in.  This is fixed when the record is
+	 * created, because `obj` is cleared when the object is deallocated.
+	 */
+	WeakRefShard *shard;
+	/**
+	 * The number of threads that are following this record in the lock-free
+	 * path of objc_loadWeakRetained().  Threads that clear `obj` or recycle the
+	 * record wait for this to drop to zero.  Preserved when the record is
+	 * recycled, because a reader may still be about to decrement it.
+	 */
+	unsigned readers;
+};
+
+/**
+ * Links free weak reference records through their `obj` field, so that `isa`
+ * and `readers` remain valid for lock-free readers that follow a stale
+ * pointer to a free record.
+ */
+struct WeakRefFreeListLink
+{
+	static WeakRef *&next(WeakRef *ref)
+	{
+		return reinterpret_cast<WeakRef*&>(ref->obj);
+	}
 };
 
 template<typename T>
@@ -700,13 +2257,73 @@ using weak_ref_table = tsl::robin_pg_map<const void*,
                                          std::equal_to<const void*>,
                                          malloc_allocator<std::pair<const void*, WeakRef*>>>;
 
-weak_ref_table &weakRefs()
+using weak_pin_table = tsl::robin_map<const void*,
+                                      unsigned,
+                                      std::hash<const void*>,
+                                      std::equal_to<const void*>,
+                                      malloc_allocator<std::pair<const void*, unsigned>>>;
+
+/**
+ * The number of shards in the weak reference table.  Must be a power of two.
+ */
+static const size_t weak_ref_shard_count = 64;
+
+/**
+ * The number of locks for weak variables.  Must be a power of two.
+ */
+static const size_t weak_variable_lock_count = 256;
+
+/**
+ * One shard of the weak reference table.  Each object's weak reference record
+ * is in the shard selected by the object's address.  The shard's lock protects
+ * its table, the records in it, and the deallocation of objects that have
+ * weak references in it.  Shards are padded to avoid false sharing.
+ */
+struct alignas(64) WeakRefShard
+{
+	RecursiveThinLock lock;
+	weak_ref_table table{16};
+	/**
+	 * The records for this shard.  Records are never returned to the system,
+	 * so that the lock-free path of objc_loadWeakRetained() can safely follow
+	 * a stale pointer to one.
+	 */
+	Pool<WeakRef, 4096 / sizeof(WeakRef), WeakRefFreeListLink> records;
+	/**
+	 * The number of threads that are sending messages to each object in this
+	 * shard to load it from a weak reference, with no locks held.
+	 * objc_delete_weak_refs() waits for an object's entry to be removed.
+	 */
+	weak_pin_table pinned;
+};
+
+/**
+ * Returns the array of shards of the weak reference table.
+ */
+WeakRefShard *weakRefShards()
+{
+	static WeakRefShard shards[weak_ref_shard_count];
+	return shards;
+}
+
+/**
+ * Returns the shard of the weak reference table for an object.
+ */
+WeakRefShard &weakRefShard(const void *obj)
 {
-	static weak_ref_table w{128};
-	return w;
+	return weakRefShards()[hash_for_pointer(obj) & (weak_ref_shard_count - 1)];
 }
 
-mutex_t weakRefLock;
+/**
+ * Returns the lock for a weak variable.  This serialises accesses to the
+ * variable, and keeps the record that it refers to alive, so that its shard
+ * can be found.  It must be acquired before any shard locks.
+ */
+RecursiveThinLock &weakVariableLock(id *addr)
+{
+	static RecursiveThinLock locks[weak_variable_lock_count];
+	return locks[hash_for_pointer(addr) & (weak_variable_lock_count - 1)];
+}
 
 }
 
@@ -721,7 +2338,24 @@ static const struct Block_callbacks_RR blocks_runtime_callbacks = {
 
 PRIVATE extern "C" void init_arc(void)
 {
-	INIT_LOCK(weakRefLock);
+	if (const char *limit = getenv("LIBOBJC_AUTORELEASE_PAGE_CACHE"))
+	{
+		autoreleasePageCacheLimit = strtoul(limit, NULL, 10);
+	}
+#ifdef TEST_HOOKS
+	if (const char *limit = getenv("LIBOBJC_REFCOUNT_INLINE_MAX"))
+	{
+		size_t max = strtoul(limit, NULL, 10);
+		if ((max > 0) && (max < refcount_max))
+		{
+			refcount_inline_max = max;
+		}
+	}
+#endif
+	if (getenv("LIBOBJC_AUTORELEASE_INSTRUMENTATION") != NULL)
+	{
+		autoreleaseInstrumentation = YES;
+	}
 #ifdef arc_tls_store
 	ARCThreadKey = arc_tls_key_create((arc_cleanup_function_t)cleanupPools);
 #endif
@@ -757,25 +2391,96 @@ static inline BOOL loadWeakPointer(id *addr, id *obj, WeakRef **ref)
 	return NO;
 }
 
+/**
+ * Returns the weak reference record that the weak variable at `addr` refers
+ * to, or NULL if it contains nil or a strong reference.  The caller must hold
+ * the lock for the variable.
+ */
+static inline WeakRef *weakRefForVariable(id *addr)
+{
+	id value = *addr;
+	if ((value != nil) && (classForObject(value) == (Class)&weakref_class))
+	{
+		return (WeakRef*)value;
+	}
+	return NULL;
+}
+
+/**
+ * Returns the lock for the shard that contains the weak reference record for
+ * `obj`, or that contains `ref` if it is not NULL.
+ */
+static inline RecursiveThinLock *weakRefShardLock(id obj, WeakRef *ref)
+{
+	return &((NULL != ref) ? *ref->shard : weakRefShard(obj)).lock;
+}
+
+/**
+ * Stores to a weak variable.  Stores that stop a variable from referring to a
+ * weak reference record must be sequentially consistent with the loads in the
+ * lock-free path of objc_loadWeakRetained().
+ */
+static inline void setWeakVariable(id *addr, id value)
+{
+	__atomic_store_n(addr, value, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Waits until no thread is following `ref` in the lock-free path of
+ * objc_loadWeakRetained().  Readers do not block, so this should be brief.
+ */
+static inline void waitForWeakRefReaders(WeakRef *ref)
+{
+	while (__atomic_load_n(&ref->readers, __ATOMIC_SEQ_CST) != 0)
+	{
+		std::this_thread::yield();
+	}
+}
+
+/**
+ * Returns a new weak reference record for `obj` from `shard`'s pool.  The
+ * caller must hold the shard's lock.
+ */
+static inline WeakRef *allocWeakRef(WeakRefShard &shard, id obj)
+{
+	WeakRef *ref = shard.records.allocate();
+	ref->isa = &weakref_class;
+	ref->weak_count = 1;
+	ref->shard = &shard;
+	__atomic_store_n(&ref->obj, obj, __ATOMIC_RELAXED);
+	return ref;
+}
+
+/**
+ * Drops a reference to a weak reference record, recycling it if this was the
+ * last one.  The caller must hold the lock for the record's shard and must
+ * already have removed the reference from the weak variable.
+ */
 __attribute__((always_inline))
 static inline BOOL weakRefRelease(WeakRef *ref)
 {
 	ref->weak_count--;
 	if (ref->weak_count == 0)
 	{
-		weakRefs().erase(ref->obj);
-		delete ref;
+		WeakRefShard *shard = ref->shard;
+		shard->table.erase(ref->obj);
+		waitForWeakRefReaders(ref);
+		shard->records.deallocate(ref);
 		return YES;
 	}
 	return NO;
 }
 
 extern "C" void* block_load_weak(void *block);
+extern "C" bool block_set_weakly_referenced(void *block);
+extern "C" bool block_is_weakly_referenced(void *block);
 
 static BOOL setObjectHasWeakRefs(id obj)
 {
 	BOOL isGlobalObject = isPersistentObject(obj);
-	Class cls = isGlobalObject ? Nil : obj->isa;
+	// An object may be given a hidden class after it is weakly referenced, so
+	// record the weak reference in the real class.
+	Class cls = isGlobalObject ? Nil : realClass(obj->isa);
 	if (obj && cls && objc_test_class_flag(cls, objc_class_flag_fast_arc))
 	{
 		uintptr_t *refCount = ((uintptr_t*)obj) - 1;
@@ -801,25 +2506,57 @@ static BOOL setObjectHasWeakRefs(id obj)
 			// Set the flag in the reference count to indicate that a weak
 			// reference has been taken.
 			//
-			// We currently hold the weak ref lock, so another thread
+			// We currently hold the weak ref shard lock, so another thread
 			// racing to deallocate this object will have to wait to do so
 			// if we manage to do the reference count update first.  This
 			// shouldn't be possible, because `obj` should be a strong
 			// reference and so it shouldn't be possible to deallocate it
 			// while we're assigning it.
-			uintptr_t updated = ((uintptr_t)realCount | weak_mask);
+			uintptr_t updated = refCountVal | weak_mask;
 			newVal = __sync_val_compare_and_swap(refCount, refCountVal, updated);
 		} while (newVal != refCountVal);
 	}
+	else if (obj && cls)
+	{
+		// Other objects record that they may have weak references in their
+		// class, unless they are blocks that can record it themselves.
+		if (!objc_test_class_flag(cls, objc_class_flag_is_block) ||
+		    !block_set_weakly_referenced(obj))
+		{
+			if (!objc_test_class_flag(cls, objc_class_flag_weakly_referenced))
+			{
+				objc_set_class_flag(cls, objc_class_flag_weakly_referenced);
+			}
+		}
+	}
 	return isGlobalObject;
 }
 
+/**
+ * Returns whether an object that does not use the fast reference count may
+ * have weak references.
+ */
+static inline BOOL mayHaveWeakRefs(id obj, Class cls)
+{
+	if (objc_test_class_flag(cls, objc_class_flag_weakly_referenced))
+	{
+		return YES;
+	}
+	return objc_test_class_flag(cls, objc_class_flag_is_block) &&
+	       block_is_weakly_referenced(obj);
+}
+
+/**
+ * Adds a weak reference to `obj`, creating its weak reference record if
+ * necessary.  The caller must hold the lock for the object's shard.
+ */
 WeakRef *incrementWeakRefCount(id obj)
 {
-	WeakRef *&ref = weakRefs()[obj];
+	WeakRefShard &shard = weakRefShard(obj);
+	WeakRef *&ref = shard.table[obj];
 	if (ref == nullptr)
 	{
-		ref = new WeakRef(obj);
+		ref = allocWeakRef(shard, obj);
 	}
 	else
 	{
@@ -831,7 +2568,10 @@ WeakRef *incrementWeakRefCount(id obj)
 
 extern "C" OBJC_PUBLIC id objc_storeWeak(id *addr, id obj)
 {
-	LOCK_FOR_SCOPE(&weakRefLock);
+	std::lock_guard<RecursiveThinLock> variableLock{weakVariableLock(addr)};
+	// Lock the shards for the old record and the new object.
+	DoubleLockGuard shardLocks(weakRefShardLock(obj, weakRefForVariable(addr)),
+	                           weakRefShardLock(obj, NULL));
 	WeakRef *oldRef;
 	id old;
 	loadWeakPointer(addr, &old, &oldRef);
@@ -842,51 +2582,79 @@ extern "C" OBJC_PUBLIC id objc_storeWeak(id *addr, id obj)
 		return obj;
 	}
 	BOOL isGlobalObject = setObjectHasWeakRefs(obj);
+	// If we're storing nil, then just write a null pointer.  If this is a
+	// global object, it's never deallocated, so secretly make this a strong
+	// reference.
+	id value = obj;
+	if ((nil != obj) && !isGlobalObject)
+	{
+		Class cls = classForObject(obj);
+		if (UNLIKELY(objc_test_class_flag(cls, objc_class_flag_is_block)))
+		{
+			// Check whether the block is being deallocated and store nil if so
+			if (_Block_isDeallocating(obj))
+			{
+				obj = nil;
+			}
+		}
+		else if (object_getRetainCount_np(obj) == 0)
+		{
+			// If the object is being deallocated store nil.
+			obj = nil;
+		}
+		value = (nil == obj) ? nil : (id)incrementWeakRefCount(obj);
+	}
+	setWeakVariable(addr, value);
 	// If we old ref exists, decrement its reference count.  This may also
-	// delete the weak reference control block.
+	// recycle the weak reference control block, so must happen after the
+	// variable no longer refers to it.
 	if (oldRef != NULL)
 	{
 		weakRefRelease(oldRef);
 	}
-	// If we're storing nil, then just write a null pointer.
-	if (nil == obj)
-	{
-		*addr = obj;
-		return nil;
-	}
-	if (isGlobalObject)
+	return obj;
+}
+
+/**
+ * Drops a pin on `obj`, which was added with its shard's lock held by a
+ * thread that was about to send messages to it to load it from a weak
+ * reference.
+ */
+static void unpinWeakLoad(WeakRefShard &shard, id obj)
+{
+	std::lock_guard<RecursiveThinLock> lock{shard.lock};
+	auto pin = shard.pinned.find(obj);
+	assert(pin != shard.pinned.end());
+	if (--pin.value() == 0)
 	{
-		// If this is a global object, it's never deallocated, so secretly make
-		// this a strong reference.
-		*addr = obj;
-		return obj;
+		shard.pinned.erase(pin);
 	}
-	Class cls = classForObject(obj);
-	if (UNLIKELY(objc_test_class_flag(cls, objc_class_flag_is_block)))
+}
+
+/**
+ * Waits until no thread has `obj` pinned.  Those threads are running
+ * arbitrary code, which may need the shard lock, so this must be called
+ * without holding it.
+ */
+static void waitForWeakLoadPins(WeakRefShard &shard, id obj)
+{
+	for (;;)
 	{
-		// Check whether the block is being deallocated and return nil if so
-		if (_Block_isDeallocating(obj)) {
-			*addr = nil;
-			return nil;
+		{
+			std::lock_guard<RecursiveThinLock> lock{shard.lock};
+			if (shard.pinned.find(obj) == shard.pinned.end())
+			{
+				return;
+			}
 		}
+		std::this_thread::yield();
 	}
-	else if (object_getRetainCount_np(obj) == 0)
-	{
-		// If the object is being deallocated return nil.
-		*addr = nil;
-		return nil;
-	}
-	if (nil != obj)
-	{
-		*addr = (id)incrementWeakRefCount(obj);
-	}
-	return obj;
 }
 
 extern "C" OBJC_PUBLIC BOOL objc_delete_weak_refs(id obj)
 {
-	LOCK_FOR_SCOPE(&weakRefLock);
-	if (objc_test_class_flag(classForObject(obj), objc_class_flag_fast_arc))
+	Class cls = realClass(classForObject(obj));
+	if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
 	{
 		// Don't proceed if the object isn't deallocating.
 		uintptr_t *refCount = ((uintptr_t*)obj) - 1;
@@ -896,80 +2664,175 @@ extern "C" OBJC_PUBLIC BOOL objc_delete_weak_refs(id obj)
 		{
 			return NO;
 		}
+		// The weak flag can't be set once the object is deallocating, so if
+		// it isn't set then there is nothing to clear.
+		if ((refCountVal & weak_mask) != weak_mask)
+		{
+			return YES;
+		}
+	}
+	else if (!mayHaveWeakRefs(obj, cls))
+	{
+		return YES;
+	}
+	WeakRefShard &shard = weakRefShard(obj);
+	{
+		std::lock_guard<RecursiveThinLock> lock{shard.lock};
+		auto &table = shard.table;
+		auto old = table.find(obj);
+		if (old != table.end())
+		{
+			WeakRef *oldRef = old->second;
+			// The address of obj is likely to be reused, so remove it from
+			// the table so that we don't accidentally alias weak
+			// references
+			table.erase(old);
+			// Zero the object pointer.  This prevents any other weak
+			// accesses from loading from this.  This must be done after
+			// removing the ref from the table, because the compare operation
+			// tests the obj field.
+			__atomic_store_n(&oldRef->obj, nil, __ATOMIC_SEQ_CST);
+			// Lock-free readers may have loaded the object before it was
+			// cleared, so wait for them before it is freed.
+			waitForWeakRefReaders(oldRef);
+			// If the weak reference count is zero, then we should have
+			// already removed this.
+			assert(oldRef->weak_count > 0);
+		}
 	}
-	auto &table = weakRefs();
-	auto old = table.find(obj);
-	if (old != table.end())
-	{
-		WeakRef *oldRef = old->second;
-		// The address of obj is likely to be reused, so remove it from
-		// the table so that we don't accidentally alias weak
-		// references
-		table.erase(old);
-		// Zero the object pointer.  This prevents any other weak
-		// accesses from loading from this.  This must be done after
-		// removing the ref from the table, because the compare operation
-		// tests the obj field.
-		oldRef->obj = nil;
-		// If the weak reference count is zero, then we should have
-		// already removed this.
-		assert(oldRef->weak_count > 0);
+	// Objects that don't use the fast reference count may have been pinned by
+	// threads that loaded them before the weak references were cleared and
+	// are now sending them messages.  No more can be pinned.
+	if (!objc_test_class_flag(cls, objc_class_flag_fast_arc))
+	{
+		waitForWeakLoadPins(shard, obj);
 	}
 	return YES;
 }
 
-extern "C" OBJC_PUBLIC id objc_loadWeakRetained(id* addr)
+/**
+ * Loads a strong reference from a weak variable without acquiring any locks.
+ * Returns NO if the caller must use the locked path instead, because the
+ * object does not use the fast reference count or is being deallocated.
+ */
+static inline BOOL loadWeakRetainedFast(id *addr, id *result)
 {
-	LOCK_FOR_SCOPE(&weakRefLock);
-	id obj;
-	WeakRef *ref;
-	// If this is really a strong reference (nil, or an non-deallocatable
-	// object), just return it.
-	if (!loadWeakPointer(addr, &obj, &ref))
+	id value = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+	if ((value == nil) || (classForObject(value) != (Class)&weakref_class))
 	{
-		return obj;
+		*result = value;
+		return YES;
 	}
-	// The object cannot be deallocated while we hold the lock (release
-	// will acquire the lock before attempting to deallocate)
-	if (obj == nil)
+	WeakRef *ref = (WeakRef*)value;
+	// Don't bother with records whose object is already gone.  Records are
+	// never freed, so this is safe even if the record is being recycled.
+	if (__atomic_load_n(&ref->obj, __ATOMIC_RELAXED) == nil)
 	{
-		// If the object is destroyed, drop this reference to the WeakRef
-		// struct.
-		if (ref != NULL)
-		{
-			weakRefRelease(ref);
-			*addr = nil;
-		}
-		return nil;
+		return NO;
 	}
-	Class cls = classForObject(obj);
-	if (objc_test_class_flag(cls, objc_class_flag_permanent_instances))
+	// Once we have registered as a reader, the record can't be recycled and
+	// its object can't be freed until we are done.  If the variable still
+	// refers to the record, then the record hasn't been recycled yet.
+	__atomic_fetch_add(&ref->readers, 1, __ATOMIC_SEQ_CST);
+	BOOL loaded = NO;
+	if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == value)
 	{
-		return obj;
+		id obj = __atomic_load_n(&ref->obj, __ATOMIC_SEQ_CST);
+		Class cls = (obj == nil) ? Nil : realClass(classForObject(obj));
+		if ((cls != Nil) &&
+		    !objc_test_class_flag(cls, objc_class_flag_is_block) &&
+		    objc_test_class_flag(cls, objc_class_flag_fast_arc))
+		{
+			// This fails if the object has started deallocating.
+			*result = retain_fast(obj, YES);
+			loaded = (*result != nil);
+		}
 	}
-	else if (UNLIKELY(objc_test_class_flag(cls, objc_class_flag_is_block)))
+	__atomic_fetch_sub(&ref->readers, 1, __ATOMIC_RELEASE);
+	return loaded;
+}
+
+/**
+ * Loads a strong reference from a weak variable with locks held, so that the
+ * object can't be deallocated concurrently.
+ */
+static id loadWeakRetainedLocked(id* addr)
+{
+	id obj;
+	WeakRefShard *shard;
 	{
-		obj = static_cast<id>(block_load_weak(obj));
+		std::lock_guard<RecursiveThinLock> variableLock{weakVariableLock(addr)};
+		WeakRef *ref = weakRefForVariable(addr);
+		// If this is really a strong reference (nil, or an non-deallocatable
+		// object), just return it.
+		if (NULL == ref)
+		{
+			return *addr;
+		}
+		shard = ref->shard;
+		std::lock_guard<RecursiveThinLock> shardLock{shard->lock};
+		obj = ref->obj;
+		// The object cannot be deallocated while we hold the shard lock
+		// (release will acquire the lock before attempting to deallocate)
 		if (obj == nil)
 		{
+			// If the object is destroyed, drop this reference to the WeakRef
+			// struct.
+			setWeakVariable(addr, nil);
+			weakRefRelease(ref);
 			return nil;
 		}
-		// This is a defeasible retain operation that protects against another thread concurrently
-		// starting to deallocate the block.
-		if (_Block_tryRetain(obj))
+		// Hidden classes don't have the flags of the class that they hide.
+		Class cls = realClass(classForObject(obj));
+		if (objc_test_class_flag(cls, objc_class_flag_permanent_instances))
 		{
 			return obj;
 		}
-		return nil;
-
+		else if (UNLIKELY(objc_test_class_flag(cls, objc_class_flag_is_block)))
+		{
+			obj = static_cast<id>(block_load_weak(obj));
+			if (obj == nil)
+			{
+				return nil;
+			}
+			// This is a defeasible retain operation that protects against
+			// another thread concurrently starting to deallocate the block.
+			if (_Block_tryRetain(obj))
+			{
+				return obj;
+			}
+			return nil;
+		}
+		else if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
+		{
+			// This fails if the object has started deallocating, and never
+			// sends a message.
+			return retain_fast(obj, YES);
+		}
+		// Sending messages may run arbitrary code, including code that uses
+		// other weak variables, so it can't be done with these locks held.
+		// Pin the object instead, so that objc_delete_weak_refs() waits for
+		// us before the object can be freed.
+		shard->pinned[obj]++;
 	}
-	else if (!objc_test_class_flag(cls, objc_class_flag_fast_arc))
+	id loaded = _objc_weak_load(obj);
+	// _objc_weak_load() can return nil
+	if (loaded != nil)
 	{
-		obj = _objc_weak_load(obj);
+		loaded = retain(loaded, YES);
 	}
-	// _objc_weak_load() can return nil
-	if (obj == nil) { return nil; }
-	return retain(obj, YES);
+	unpinWeakLoad(*shard, obj);
+	return loaded;
+}
+
+extern "C" OBJC_PUBLIC id objc_loadWeakRetained(id* addr)
+{
+	id obj;
+	if (loadWeakRetainedFast(addr, &obj))
+	{
+		return obj;
+	}
+	return loadWeakRetainedLocked(addr);
 }
 
 extern "C" OBJC_PUBLIC id objc_loadWeak(id* object)
@@ -983,13 +2846,12 @@ extern "C" OBJC_PUBLIC void objc_copyWeak(id *dest, id *src)
 	// `src` is a valid pointer to a __weak pointer or nil.
 	// `dest` is a valid pointer to uninitialised memory.
 	// After this operation, `dest` should contain whatever `src` contained.
-	LOCK_FOR_SCOPE(&weakRefLock);
-	id obj;
-	WeakRef *srcRef;
-	loadWeakPointer(src, &obj, &srcRef);
+	std::lock_guard<RecursiveThinLock> variableLock{weakVariableLock(src)};
+	WeakRef *srcRef = weakRefForVariable(src);
 	*dest = *src;
 	if (srcRef)
 	{
+		std::lock_guard<RecursiveThinLock> shardLock{srcRef->shard->lock};
 		srcRef->weak_count++;
 	}
 }
@@ -1002,25 +2864,23 @@ extern "C" OBJC_PUBLIC void objc_moveWeak(id *dest, id *src)
 	// This operation moves from *src to *dest and must be atomic with respect
 	// to other stores to *src via `objc_storeWeak`.
 	//
-	// Acquire the lock so that we guarantee the atomicity.  We could probably
-	// optimise this by doing an atomic exchange of `*src` with `nil` and
-	// storing the result in `dest`, but it's probably not worth it unless weak
-	// references are a bottleneck.
-	LOCK_FOR_SCOPE(&weakRefLock);
-	*dest = *src;
-	*src = nil;
+	// Acquire the variable locks so that we guarantee the atomicity.  The
+	// record's weak count does not change, so its shard need not be locked.
+	DoubleLockGuard variableLocks(&weakVariableLock(src), &weakVariableLock(dest));
+	setWeakVariable(dest, *src);
+	setWeakVariable(src, nil);
 }
 
 extern "C" OBJC_PUBLIC void objc_destroyWeak(id* obj)
 {
-	LOCK_FOR_SCOPE(&weakRefLock);
-	WeakRef *oldRef;
-	id old;
-	loadWeakPointer(obj, &old, &oldRef);
+	std::lock_guard<RecursiveThinLock> variableLock{weakVariableLock(obj)};
+	WeakRef *oldRef = weakRefForVariable(obj);
 	// If the old ref exists, decrement its reference count.  This may also
-	// delete the weak reference control block.
+	// recycle the weak reference control block.
 	if (oldRef != NULL)
 	{
+		std::lock_guard<RecursiveThinLock> shardLock{oldRef->shard->lock};
+		setWeakVariable(obj, nil);
 		weakRefRelease(oldRef);
 	}
 }
@@ -1032,7 +2892,8 @@ extern "C" OBJC_PUBLIC id objc_initWeak(id *addr, id obj)
 		*addr = nil;
 		return nil;
 	}
-	LOCK_FOR_SCOPE(&weakRefLock);
+	// `addr` is uninitialised, so no other thread can be accessing it.
+	std::lock_guard<RecursiveThinLock> shardLock{weakRefShard(obj).lock};
 	BOOL isGlobalObject = setObjectHasWeakRefs(obj);
 	if (isGlobalObject)
 	{
@@ -1049,7 +2910,29 @@ extern "C" OBJC_PUBLIC id objc_initWeak(id *addr, id obj)
 	}
 	if (nil != obj)
 	{
-		*(WeakRef**)addr = incrementWeakRefCount(obj);
+		setWeakVariable(addr, (id)incrementWeakRefCount(obj));
 	}
 	return obj;
 }
+
+extern "C" OBJC_PUBLIC void objc_arc_weak_ref_stats_np(unsigned long *live,
+                                                       unsigned long *peak)
+{
+	unsigned long liveCount = 0;
+	unsigned long peakCount = 0;
+	WeakRefShard *shards = weakRefShards();
+	for (size_t i=0 ; i<weak_ref_shard_count ; i++)
+	{
+		std::lock_guard<RecursiveThinLock> shardLock{shards[i].lock};
+		liveCount += shards[i].records.liveCount();
+		peakCount += shards[i].records.peakCount();
+	}
+	if (NULL != live)
+	{
+		*live = liveCount;
+	}
+	if (NULL != peak)
+	{
+		*peak = peakCount;
+	}
+}
@@ -2,23 +2,43 @@
 #define DTABLE_OFFSET  64
 #define SMALLOBJ_BITS  3
 #define SHIFT_OFFSET   0
-#define DATA_OFFSET    8
+#define CACHE_OFFSET   8
+#define DATA_OFFSET    16
 #define SLOT_OFFSET    0
+#define COMPACT_MASK_OFFSET     4
+#define COMPACT_BASE_OFFSET     16
+#define COMPACT_ENTRIES_OFFSET  32
+#define SUPER_CLASS_OFFSET      8
 #elif defined(_WIN64)
 // long is 32 bits on Win64, so struct objc_class is smaller.  All other offsets are the same.
 #define DTABLE_OFFSET  56
 #define SMALLOBJ_BITS  3
 #define SHIFT_OFFSET   0
-#define DATA_OFFSET    8
+#define CACHE_OFFSET   8
+#define DATA_OFFSET    16
 #define SLOT_OFFSET    0
+#define COMPACT_MASK_OFFSET     4
+#define COMPACT_BASE_OFFSET     16
+#define COMPACT_ENTRIES_OFFSET  32
+#define SUPER_CLASS_OFFSET      8
 #else
 #define DTABLE_OFFSET  32
 #define SMALLOBJ_BITS  1
 #define SHIFT_OFFSET   0
-#define DATA_OFFSET    8
+#define CACHE_OFFSET   8
+#define DATA_OFFSET    12
 #define SLOT_OFFSET    0
+#define COMPACT_MASK_OFFSET     4
+#define COMPACT_BASE_OFFSET     12
+#define COMPACT_ENTRIES_OFFSET  20
+#define SUPER_CLASS_OFFSET      4
 #endif
 #define SMALLOBJ_MASK  ((1<<SMALLOBJ_BITS) - 1)
+#define CACHE_MASK_OFFSET       0
+#define CACHE_ENTRIES_OFFSET    8
+// Value stored in the shift field of a compact dtable.  Sparse arrays only use
+// multiples of 8.
+#define COMPACT_DTABLE_SHIFT 1
 
 // Page size configuration
 #if defined(__powerpc64__)
@@ -0,0 +1,41 @@
+#ifndef __OBJC_ASSOCIATE_H_INCLUDED__
+#define __OBJC_ASSOCIATE_H_INCLUDED__
+#include "objc/runtime.h"
+#include "visibility.h"
+
+/**
+ * Associated objects are normally stored in a hidden class that is created
+ * for each object.  When the side table is enabled with
+ * objc_setAssociationSideTable_np(), objects that use the runtime's reference
+ * count store them in a table keyed by the object's address instead, and set
+ * a flag in their reference count so that deallocation only needs to look in
+ * the table for objects that have used it.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sets the flag indicating that `obj` has associations in the side table and
+ * stores whether it was already set in `wasMarked`.  Returns NO, without
+ * modifying `wasMarked`, if the object does not use the runtime's reference
+ * count and so can't use the side table.
+ */
+PRIVATE BOOL arc_mark_has_associations(id obj, BOOL *wasMarked);
+
+/**
+ * Returns whether `obj` may have associations in the side table.
+ */
+PRIVATE BOOL arc_has_associations(id obj);
+
+/**
+ * Releases and removes any associations that `obj` has in the side table.
+ * Called when the object is destroyed.
+ */
+PRIVATE void remove_side_table_associations(id obj);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // __OBJC_ASSOCIATE_H_INCLUDED__
@@ -12,6 +12,9 @@
 #include "lock.h"
 #include "gc_ops.h"
 #include "helpers.hh"
+#include "associate.h"
+#include <mutex>
+#include <tsl/robin_map.h>
 
 /**
  * A single associative reference.  Contains the key, value, and association
@@ -38,22 +41,62 @@ struct reference
 #define REFERENCE_LIST_SIZE 10
 
 /**
- * Linked list of references associated with an object.  We assume that there
- * won't be very many, so we don't bother with a proper hash table, and just
- * iterate over a list.
+ * Open-addressed hash table of the references in a reference list, which is
+ * created once the list needs more than one group of references.  It is read
+ * without any locks, so it is never modified except to fill empty slots, and
+ * is kept until the object is deallocated when it is replaced.
+ */
+struct reference_index
+{
+	/**
+	 * The next index in the list's chain of replaced indexes.
+	 */
+	struct reference_index *next;
+	/**
+	 * The number of slots.  Always a power of two and at least twice the
+	 * number of slots in use, so that lookups always find an empty slot.
+	 */
+	size_t capacity;
+	/**
+	 * The number of slots in use.
+	 */
+	size_t count;
+	/**
+	 * Pointers to references, or NULL for empty slots.
+	 */
+	struct reference *slots[];
+};
+
+/**
+ * Linked list of references associated with an object.  Most objects have
+ * only a few, which are found by iterating over the list.  Objects with more
+ * than fit in one group also have an index.
  */
 struct reference_list
 {
 	/**
-	 * Next group of references.  This is only ever used if we have more than
-	 * 10 references associated with an object, which seems highly unlikely.
+	 * Next group of references.  This is only used if we have more than 10
+	 * references associated with an object.
 	 */
 	struct reference_list *next;
 	/**
-	 * Mutex.  Only set for the first reference list in a chain.  Used for
-	 * @syncronize().
+	 * Index of the references in all groups, or NULL if there is only one
+	 * group.  Only set for the first reference list in a chain.
+	 */
+	struct reference_index *index;
+	/**
+	 * Indexes that have been replaced, which other threads may still be
+	 * reading.  Freed when the object is deallocated.  Only set for the first
+	 * reference list in a chain.
+	 */
+	struct reference_index *replaced;
+	/**
+	 * The number of references in the chain that have been used since it was
+	 * last cleaned up.  References are used in order, so this is also the
+	 * position of the first free reference.  Only set for the first reference
+	 * list in a chain.
 	 */
-	mutex_t lock;
+	size_t count;
 	/**
 	 * Array of references.
 	 */
@@ -69,26 +112,76 @@ static BOOL isAtomic(uintptr_t policy)
 	return (policy & OBJC_ASSOCIATION_ATOMIC) == OBJC_ASSOCIATION_ATOMIC;
 }
 
+static inline size_t referenceHash(const void *key)
+{
+	// Keys are often pointers to adjacent static variables, or small
+	// integers, so mix all of the bits.
+	uintptr_t hash = (uintptr_t)key * (uintptr_t)0x9E3779B97F4A7C15ULL;
+	return hash ^ (hash >> (sizeof(uintptr_t) * 4));
+}
+
 static struct reference* findReference(struct reference_list *list, const void *key)
 {
+	struct reference_index *index = __atomic_load_n(&list->index, __ATOMIC_ACQUIRE);
+	if ((NULL != index) && (0 != key))
+	{
+		size_t mask = index->capacity - 1;
+		for (size_t i=referenceHash(key) ; ; i++)
+		{
+			struct reference *r =
+				__atomic_load_n(&index->slots[i & mask], __ATOMIC_ACQUIRE);
+			if (NULL == r)
+			{
+				return NULL;
+			}
+			if (__atomic_load_n(&r->key, __ATOMIC_RELAXED) == key)
+			{
+				return r;
+			}
+		}
+	}
+	// Readers don't hold the list lock, so keys and groups may be added
+	// concurrently.
 	while (list)
 	{
 		for (int i=0 ; i<REFERENCE_LIST_SIZE ; i++)
 		{
-			if (list->list[i].key == key)
+			if (__atomic_load_n(&list->list[i].key, __ATOMIC_ACQUIRE) == key)
 			{
 				return &list->list[i];
 			}
 		}
-		list = list->next;
+		list = __atomic_load_n(&list->next, __ATOMIC_ACQUIRE);
 	}
 	return NULL;
 }
-static void cleanupReferenceList(struct reference_list *list)
+/**
+ * Records that an index is no longer reachable from its list.  Other threads
+ * may still be reading it, so it is kept until the object that owns the list
+ * is deallocated.  Must be called with the list locked.
+ */
+static void retireReferenceIndex(struct reference_list *list,
+                                 struct reference_index *index)
+{
+	index->next = list->replaced;
+	list->replaced = index;
+}
+
+static void freeReferenceIndexes(struct reference_index *index)
+{
+	while (NULL != index)
+	{
+		struct reference_index *next = index->next;
+		free(index);
+		index = next;
+	}
+}
+
+static void cleanupReferenceList(struct reference_list *list, BOOL isDeallocating)
 {
 	if (NULL == list) { return; }
 
-	cleanupReferenceList(list->next);
+	cleanupReferenceList(list->next, isDeallocating);
 
 	for (int i=0 ; i<REFERENCE_LIST_SIZE ; i++)
 	{
@@ -107,6 +200,104 @@ static void cleanupReferenceList(struct reference_list *list)
 			r->policy = 0;
 		}
 	}
+	// Only the first list in a chain has indexes or a count.
+	if ((NULL != list->index) || (NULL != list->replaced) || (0 != list->count))
+	{
+		auto lock = acquire_locks_for_pointers(list);
+		struct reference_index *index = list->index;
+		if (NULL != index)
+		{
+			__atomic_store_n(&list->index, NULL, __ATOMIC_RELEASE);
+			retireReferenceIndex(list, index);
+		}
+		// If the object is being deallocated then no other thread can be
+		// reading its indexes.
+		if (isDeallocating)
+		{
+			freeReferenceIndexes(list->replaced);
+			list->replaced = NULL;
+		}
+		list->count = 0;
+	}
+}
+
+static void insertIntoIndex(struct reference_index *index, struct reference *r)
+{
+	size_t mask = index->capacity - 1;
+	for (size_t i=referenceHash(r->key) ; ; i++)
+	{
+		if (NULL == index->slots[i & mask])
+		{
+			__atomic_store_n(&index->slots[i & mask], r, __ATOMIC_RELEASE);
+			index->count++;
+			return;
+		}
+	}
+}
+
+/**
+ * Adds a reference whose key has just been set to the index, creating or
+ * growing the index if necessary.  Must be called with the list locked.
+ */
+static void indexReference(struct reference_list *list, struct reference *r)
+{
+	struct reference_index *index = list->index;
+	if ((NULL == index) && (list->count <= REFERENCE_LIST_SIZE))
+	{
+		return;
+	}
+	if ((NULL != index) && ((index->count + 1) * 2 <= index->capacity))
+	{
+		insertIntoIndex(index, r);
+		return;
+	}
+	size_t capacity = (NULL != index) ? index->capacity * 2 : 32;
+	while (capacity < list->count * 2)
+	{
+		capacity *= 2;
+	}
+	struct reference_index *newIndex = static_cast<struct reference_index*>(
+		calloc(1, sizeof(struct reference_index) + capacity * sizeof(struct reference*)));
+	newIndex->capacity = capacity;
+	// This includes `r`, because its key has already been set.
+	for (struct reference_list *l=list ; NULL != l ; l=l->next)
+	{
+		for (int i=0 ; i<REFERENCE_LIST_SIZE ; i++)
+		{
+			if (0 != l->list[i].key)
+			{
+				insertIntoIndex(newIndex, &l->list[i]);
+			}
+		}
+	}
+	__atomic_store_n(&list->index, newIndex, __ATOMIC_RELEASE);
+	// Lookups read the index without locks, so the old one may still be in
+	// use.
+	if (NULL != index)
+	{
+		retireReferenceIndex(list, index);
+	}
+}
+
+/**
+ * Returns the first free reference in a list, adding a new group to the end
+ * of the chain if necessary.  Must be called with the list locked.
+ */
+static struct reference *nextFreeReference(struct reference_list *list)
+{
+	size_t i = list->count++;
+	struct reference_list *l = list;
+	while (i >= REFERENCE_LIST_SIZE)
+	{
+		if (NULL == l->next)
+		{
+			__atomic_store_n(&l->next, allocate_zeroed<struct reference_list>(),
+			                 __ATOMIC_RELEASE);
+		}
+		l = l->next;
+		i -= REFERENCE_LIST_SIZE;
+	}
+	return &l->list[i];
 }
 
 static void freeReferenceList(struct reference_list *l)
@@ -137,29 +328,22 @@ static void setReference(struct reference_list *list,
 	}
 	// While inserting into the list, we need to lock it temporarily.
 	struct reference *r = findReference(list, key);
+	if (NULL == r)
 	{
 		auto lock = acquire_locks_for_pointers(list);
-		// If there's an existing reference, then we can update it, otherwise we
-		// have to install a new one
+		// If another thread has installed the reference since we looked,
+		// then we can update it, otherwise we have to install a new one.
+		r = findReference(list, key);
 		if (NULL == r)
 		{
-			// Search for an unused slot
-			r = findReference(list, 0);
-			if (NULL == r)
-			{
-				struct reference_list *l = list;
-
-				while (NULL != l->next) { l = l->next; }
-
-				l->next = allocate_zeroed<struct reference_list>();
-				r = &l->next->list[0];
-			}
-			r->key = key;
+			r = nextFreeReference(list);
+			__atomic_store_n(&r->key, key, __ATOMIC_RELEASE);
+			indexReference(list, r);
 		}
 	}
 	// Now we only need to lock if the old or new property is atomic
 	BOOL needLock = isAtomic(r->policy) || isAtomic(policy);
-	ThinLock *lock;
+	PropertyLock *lock;
 	if (needLock)
 	{
 		lock = lock_for_pointer(r);
@@ -246,8 +430,7 @@ static void deallocHiddenClass(id obj, SEL _cmd)
 	// After calling [super dealloc], the object will no longer exist.
 	// Free the hidden class.
 	struct reference_list *list = static_cast<struct reference_list *>(object_getIndexedIvars(hiddenClass));
-	DESTROY_LOCK(&list->lock);
-	cleanupReferenceList(list);
+	cleanupReferenceList(list, YES);
 	freeReferenceList(list->next);
 	//fprintf(stderr, "Deallocating dtable %p\n", hiddenClass->dtable);
 	free_dtable(hiddenClass->dtable);
@@ -290,7 +473,6 @@ static struct reference_list* referenceListForObject(id object, BOOL create)
 			auto guard = acquire_locks_for_pointers(cls);
 			if (NULL == cls->extra_data)
 			{
-				INIT_LOCK(list->lock);
 				cls->extra_data = list;
 			}
 			else
@@ -308,38 +490,189 @@ static struct reference_list* referenceListForObject(id object, BOOL create)
 		if (NULL == hiddenClass)
 		{
 			hiddenClass = initHiddenClassForObject(object);
-			struct reference_list *list = static_cast<struct reference_list *>(object_getIndexedIvars(hiddenClass));
-			INIT_LOCK(list->lock);
 		}
 	}
 	return hiddenClass ? static_cast<struct reference_list*>(object_getIndexedIvars(hiddenClass)) : nullptr;
 }
 
+/**
+ * Set if associations for objects that use the runtime's reference count
+ * should be stored in the side table, rather than in hidden classes.
+ */
+static BOOL useSideTable;
+
+/**
+ * The number of stripes in the association side table.  Must be a power of
+ * two.
+ */
+static const size_t association_stripe_count = 64;
+
+/**
+ * One stripe of the association side table.  The lock protects the map, but
+ * not the reference lists, which are updated in the same way as those in
+ * hidden classes.  Stripes are padded to avoid false sharing.
+ */
+struct alignas(64) AssociationStripe
+{
+	ThinLock lock;
+	tsl::robin_map<const void*, struct reference_list*> lists;
+};
+
+static AssociationStripe &associationStripe(const void *obj)
+{
+	static AssociationStripe stripes[association_stripe_count];
+	return stripes[hash_for_pointer(obj) & (association_stripe_count - 1)];
+}
+
+/**
+ * Returns the side table reference list for an object that has the
+ * associations flag set, or NULL if it has none.
+ */
+static struct reference_list *sideTableListForObject(id object)
+{
+	AssociationStripe &stripe = associationStripe(object);
+	std::lock_guard<ThinLock> guard{stripe.lock};
+	auto found = stripe.lists.find(object);
+	return (found == stripe.lists.end()) ? nullptr : found->second;
+}
+
+/**
+ * Returns the side table reference list for an object, creating it if
+ * necessary, or NULL if the object should store its associations in a hidden
+ * class.
+ */
+static struct reference_list *createSideTableListForObject(id object)
+{
+	if (!arc_has_associations(object) &&
+	    (!__atomic_load_n(&useSideTable, __ATOMIC_RELAXED) ||
+	     class_isMetaClass(object->isa) ||
+	     (Nil != findHiddenClass(object))))
+	{
+		return nullptr;
+	}
+	AssociationStripe &stripe = associationStripe(object);
+	struct reference_list *stale = nullptr;
+	struct reference_list *list;
+	{
+		std::lock_guard<ThinLock> guard{stripe.lock};
+		// Set the flag with the lock held, so that only the first thread to
+		// set it can find a list left by a previous object at this address.
+		BOOL wasMarked;
+		if (!arc_mark_has_associations(object, &wasMarked))
+		{
+			return nullptr;
+		}
+		struct reference_list *&entry = stripe.lists[object];
+		if (!wasMarked)
+		{
+			// The previous object was freed without being destroyed by the
+			// runtime.
+			stale = entry;
+			entry = nullptr;
+		}
+		if (nullptr == entry)
+		{
+			entry = allocate_zeroed<struct reference_list>();
+		}
+		list = entry;
+	}
+	if (nullptr != stale)
+	{
+		cleanupReferenceList(stale, YES);
+		freeReferenceList(stale);
+	}
+	return list;
+}
+
+PRIVATE void remove_side_table_associations(id obj)
+{
+	if (!arc_has_associations(obj))
+	{
+		return;
+	}
+	struct reference_list *list;
+	{
+		AssociationStripe &stripe = associationStripe(obj);
+		std::lock_guard<ThinLock> guard{stripe.lock};
+		auto found = stripe.lists.find(obj);
+		if (found == stripe.lists.end())
+		{
+			return;
+		}
+		list = found->second;
+		stripe.lists.erase(found);
+	}
+	// Releasing the associated objects may run arbitrary code, so do it
+	// without the stripe lock held.
+	cleanupReferenceList(list, YES);
+	freeReferenceList(list);
+}
+
+BOOL objc_setAssociationSideTable_np(BOOL enabled)
+{
+	return __atomic_exchange_n(&useSideTable, enabled, __ATOMIC_RELAXED);
+}
+
 void objc_setAssociatedObject(id object,
                               const void *key,
                               id value,
                               objc_AssociationPolicy policy)
 {
 	if (isSmallObject(object)) { return; }
-	struct reference_list *list = referenceListForObject(object, YES);
+	struct reference_list *list = createSideTableListForObject(object);
+	if (NULL == list)
+	{
+		list = referenceListForObject(object, YES);
+	}
 	setReference(list, key, value, policy);
 }
 
+/**
+ * Returns the value of a reference.  Values with atomic policies are read
+ * with the same lock that setReference() holds while replacing them, so that
+ * they can't be released before they are retained.  Others are read without
+ * any locks.
+ */
+static id loadReference(struct reference *r)
+{
+	uintptr_t policy = r->policy;
+	// Check if the policy is OBJC_ASSOCIATION_{RETAIN, COPY} or OBJC_ASSOCIATION_{RETAIN, COPY}_NONATOMIC (LSB set)
+	// Apple's objc4 retains and autoreleases the object under these policies
+	if (!(policy & OBJC_ASSOCIATION_RETAIN_NONATOMIC))
+	{
+		return (id)r->object;
+	}
+	if (!isAtomic(policy))
+	{
+		return objc_retainAutorelease((id)r->object);
+	}
+	id value;
+	{
+		PropertyLock *lock = lock_for_pointer(r);
+		std::lock_guard<PropertyLock> guard{*lock};
+		value = objc_retain((id)r->object);
+	}
+	return objc_autorelease(value);
+}
+
 id objc_getAssociatedObject(id object, const void *key)
 {
 	if (isSmallObject(object)) { return nil; }
+	if (arc_has_associations(object))
+	{
+		struct reference_list *list = sideTableListForObject(object);
+		struct reference *r = list ? findReference(list, key) : NULL;
+		if (NULL != r)
+		{
+			return loadReference(r);
+		}
+	}
 	struct reference_list *list = referenceListForObject(object, NO);
 	if (NULL == list) { return nil; }
 	struct reference *r = findReference(list, key);
 	if (NULL != r)
 	{
-		// Check if the policy is OBJC_ASSOCIATION_{RETAIN, COPY} or OBJC_ASSOCIATION_{RETAIN, COPY}_NONATOMIC (LSB set)
-		// Apple's objc4 retains and autoreleases the object under these policies
-		if (r->policy & OBJC_ASSOCIATION_RETAIN_NONATOMIC)
-		{
-			objc_retainAutorelease((id)r->object);
-		}
-		return (id)r->object;
+		return loadReference(r);
 	}
 	if (class_isMetaClass(object->isa))
 	{
@@ -362,11 +695,7 @@ id objc_getAssociatedObject(id object, const void *key)
 				struct reference *r = findReference(list, key);
 				if (NULL != r)
 				{
-					if (r->policy & OBJC_ASSOCIATION_RETAIN_NONATOMIC)
-					{
-						objc_retainAutorelease((id)r->object);
-					}
-					return (id)r->object;
+					return loadReference(r);
 				}
 			}
 			cls = class_getSuperclass(cls);
@@ -379,29 +708,11 @@ id objc_getAssociatedObject(id object, const void *key)
 void objc_removeAssociatedObjects(id object)
 {
 	if (isSmallObject(object)) { return; }
-	cleanupReferenceList(referenceListForObject(object, NO));
-}
-
-OBJC_PUBLIC
-int objc_sync_enter(id object)
-{
-	if ((object == 0) || isSmallObject(object)) { return 0; }
-	struct reference_list *list = referenceListForObject(object, YES);
-	LOCK(&list->lock);
-	return 0;
-}
-
-OBJC_PUBLIC
-int objc_sync_exit(id object)
-{
-	if ((object == 0) || isSmallObject(object)) { return 0; }
-	struct reference_list *list = referenceListForObject(object, NO);
-	if (NULL != list)
+	if (arc_has_associations(object))
 	{
-		UNLOCK(&list->lock);
-		return 0;
+		cleanupReferenceList(sideTableListForObject(object), NO);
 	}
-	return 1;
+	cleanupReferenceList(referenceListForObject(object, NO), NO);
 }
 
 static Class hiddenClassForObject(id object)
@@ -419,8 +730,6 @@ static Class hiddenClassForObject(id object)
 		if (NULL == hiddenClass)
 		{
 			hiddenClass = initHiddenClassForObject(object);
-			struct reference_list *list = static_cast<struct reference_list*>(object_getIndexedIvars(hiddenClass));
-			INIT_LOCK(list->lock);
 		}
 	}
 	return hiddenClass;
@@ -444,9 +753,7 @@ id object_clone_np(id object)
 	// to it will appear in the clone.
 	referenceListForObject(object, YES);
 	id newInstance = class_createInstance(object->isa, 0);
-	Class hiddenClass = initHiddenClassForObject(newInstance);
-	struct reference_list *list = static_cast<struct reference_list*>(object_getIndexedIvars(hiddenClass));
-	INIT_LOCK(list->lock);
+	initHiddenClassForObject(newInstance);
 	objc_setAssociatedObject(newInstance, &prototypeKey, object,
 			OBJC_ASSOCIATION_RETAIN_NONATOMIC);
 	return newInstance;
@@ -11,6 +11,12 @@ enum block_flags
 	 * The helpers have C++ code.
 	 */
 	BLOCK_HAS_CTOR         = (1 << 26),
+	/**
+	 * The block has been weakly referenced.  Set by the runtime on heap
+	 * blocks, so that weak references to them are cleared when they are
+	 * freed.
+	 */
+	BLOCK_HAS_WEAK_REFS    = (1 << 27),
 	/**
 	 * Block is stored in global memory and does not need to be copied.
 	 */
@@ -287,7 +287,12 @@ OBJC_PUBLIC void _Block_release(const void *src)
 		{
 			if(self->flags & BLOCK_HAS_COPY_DISPOSE)
 				self->descriptor->dispose_helper(self);
-			objc_delete_weak_refs((id)self);
+			// Most blocks are never weakly referenced, so don't touch the weak
+			// reference table for them.
+			if (self->flags & BLOCK_HAS_WEAK_REFS)
+			{
+				objc_delete_weak_refs((id)self);
+			}
 			gc->free(self);
 		}
 	}
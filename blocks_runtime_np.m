@@ -33,6 +33,7 @@
 #import <Block_private.h>
 #endif
 #include "visibility.h"
+#include <stdbool.h>
 
 
 OBJC_PUBLIC const char *block_getType_np(const void *b)
@@ -55,3 +56,33 @@ PRIVATE void* block_load_weak(void *block)
 	return (self->flags) & BLOCK_REFCOUNT_MASK ? block : 0;
 	#endif
 }
+
+/**
+ * Records that a heap block has been weakly referenced, so that its weak
+ * references are cleared when it is freed.  Returns false if the blocks
+ * runtime has nowhere to record this.
+ */
+PRIVATE bool block_set_weakly_referenced(void *block)
+{
+	#ifdef EMBEDDED_BLOCKS_RUNTIME
+	struct Block_layout *self = block;
+	__atomic_fetch_or(&self->flags, BLOCK_HAS_WEAK_REFS, __ATOMIC_RELAXED);
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+/**
+ * Returns whether block_set_weakly_referenced() has recorded that a block has
+ * been weakly referenced.
+ */
+PRIVATE bool block_is_weakly_referenced(void *block)
+{
+	#ifdef EMBEDDED_BLOCKS_RUNTIME
+	struct Block_layout *self = block;
+	return __atomic_load_n(&self->flags, __ATOMIC_RELAXED) & BLOCK_HAS_WEAK_REFS;
+	#else
+	return false;
+	#endif
+}
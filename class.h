@@ -3,6 +3,7 @@
 #include "visibility.h"
 #include "objc/runtime.h"
 #include "sarray2.h"
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -348,23 +349,38 @@ enum objc_class_flags
 	 * the underlying blocks runtime.
 	 */
 	objc_class_flag_is_block = (1 << 16),
+	/**
+	 * An instance of this class may have been weakly referenced.  Instances
+	 * of classes that use the fast reference count record this in their
+	 * reference count instead.  Weak references to instances of other classes
+	 * only need to be cleared on deallocation if this is set.
+	 */
+	objc_class_flag_weakly_referenced = (1 << 17),
+	/**
+	 * Instances of this class that are allocated while it uses the fast
+	 * reference count use biased reference counting.  This is set with
+	 * objc_arc_set_biased_refcount_np().
+	 */
+	objc_class_flag_biased_refcount = (1 << 18),
 };
 
 /**
- * Sets the specific class flag.  Note: This is not atomic.
+ * Sets the specific class flag.  This is atomic with respect to other flag
+ * updates, because some flags are set without holding the runtime lock.
  */
 static inline void objc_set_class_flag(Class aClass,
                                        enum objc_class_flags flag)
 {
-	aClass->info |= (unsigned long)flag;
+	__atomic_fetch_or(&aClass->info, (unsigned long)flag, __ATOMIC_RELAXED);
 }
 /**
- * Unsets the specific class flag.  Note: This is not atomic.
+ * Unsets the specific class flag.  This is atomic with respect to other flag
+ * updates.
  */
 static inline void objc_clear_class_flag(Class aClass,
                                          enum objc_class_flags flag)
 {
-	aClass->info &= ~(unsigned long)flag;
+	__atomic_fetch_and(&aClass->info, ~(unsigned long)flag, __ATOMIC_RELAXED);
 }
 /**
  * Checks whether a specific class flag is set.
@@ -430,6 +446,18 @@ static inline BOOL classIsOrInherits(Class cls, Class base)
 	return NO;
 }
 
+/**
+ * The alignment of the memory that is allocated for objects.  Objects start
+ * one word after the start of their allocation, after the reference count,
+ * and ivar.c aligns instance variables on that assumption, so larger headers
+ * must be a whole number of alignment units plus one word.
+ */
+#ifdef _WIN32
+#	define OBJECT_ALLOCATION_ALIGNMENT 32
+#else
+#	define OBJECT_ALLOCATION_ALIGNMENT __alignof__(max_align_t)
+#endif
+
 /**
  * Free the instance variable lists associated with a class.
  */
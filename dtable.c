@@ -13,6 +13,7 @@
 #include "dtable.h"
 #include "visibility.h"
 #include "asmconstants.h"
+#include "reclaim.h"
 
 _Static_assert(__builtin_offsetof(struct objc_class, dtable) == DTABLE_OFFSET,
 		"Incorrect dtable offset for assembly");
@@ -20,6 +21,28 @@ _Static_assert(__builtin_offsetof(SparseArray, shift) == SHIFT_OFFSET,
 		"Incorrect shift offset for assembly");
 _Static_assert(__builtin_offsetof(SparseArray, data) == DATA_OFFSET,
 		"Incorrect data offset for assembly");
+_Static_assert(__builtin_offsetof(SparseArray, cache) == CACHE_OFFSET,
+		"Incorrect cache offset for assembly");
+_Static_assert(__builtin_offsetof(CompactDtable, cache) == CACHE_OFFSET,
+		"Incorrect compact dtable cache offset for assembly");
+_Static_assert(__builtin_offsetof(struct objc_method_cache, mask) == CACHE_MASK_OFFSET,
+		"Incorrect cache mask offset for assembly");
+_Static_assert(__builtin_offsetof(struct objc_method_cache, entries) == CACHE_ENTRIES_OFFSET,
+		"Incorrect cache entries offset for assembly");
+_Static_assert(sizeof(struct objc_method_cache_entry) == 2 * sizeof(void*),
+		"Incorrect cache entry size for assembly");
+_Static_assert(__builtin_offsetof(CompactDtable, shift) == SHIFT_OFFSET,
+		"Incorrect compact dtable shift offset for assembly");
+_Static_assert(__builtin_offsetof(CompactDtable, mask) == COMPACT_MASK_OFFSET,
+		"Incorrect compact dtable mask offset for assembly");
+_Static_assert(__builtin_offsetof(CompactDtable, base) == COMPACT_BASE_OFFSET,
+		"Incorrect compact dtable base offset for assembly");
+_Static_assert(__builtin_offsetof(CompactDtable, entries) == COMPACT_ENTRIES_OFFSET,
+		"Incorrect compact dtable entries offset for assembly");
+_Static_assert(sizeof(struct compact_dtable_entry) == 2 * sizeof(void*),
+		"Incorrect compact dtable entry size for assembly");
+_Static_assert(__builtin_offsetof(struct objc_super, class) == SUPER_CLASS_OFFSET,
+		"Incorrect objc_super class offset for assembly");
 // Slots are now a public interface to part of the method structure, so make
 // sure that it's safe to use method and slot structures interchangeably.
 _Static_assert(__builtin_offsetof(struct objc_slot2, method) == SLOT_OFFSET,
@@ -40,13 +63,91 @@ PRIVATE InitializingDtable *temporary_dtables;
 /** Lock used to protect the temporary dtables list. */
 PRIVATE mutex_t initialize_lock;
 /** The size of the largest dtable.  This is a sparse array shift value, so is
- * 2^x in increments of 8. */
-static uint32_t dtable_depth = 8;
+ * 2^x in increments of 8.  Selector indexes start at 2^16 (lower ones are
+ * reserved for hot selectors), so dtables start large enough for the first
+ * 2^24 selectors and are never resized in practice. */
+static uint32_t dtable_depth = 24;
+
+/**
+ * The number of per-selector cache version counters.  Selector indexes are
+ * allocated sequentially, so selectors are spread evenly across them.
+ */
+#define SELECTOR_CACHE_VERSION_BUCKETS 1024
 
 #ifndef NO_SAFE_CACHING
 _Atomic(uint64_t) objc_method_cache_version;
+
+/**
+ * Cache version counters for groups of selectors.  These are incremented only
+ * when the dtable entry for a selector in the group changes, so slots cached
+ * against them survive changes to unrelated methods.  They start at 1 so that
+ * a valid version is never 0, which marks a slot as uncacheable.
+ */
+static _Atomic(uint64_t) selector_cache_versions[SELECTOR_CACHE_VERSION_BUCKETS];
+
+_Atomic(uint64_t) *objc_selector_cache_version(SEL sel)
+{
+	return &selector_cache_versions[sel->index % SELECTOR_CACHE_VERSION_BUCKETS];
+}
+
+/**
+ * Invalidates cached slots for the selector with the specified index.
+ */
+static inline void invalidate_selector_caches(uint32_t idx)
+{
+	selector_cache_versions[idx % SELECTOR_CACHE_VERSION_BUCKETS]++;
+}
+#else
+_Atomic(uint64_t) *objc_selector_cache_version(SEL sel)
+{
+	// Slots are never cacheable, so always report a version of 0.
+	static _Atomic(uint64_t) uncacheable_version;
+	return &uncacheable_version;
+}
 #endif
 
+/**
+ * The set of selectors whose cached slots are invalidated by a dtable update.
+ * The version counters are incremented only once every affected dtable has
+ * been updated, so that a concurrent lookup can't pair a new version with a
+ * stale method, and only once per update, however many methods it installs.
+ */
+struct slot_invalidation
+{
+	/** Set if any cached slots are invalidated. */
+	BOOL any;
+	/** Bitmap of selector version counters to increment. */
+	uint32_t buckets[SELECTOR_CACHE_VERSION_BUCKETS / 32];
+};
+
+static inline void slot_invalidation_add(struct slot_invalidation *inv, uint32_t idx)
+{
+	idx %= SELECTOR_CACHE_VERSION_BUCKETS;
+	inv->any = YES;
+	inv->buckets[idx / 32] |= (1U << (idx % 32));
+}
+
+/**
+ * Increments the version counters for the slots recorded in `inv`.
+ */
+static void slot_invalidation_apply(struct slot_invalidation *inv)
+{
+#ifndef NO_SAFE_CACHING
+	if (!inv->any) { return; }
+	objc_method_cache_version++;
+	for (int i=0 ; i<SELECTOR_CACHE_VERSION_BUCKETS / 32 ; i++)
+	{
+		uint32_t bits = inv->buckets[i];
+		while (bits != 0)
+		{
+			int bit = __builtin_ctz(bits);
+			selector_cache_versions[i * 32 + bit]++;
+			bits &= bits - 1;
+		}
+	}
+#endif
+}
+
 /**
  * Starting at `cls`, finds the class that provides the implementation of the
  * method identified by `sel`.
@@ -257,6 +358,12 @@ PRIVATE void init_dispatch_tables ()
 #if defined(WITH_TRACING) && defined (__x86_64)
 	tracing_dtable = SparseArrayNewWithDepth(dtable_depth);
 #endif
+#ifndef NO_SAFE_CACHING
+	for (int i=0 ; i<SELECTOR_CACHE_VERSION_BUCKETS ; i++)
+	{
+		selector_cache_versions[i] = 1;
+	}
+#endif
 }
 
 #if defined(WITH_TRACING) && defined (__x86_64)
@@ -333,21 +440,592 @@ int objc_registerTracingHook(SEL aSel, objc_tracing_hook aHook)
 }
 
 /**
- * Installs a new method in the dtable for `class`.  If `replaceMethod` is
- * `YES` then this will replace any dtable entry where the original is
- * `method_to_replace`.  This is used when a superclass method is replaced, to
- * replace all subclass dtable entries that are inherited, but not ones that
- * are overridden.
+ * Header in front of memory that the message send fast paths read without
+ * acquiring locks: method caches and compact dtables.  When one of these is replaced,
+ * other threads may still be reading it and, because the fast paths do not
+ * announce that they are doing so, there is no point at which it is known to
+ * be unused while its class is still in use.  Instead, its replacement links
+ * to it and the whole chain is freed along with the dtable.  Padded so that
+ * the memory that follows it is as aligned as memory from calloc().
  */
-static BOOL installMethodInDtable(Class class,
-                                  SparseArray *dtable,
-                                  struct objc_method *method,
-                                  struct objc_method *method_to_replace,
-                                  BOOL replaceExisting)
+struct superseded_header
+{
+	/** The memory that this memory replaced, or NULL. */
+	struct superseded_header *superseded;
+} __attribute__((aligned(16)));
+
+/**
+ * Allocates `size` bytes of zeroed memory with a superseded_header.
+ */
+static inline void *superseded_calloc(size_t size)
+{
+	struct superseded_header *header = calloc(1, sizeof(*header) + size);
+	return header + 1;
+}
+
+/**
+ * Records that `replacement` has replaced `old`, so that `old` and the memory
+ * that it replaced are freed when `replacement` is.  Both must have been
+ * allocated with superseded_calloc().
+ */
+static inline void superseded_link(void *replacement, void *old)
+{
+	((struct superseded_header*)replacement - 1)->superseded =
+		(struct superseded_header*)old - 1;
+}
+
+/**
+ * Frees memory allocated with superseded_calloc(), and all of the memory
+ * that it replaced.  `ptr` may be NULL.
+ */
+static inline void superseded_free(void *ptr)
 {
-	ASSERT(uninstalled_dtable != dtable);
+	if (NULL == ptr)
+	{
+		return;
+	}
+	struct superseded_header *header = (struct superseded_header*)ptr - 1;
+	while (NULL != header)
+	{
+		struct superseded_header *next = header->superseded;
+		free(header);
+		header = next;
+	}
+}
+
+#ifdef METHOD_CACHE
+/**
+ * The number of entries in a new method cache.
+ */
+static const uint32_t method_cache_initial_size = 8;
+/**
+ * The largest number of entries in a method cache.  Caches grow when they are
+ * half full, up to this size.
+ */
+static const uint32_t method_cache_max_size = 1024;
+
+static struct objc_method_cache *method_cache_new(uint32_t capacity)
+{
+	struct objc_method_cache *cache = superseded_calloc(sizeof(struct objc_method_cache) +
+			capacity * sizeof(struct objc_method_cache_entry));
+	cache->mask = capacity - 1;
+	return cache;
+}
+
+static size_t method_cache_size(struct objc_method_cache *cache)
+{
+	return sizeof(struct objc_method_cache) +
+		(cache->mask + 1) * sizeof(struct objc_method_cache_entry);
+}
+
+/**
+ * Tries to claim an empty entry in a method cache and store a method there.
+ */
+static BOOL method_cache_insert(struct objc_method_cache *cache,
+                                uintptr_t idx,
+                                struct objc_method *method)
+{
+	struct objc_method_cache_entry *e = &cache->entries[idx & cache->mask];
+	uintptr_t empty = 0;
+	if (!__atomic_compare_exchange_n(&e->index, &empty, method_cache_busy,
+	                                 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		return NO;
+	}
+	// Store the method before the index, so that concurrent readers that see
+	// the index will see the method.
+	e->method = method;
+	__atomic_store_n(&e->index, idx, __ATOMIC_RELEASE);
+	return YES;
+}
+#endif
+
+#ifdef METHOD_CACHE
+/**
+ * Records that an entry has been added to a method cache, replacing the cache
+ * with a bigger one if it is now half full.
+ */
+static void method_cache_filled(dtable_t dtable, struct objc_method_cache *cache)
+{
+	uint32_t count = __atomic_add_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+	uint32_t capacity = cache->mask + 1;
+	if ((count * 2 <= capacity) || (capacity >= method_cache_max_size))
+	{
+		return;
+	}
+	// The cache is half full, replace it with a bigger one containing the
+	// same entries.  If another thread has replaced the cache in the
+	// meantime, then either it has grown it or invalidated it, so we discard
+	// ours.  Negative entries keep the flag in their index, which does not
+	// change the entry that they map to.
+	struct objc_method_cache *bigger = method_cache_new(capacity * 2);
+	for (uint32_t i=0 ; i<capacity ; i++)
+	{
+		struct objc_method_cache_entry *e = &cache->entries[i];
+		uintptr_t entry_idx = __atomic_load_n(&e->index, __ATOMIC_ACQUIRE);
+		if ((entry_idx != 0) && (entry_idx != method_cache_busy))
+		{
+			if (method_cache_insert(bigger, entry_idx, e->method))
+			{
+				bigger->count++;
+			}
+		}
+	}
+	if (!__atomic_compare_exchange_n((struct objc_method_cache**)&dtable->cache,
+	                                 &cache, bigger, 0,
+	                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+		superseded_free(bigger);
+		return;
+	}
+	// The old cache may still be in use by other threads.
+	superseded_link(bigger, cache);
+}
+
+/**
+ * Returns whether a method cache may have an entry for the selector with index
+ * `idx`.  This includes entries that are being filled and negative entries.
+ */
+static BOOL method_cache_may_contain(struct objc_method_cache *cache,
+                                     uint32_t idx)
+{
+	uintptr_t key = __atomic_load_n(&cache->entries[idx & cache->mask].index,
+	                                __ATOMIC_ACQUIRE);
+	return (key == method_cache_busy) || (key == idx) ||
+		(key == ((uintptr_t)idx | method_cache_negative));
+}
+#endif
+
+PRIVATE void method_cache_fill(dtable_t dtable,
+                               struct objc_method_cache *cache,
+                               uint32_t idx,
+                               struct objc_method *method)
+{
+#ifdef METHOD_CACHE
+	if ((NULL == cache) || !method_cache_insert(cache, idx, method))
+	{
+		return;
+	}
+	method_cache_filled(dtable, cache);
+#endif
+}
+
+PRIVATE void method_cache_fill_missing(dtable_t dtable,
+                                       struct objc_method_cache *cache,
+                                       uint32_t idx,
+                                       struct objc_method *method)
+{
+#ifdef METHOD_CACHE
+	if (NULL == cache)
+	{
+		return;
+	}
+	struct objc_method_cache_entry *e = &cache->entries[idx & cache->mask];
+	uintptr_t empty = 0;
+	if (!__atomic_compare_exchange_n(&e->index, &empty, method_cache_busy,
+	                                 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	// Threads installing methods check for claimed entries after updating the
+	// dtable, so either they see this entry and invalidate the cache or we see
+	// their method here.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	struct objc_method *installed = SparseArrayLookup(dtable, idx);
+	uintptr_t key = idx;
+	if (NULL != installed)
+	{
+		method = installed;
+	}
+	else if (NULL == method)
+	{
+		key |= method_cache_negative;
+	}
+	e->method = method;
+	__atomic_store_n(&e->index, key, __ATOMIC_RELEASE);
+	method_cache_filled(dtable, cache);
+#endif
+}
+
+/**
+ * Discards all of the entries in the method cache for a dtable.  Must be
+ * called after any change to the dtable that modifies an existing entry.
+ */
+static void method_cache_invalidate(dtable_t dtable)
+{
+#ifdef METHOD_CACHE
+	if (dtable_is_compact(dtable) || (NULL == dtable->cache))
+	{
+		return;
+	}
+	// Keep the same capacity, so the cache does not need to grow again.  The
+	// cache may be concurrently replaced by a bigger one, so swap it
+	// atomically to find the one that this replaces.
+	struct objc_method_cache *new_cache =
+		method_cache_new(dtable_method_cache(dtable)->mask + 1);
+	struct objc_method_cache *old =
+		__atomic_exchange_n((struct objc_method_cache**)&dtable->cache,
+		                    new_cache, __ATOMIC_ACQ_REL);
+	// The old cache may still be in use by other threads.
+	superseded_link(new_cache, old);
+#endif
+}
+
+/**
+ * Gives a newly created sparse dtable its own method cache.
+ */
+static void method_cache_create(dtable_t dtable)
+{
+#ifdef METHOD_CACHE
+	dtable->cache = method_cache_new(method_cache_initial_size);
+#endif
+}
+
+#ifdef COMPACT_DTABLES
+/**
+ * The largest number of entries that a compact dtable may hold.  Classes that
+ * would need more than this use a sparse array.  A table with this many
+ * entries is half full and so uses around half of the memory of a single
+ * sparse array node.
+ */
+static const uint32_t compact_dtable_max_entries = 32;
+
+static CompactDtable *compact_dtable_new(Class base, uint32_t capacity)
+{
+	CompactDtable *dtable = superseded_calloc(sizeof(CompactDtable) +
+			capacity * sizeof(struct compact_dtable_entry));
+	dtable->shift = COMPACT_DTABLE_SHIFT;
+	dtable->mask = capacity - 1;
+	dtable->base = base;
+	return dtable;
+}
+
+/**
+ * Returns the size of a compact dtable, in bytes.
+ */
+static size_t compact_dtable_size(CompactDtable *dtable)
+{
+	return sizeof(CompactDtable) +
+		(dtable->mask + 1) * sizeof(struct compact_dtable_entry);
+}
+
+/**
+ * Returns the capacity of a compact dtable that can store `count` entries
+ * while remaining at most half full.
+ */
+static uint32_t compact_dtable_capacity(uint32_t count)
+{
+	uint32_t capacity = 4;
+	while (capacity < count * 2)
+	{
+		capacity <<= 1;
+	}
+	return capacity;
+}
+
+/**
+ * Returns the entry in a compact dtable for the selector index `idx`, or the
+ * empty entry where it should be inserted.
+ */
+static struct compact_dtable_entry *compact_dtable_entry(CompactDtable *dtable,
+                                                         uint32_t idx)
+{
+	for (uint32_t i=idx & dtable->mask ; ; i = (i + 1) & dtable->mask)
+	{
+		struct compact_dtable_entry *e = &dtable->entries[i];
+		if ((e->index == idx) || (e->index == 0))
+		{
+			return e;
+		}
+	}
+}
+
+/**
+ * Inserts a method into a compact dtable.  The caller is responsible for
+ * ensuring that there is space.
+ */
+static void compact_dtable_insert(CompactDtable *dtable,
+                                  uint32_t idx,
+                                  struct objc_method *method)
+{
+	struct compact_dtable_entry *e = compact_dtable_entry(dtable, idx);
+	if (e->index == idx)
+	{
+		__atomic_store_n(&e->method, method, __ATOMIC_RELEASE);
+		return;
+	}
+	// Store the method before the index, so that concurrent readers that see
+	// the index will see the method.
+	e->method = method;
+	__atomic_store_n(&e->index, idx, __ATOMIC_RELEASE);
+	dtable->count++;
+}
+
+/**
+ * Returns a copy of a compact dtable with a new capacity.
+ */
+static CompactDtable *compact_dtable_resize(CompactDtable *dtable,
+                                            uint32_t capacity)
+{
+	CompactDtable *copy = compact_dtable_new(dtable->base, capacity);
+	for (uint32_t i=0 ; i<=dtable->mask ; i++)
+	{
+		struct compact_dtable_entry *e = &dtable->entries[i];
+		if (e->index != 0)
+		{
+			compact_dtable_insert(copy, e->index, e->method);
+		}
+	}
+	return copy;
+}
+
+/**
+ * Returns a sparse array containing the same methods as a compact dtable.
+ */
+static SparseArray *compact_dtable_to_sparse(CompactDtable *dtable)
+{
+	SparseArray *sarray = SparseArrayCopy(dtable->base->dtable);
+	for (uint32_t i=0 ; i<=dtable->mask ; i++)
+	{
+		struct compact_dtable_entry *e = &dtable->entries[i];
+		if (e->index != 0)
+		{
+			SparseArrayInsert(sarray, e->index, e->method);
+		}
+	}
+	method_cache_create(sarray);
+	return sarray;
+}
+
+/**
+ * Returns whether a compact dtable has its own entry for the selector index
+ * `idx`, rather than inheriting it from the base class.
+ */
+static BOOL compact_dtable_contains(CompactDtable *dtable, uint32_t idx)
+{
+	return compact_dtable_entry(dtable, idx)->index == idx;
+}
+
+/**
+ * Creates a compact dtable for `cls`, if it is a good candidate for one.
+ * Returns NULL if the class should have a sparse dtable.
+ */
+static dtable_t compact_dtable_for_class(Class cls,
+                                         Class super,
+                                         dtable_t super_dtable)
+{
+	// Lookups that miss in a compact dtable continue in the base class's
+	// dtable, so the base must be a class whose dtable is already installed
+	// and will not be replaced.
+	if (!classHasInstalledDtable(super))
+	{
+		return NULL;
+	}
+	uint32_t count = 0;
+	for (struct objc_method_list *l=cls->methods ; l != NULL ; l=l->next)
+	{
+		count += l->count;
+	}
+#ifdef TYPE_DEPENDENT_DISPATCH
+	// Each method is installed for the typed and untyped selector.
+	count *= 2;
+#endif
+	Class base = super;
+	CompactDtable *super_compact = NULL;
+	if (dtable_is_compact(super_dtable))
+	{
+		super_compact = (CompactDtable*)super_dtable;
+		base = super_compact->base;
+		count += super_compact->count;
+	}
+	if (count > compact_dtable_max_entries)
+	{
+		return NULL;
+	}
+	CompactDtable *dtable = compact_dtable_new(base, compact_dtable_capacity(count));
+	if (NULL != super_compact)
+	{
+		for (uint32_t i=0 ; i<=super_compact->mask ; i++)
+		{
+			struct compact_dtable_entry *e = &super_compact->entries[i];
+			if (e->index != 0)
+			{
+				compact_dtable_insert(dtable, e->index, e->method);
+			}
+		}
+	}
+	return (dtable_t)dtable;
+}
+#endif
+
+/**
+ * Returns a new sparse dtable that is a copy of `dtable`.
+ */
+static dtable_t copy_dtable(dtable_t dtable)
+{
+#ifdef COMPACT_DTABLES
+	if (dtable_is_compact(dtable))
+	{
+		return compact_dtable_to_sparse((CompactDtable*)dtable);
+	}
+#endif
+	return SparseArrayCopy(dtable);
+}
+
+#ifdef COMPACT_DTABLES
+/**
+ * Replaces `old` with `new_dtable` as the dtable for `cls`.  This replaces
+ * the installed dtable, or the one in the temporary dtables list if the class
+ * is currently running +initialize.  Returns NO if the old dtable was not
+ * visible to other threads, in which case it can be freed immediately.
+ */
+static BOOL replace_dtable(Class cls, dtable_t old, dtable_t new_dtable)
+{
+	if (cls->dtable == old)
+	{
+		__atomic_store_n(&cls->dtable, new_dtable, __ATOMIC_RELEASE);
+		return YES;
+	}
+	LOCK_FOR_SCOPE(&initialize_lock);
+	for (InitializingDtable *buffer = temporary_dtables ; NULL != buffer ; buffer = buffer->next)
+	{
+		if ((buffer->owner == cls) && (buffer->dtable == old))
+		{
+			buffer->dtable = new_dtable;
+			return YES;
+		}
+	}
+	return NO;
+}
+
+/**
+ * Records that `new_dtable` has replaced the compact dtable `old`.  If `old`
+ * was published then other threads may still be reading it, so it is kept
+ * until `new_dtable` is freed.  Otherwise, it is freed now and `new_dtable`
+ * keeps the memory that `old` replaced instead.
+ */
+static void compact_dtable_replaced(dtable_t new_dtable,
+                                    CompactDtable *old,
+                                    BOOL published)
+{
+	void *superseded = old;
+	if (!published)
+	{
+		struct superseded_header *header = (struct superseded_header*)old - 1;
+		superseded = (NULL == header->superseded) ? NULL : header->superseded + 1;
+		free(header);
+		if (NULL == superseded)
+		{
+			return;
+		}
+	}
+	if (dtable_is_compact(new_dtable))
+	{
+		superseded_link(new_dtable, superseded);
+		return;
+	}
+#ifdef METHOD_CACHE
+	superseded_link(new_dtable->cache, superseded);
+#else
+	// Without method caches, nothing reads the cache field of a sparse dtable,
+	// so it holds the memory that the dtable replaced.
+	new_dtable->cache = superseded;
+#endif
+}
+#endif
+
+/**
+ * Inserts a method into the dtable for `cls`.  If the dtable must be replaced
+ * to make space, `*dtable` is updated to point to the new dtable.
+ */
+static void dtable_insert(Class cls,
+                          dtable_t *dtable,
+                          uint32_t idx,
+                          struct objc_method *method)
+{
+#ifdef COMPACT_DTABLES
+	if (dtable_is_compact(*dtable))
+	{
+		CompactDtable *compact = (CompactDtable*)*dtable;
+		if (compact_dtable_contains(compact, idx) ||
+		    ((compact->count + 1) * 2 <= compact->mask + 1))
+		{
+			compact_dtable_insert(compact, idx, method);
+			return;
+		}
+		// Grow the table, or switch to a sparse array if it is now too big.
+		dtable_t new_dtable = (compact->count < compact_dtable_max_entries)
+			? (dtable_t)compact_dtable_resize(compact, (compact->mask + 1) * 2)
+			: compact_dtable_to_sparse(compact);
+		dtable_insert(cls, &new_dtable, idx, method);
+		compact_dtable_replaced(new_dtable, compact,
+		                        replace_dtable(cls, *dtable, new_dtable));
+		*dtable = new_dtable;
+		return;
+	}
+#endif
+	SparseArrayInsert(*dtable, idx, method);
+}
+
+/**
+ * Returns the dtable for `cls`, converting it to a sparse array first if it
+ * is compact.  Used by operations that need to iterate over dtables.
+ */
+static dtable_t sparse_dtable_for_class(Class cls)
+{
+	dtable_t dtable = dtable_for_class(cls);
+#ifdef COMPACT_DTABLES
+	if (dtable_is_compact(dtable))
+	{
+		dtable_t sparse = compact_dtable_to_sparse((CompactDtable*)dtable);
+		compact_dtable_replaced(sparse, (CompactDtable*)dtable,
+		                        replace_dtable(cls, dtable, sparse));
+		dtable = sparse;
+	}
+#endif
+	return dtable;
+}
+
+/**
+ * Installs a new method in `dtable`, the dtable for `class`, without
+ * propagating it to subclasses.  If `replaceMethod` is `YES` then this will
+ * replace any dtable entry where the original is `method_to_replace`.  This is
+ * used when a superclass method is replaced, to replace all subclass dtable
+ * entries that are inherited, but not ones that are overridden.
+ *
+ * Returns YES if the method was installed, in which case `replaced` is set to
+ * the method that it replaced.  Sets `invalidateCache` if the method cache for
+ * this dtable may contain a replaced method and records any cached slots that
+ * are invalidated in `inv`.
+ */
+static BOOL installMethodInClassDtable(Class class,
+                                       dtable_t *dtable,
+                                       struct objc_method *method,
+                                       struct objc_method *method_to_replace,
+                                       BOOL replaceExisting,
+                                       struct objc_method **replaced,
+                                       BOOL *invalidateCache,
+                                       struct slot_invalidation *inv)
+{
+	ASSERT(uninstalled_dtable != *dtable);
 	uint32_t sel_id = method->selector->index;
-	struct objc_method *oldMethod = SparseArrayLookup(dtable, sel_id);
+	struct objc_method *oldMethod = dtable_lookup(*dtable, sel_id);
+	BOOL inherited = NO;
+#ifdef TYPE_DEPENDENT_DISPATCH
+	uint32_t untyped_idx = get_untyped_idx(method->selector);
+#endif
+#ifdef COMPACT_DTABLES
+	// A compact dtable without its own entry for this selector sees changes
+	// to the base class's dtable immediately.  If we are propagating the
+	// method from there, then this class previously had the method that it
+	// replaced and does not need an entry of its own.
+	if (replaceExisting && (oldMethod == method) && dtable_is_compact(*dtable) &&
+	    !compact_dtable_contains((CompactDtable*)*dtable, sel_id))
+	{
+		oldMethod = method_to_replace;
+		inherited = YES;
+	}
+#endif
 	// If we're being asked to replace an existing method, don't if it's the
 	// wrong one.
 	if ((replaceExisting) && (method_to_replace != oldMethod))
@@ -365,13 +1043,44 @@ static BOOL installMethodInDtable(Class class,
 	{
 		return NO;
 	}
-	SparseArrayInsert(dtable, sel_id, method);
-	// In TDD mode, we also register the first typed method that we
-	// encounter as the untyped version.
+	// Invalidate the old slot, if there is one.
+	if (NULL != oldMethod)
+	{
+		slot_invalidation_add(inv, sel_id);
 #ifdef TYPE_DEPENDENT_DISPATCH
-	uint32_t untyped_idx = get_untyped_idx(method->selector);
-	SparseArrayInsert(dtable, untyped_idx, method);
+		slot_invalidation_add(inv, untyped_idx);
+#endif
+	}
+	if (!inherited)
+	{
+		// Cached lookups may have returned the method that we're replacing.
+		*invalidateCache |= (NULL != oldMethod);
+		dtable_insert(class, dtable, sel_id, method);
+		// In TDD mode, we also register the first typed method that we
+		// encounter as the untyped version.
+#ifdef TYPE_DEPENDENT_DISPATCH
+		if (NULL != dtable_lookup(*dtable, untyped_idx))
+		{
+			*invalidateCache = YES;
+			slot_invalidation_add(inv, untyped_idx);
+		}
+		dtable_insert(class, dtable, untyped_idx, method);
+#endif
+#ifdef METHOD_CACHE
+		// The cache may record that this class had no method for the
+		// selector, or map it to a method with different types.  This pairs
+		// with the fence in method_cache_fill_missing().
+		struct objc_method_cache *cache = dtable_method_cache(*dtable);
+		if (NULL != cache)
+		{
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			*invalidateCache |= method_cache_may_contain(cache, sel_id);
+#ifdef TYPE_DEPENDENT_DISPATCH
+			*invalidateCache |= method_cache_may_contain(cache, untyped_idx);
 #endif
+		}
+#endif
+	}
 
 	static SEL cxx_construct, cxx_destruct;
 	if (NULL == cxx_construct)
@@ -387,6 +1096,34 @@ static BOOL installMethodInDtable(Class class,
 	{
 		class->cxx_destruct = method->imp;
 	}
+	*replaced = oldMethod;
+	return YES;
+}
+
+/**
+ * Installs a new method in the dtable for `class` and recursively in all of
+ * its subclasses, replacing their inherited versions.  Arguments are as for
+ * installMethodInClassDtable().
+ */
+static BOOL installMethodInDtable(Class class,
+                                  dtable_t *dtable,
+                                  struct objc_method *method,
+                                  struct objc_method *method_to_replace,
+                                  BOOL replaceExisting,
+                                  struct slot_invalidation *inv)
+{
+	struct objc_method *oldMethod;
+	BOOL invalidateCache = NO;
+	if (!installMethodInClassDtable(class, dtable, method, method_to_replace,
+	                                replaceExisting, &oldMethod,
+	                                &invalidateCache, inv))
+	{
+		return NO;
+	}
+	if (invalidateCache)
+	{
+		method_cache_invalidate(*dtable);
+	}
 
 	for (struct objc_class *subclass=class->subclass_list ; 
 		Nil != subclass ; subclass = subclass->sibling_class)
@@ -396,44 +1133,113 @@ static BOOL installMethodInDtable(Class class,
 		if (!classHasDtable(subclass)) { continue; }
 
 		// Recursively install this method in all subclasses
+		dtable_t subclass_dtable = dtable_for_class(subclass);
 		installMethodInDtable(subclass,
-		                      dtable_for_class(subclass),
+		                      &subclass_dtable,
 		                      method,
 		                      oldMethod,
-		                      YES);
+		                      YES,
+		                      inv);
 	}
+	return YES;
+}
 
-	// Invalidate the old slot, if there is one.
-	if (NULL != oldMethod)
+/**
+ * Returns whether any subclass of `cls` has a dtable that method changes must
+ * be propagated to.
+ */
+static BOOL hasSubclassDtables(Class cls)
+{
+	for (struct objc_class *subclass=cls->subclass_list ;
+	     Nil != subclass ; subclass = subclass->sibling_class)
 	{
-#ifndef NO_SAFE_CACHING
-		objc_method_cache_version++;
-#endif
+		if (classHasDtable(subclass)) { return YES; }
 	}
-	return YES;
+	return NO;
 }
 
-static void installMethodsInClass(Class cls,
-                                  SparseArray *methods_to_replace,
-                                  SparseArray *methods,
-                                  BOOL replaceExisting)
+/**
+ * Installs all of the methods in `methods` in the dtable for `class` and then
+ * propagates the ones that were installed to subclasses in a single walk of
+ * the class hierarchy.  Each method replaces the method for the same selector
+ * in `methods_to_replace`, as for installMethodInClassDtable().  The method
+ * cache for each dtable is invalidated at most once.
+ */
+static void installMethodListInDtable(Class class,
+                                      dtable_t *dtable,
+                                      SparseArray *methods,
+                                      dtable_t methods_to_replace,
+                                      BOOL replaceExisting,
+                                      struct slot_invalidation *inv)
 {
-	SparseArray *dtable = dtable_for_class(cls);
-	assert(uninstalled_dtable != dtable);
-
+	BOOL propagate = hasSubclassDtables(class);
+	// The methods installed in this class and the ones that they replaced,
+	// which are the methods that subclasses may inherit.
+	SparseArray *installed = NULL;
+	SparseArray *replaced = NULL;
+	if (propagate)
+	{
+		installed = SparseArrayNewWithDepth(dtable_depth);
+		replaced = SparseArrayNewWithDepth(dtable_depth);
+	}
+	BOOL invalidateCache = NO;
+	BOOL installedAny = NO;
 	uint32_t idx = 0;
 	struct objc_method *m;
 	while ((m = SparseArrayNext(methods, &idx)))
 	{
+		uint32_t sel_id = m->selector->index;
 		struct objc_method *method_to_replace = methods_to_replace
-			?  SparseArrayLookup(methods_to_replace, m->selector->index)
+			?  dtable_lookup(methods_to_replace, sel_id)
 			: NULL;
-		if (!installMethodInDtable(cls, dtable, m, method_to_replace, replaceExisting))
+		struct objc_method *oldMethod;
+		if (!installMethodInClassDtable(class, dtable, m, method_to_replace,
+		                                replaceExisting, &oldMethod,
+		                                &invalidateCache, inv))
+		{
+			continue;
+		}
+		installedAny = YES;
+		if (propagate)
 		{
-			// Remove this method from the list, if it wasn't actually installed
-			SparseArrayInsert(methods, idx, 0);
+			SparseArrayInsert(installed, sel_id, m);
+			SparseArrayInsert(replaced, sel_id, oldMethod);
 		}
 	}
+	if (invalidateCache)
+	{
+		method_cache_invalidate(*dtable);
+	}
+	if (propagate && installedAny)
+	{
+		for (struct objc_class *subclass=class->subclass_list ;
+		     Nil != subclass ; subclass = subclass->sibling_class)
+		{
+			if (!classHasDtable(subclass)) { continue; }
+			dtable_t subclass_dtable = dtable_for_class(subclass);
+			installMethodListInDtable(subclass, &subclass_dtable, installed,
+			                          replaced, YES, inv);
+		}
+	}
+	if (propagate)
+	{
+		SparseArrayDestroy(installed);
+		SparseArrayDestroy(replaced);
+	}
+}
+
+static void installMethodsInClass(Class cls,
+                                  dtable_t methods_to_replace,
+                                  SparseArray *methods,
+                                  BOOL replaceExisting)
+{
+	dtable_t dtable = dtable_for_class(cls);
+	assert(uninstalled_dtable != dtable);
+
+	struct slot_invalidation inv = { NO };
+	installMethodListInDtable(cls, &dtable, methods, methods_to_replace,
+	                          replaceExisting, &inv);
+	slot_invalidation_apply(&inv);
 }
 
 Class class_getSuperclass(Class);
@@ -447,8 +1253,8 @@ PRIVATE void objc_update_dtable_for_class(Class cls)
 
 	SparseArray *methods = SparseArrayNewWithDepth(dtable_depth);
 	collectMethodsForMethodListToSparseArray((void*)cls->methods, methods, YES);
-	SparseArray *super_dtable = cls->super_class ? dtable_for_class(cls->super_class)
-	                                             : NULL;
+	dtable_t super_dtable = cls->super_class ? dtable_for_class(cls->super_class)
+	                                         : NULL;
 	installMethodsInClass(cls, super_dtable, methods, YES);
 	SparseArrayDestroy(methods);
 	checkARCAccessors(cls);
@@ -456,7 +1262,7 @@ PRIVATE void objc_update_dtable_for_class(Class cls)
 
 static void rebaseDtableRecursive(Class cls, Class newSuper)
 {
-	dtable_t parentDtable = dtable_for_class(newSuper);
+	dtable_t parentDtable = sparse_dtable_for_class(newSuper);
 	// Collect all of the methods for this class:
 	dtable_t temporaryDtable = SparseArrayNewWithDepth(dtable_depth);
 
@@ -476,7 +1282,7 @@ static void rebaseDtableRecursive(Class cls, Class newSuper)
 	}
 
 
-	dtable_t dtable = dtable_for_class(cls);
+	dtable_t dtable = sparse_dtable_for_class(cls);
 	uint32_t idx = 0;
 	struct objc_method *method;
 	// Install all methods from the parent that aren't overridden here.
@@ -500,6 +1306,7 @@ static void rebaseDtableRecursive(Class cls, Class newSuper)
 		}
 	}
 	SparseArrayDestroy(temporaryDtable);
+	method_cache_invalidate(dtable);
 
 	// merge can make a class ARC-compatible.
 	checkARCAccessors(cls);
@@ -526,6 +1333,10 @@ PRIVATE void objc_update_dtable_for_new_superclass(Class cls, Class newSuper)
 	// Invalidate all caches after this operation.
 #ifndef NO_SAFE_CACHING
 		objc_method_cache_version++;
+		for (int i=0 ; i<SELECTOR_CACHE_VERSION_BUCKETS ; i++)
+		{
+			selector_cache_versions[i]++;
+		}
 #endif
 
 	return;
@@ -540,11 +1351,10 @@ PRIVATE void add_method_list_to_class(Class cls,
 	LOCK_RUNTIME_FOR_SCOPE();
 
 	SparseArray *methods = SparseArrayNewWithDepth(dtable_depth);
-	SparseArray *super_dtable = cls->super_class ? dtable_for_class(cls->super_class)
-	                                             : NULL;
+	dtable_t super_dtable = cls->super_class ? dtable_for_class(cls->super_class)
+	                                         : NULL;
 	collectMethodsForMethodListToSparseArray(list, methods, NO);
 	installMethodsInClass(cls, super_dtable, methods, YES);
-	// Methods now contains only the new methods for this class.
 	SparseArrayDestroy(methods);
 	checkARCAccessors(cls);
 }
@@ -567,6 +1377,7 @@ PRIVATE dtable_t create_dtable_for_class(Class class, dtable_t root_dtable)
 	if (Nil == super)
 	{
 		dtable = SparseArrayNewWithDepth(dtable_depth);
+		method_cache_create(dtable);
 	}
 	else
 	{
@@ -582,7 +1393,14 @@ PRIVATE dtable_t create_dtable_for_class(Class class, dtable_t root_dtable)
 				abort();
 			}
 		}
-		dtable = SparseArrayCopy(super_dtable);
+#ifdef COMPACT_DTABLES
+		dtable = compact_dtable_for_class(class, super, super_dtable);
+		if (NULL == dtable)
+#endif
+		{
+			dtable = copy_dtable(super_dtable);
+			method_cache_create(dtable);
+		}
 	}
 
 	// When constructing the initial dtable for a class, we iterate along the
@@ -591,18 +1409,20 @@ PRIVATE dtable_t create_dtable_for_class(Class class, dtable_t root_dtable)
 	// installMethodInDtable() to replace only methods that are inherited from
 	// the superclass.
 	struct objc_method_list *list = (void*)class->methods;
+	struct slot_invalidation inv = { NO };
 
 	while (NULL != list)
 	{
 		for (unsigned i=0 ; i<list->count ; i++)
 		{
 			struct objc_method *super_method = super_dtable
-				? SparseArrayLookup(super_dtable, method_at_index(list, i)->selector->index)
+				? dtable_lookup(super_dtable, method_at_index(list, i)->selector->index)
 				: NULL;
-			installMethodInDtable(class, dtable, method_at_index(list, i), super_method, YES);
+			installMethodInDtable(class, &dtable, method_at_index(list, i), super_method, YES, &inv);
 		}
 		list = list->next;
 	}
+	slot_invalidation_apply(&inv);
 
 	return dtable;
 }
@@ -610,15 +1430,13 @@ PRIVATE dtable_t create_dtable_for_class(Class class, dtable_t root_dtable)
 
 Class class_table_next(void **e);
 
-PRIVATE void objc_resize_dtables(uint32_t newSize)
+/**
+ * Adds a level to every dtable.  Must be called with the runtime lock held.
+ * This stops the world, but is needed only if more than 2^24 selectors are
+ * registered.
+ */
+static void expand_dtables(void)
 {
-	// If dtables already have enough space to store all registered selectors, do nothing
-	if (1<<dtable_depth > newSize) { return; }
-
-	LOCK_RUNTIME_FOR_SCOPE();
-
-	if (1<<dtable_depth > newSize) { return; }
-
 	dtable_depth += 8;
 
 	uint32_t oldShift = uninstalled_dtable->shift;
@@ -632,7 +1450,10 @@ PRIVATE void objc_resize_dtables(uint32_t newSize)
 		LOCK_FOR_SCOPE(&initialize_lock);
 		for (InitializingDtable *buffer = temporary_dtables ; NULL != buffer ; buffer = buffer->next)
 		{
-			buffer->dtable = SparseArrayExpandingArray(buffer->dtable, dtable_depth);
+			if (!dtable_is_compact(buffer->dtable))
+			{
+				buffer->dtable = SparseArrayExpandingArray(buffer->dtable, dtable_depth);
+			}
 		}
 	}
 	// Resize all existing dtables
@@ -646,20 +1467,174 @@ PRIVATE void objc_resize_dtables(uint32_t newSize)
 			next->isa->dtable = uninstalled_dtable;
 			continue;
 		}
+		// Compact dtables don't need resizing: they contain only the entries
+		// that they have and defer everything else to their base class.
 		if (NULL != next->dtable &&
 		    ((SparseArray*)next->dtable)->shift == oldShift)
 		{
 			next->dtable = SparseArrayExpandingArray((void*)next->dtable, dtable_depth);
+		}
+		if (NULL != next->isa->dtable &&
+		    ((SparseArray*)next->isa->dtable)->shift == oldShift)
+		{
 			next->isa->dtable = SparseArrayExpandingArray((void*)next->isa->dtable, dtable_depth);
 		}
 	}
 }
 
-PRIVATE void free_dtable(dtable_t dtable)
+PRIVATE void objc_resize_dtables(uint32_t newSize)
+{
+	// If dtables already have enough space to store all registered selectors, do nothing
+	if (((uint64_t)1<<dtable_depth) > newSize) { return; }
+
+	LOCK_RUNTIME_FOR_SCOPE();
+
+	while (((uint64_t)1<<dtable_depth) <= newSize)
+	{
+		expand_dtables();
+	}
+}
+
+static void free_dtable_now(void *ptr)
 {
+	dtable_t dtable = ptr;
+#ifdef COMPACT_DTABLES
+	if (dtable_is_compact(dtable))
+	{
+		superseded_free(dtable);
+		return;
+	}
+#endif
+	// The method cache, or the memory that this dtable replaced if there are
+	// no method caches.
+	superseded_free(dtable->cache);
 	SparseArrayDestroy(dtable);
 }
 
+PRIVATE void free_dtable(dtable_t dtable)
+{
+	size_t size;
+#ifdef COMPACT_DTABLES
+	if (dtable_is_compact(dtable))
+	{
+		size = compact_dtable_size((CompactDtable*)dtable);
+	}
+	else
+#endif
+	{
+		size = SparseArraySize(dtable);
+#ifdef METHOD_CACHE
+		if (NULL != dtable->cache)
+		{
+			size += method_cache_size(dtable->cache);
+		}
+#endif
+	}
+	// Other threads may still be walking this dtable, or nodes that it shares
+	// with other dtables.  Without reclamation we can't tell, so free it
+	// immediately, as we always did, rather than leaking every dtable of a
+	// disposed class.
+	if (!reclaim_is_enabled())
+	{
+		free_dtable_now(dtable);
+		return;
+	}
+	reclaim_retire(dtable, free_dtable_now, size);
+}
+
+#ifdef COMPACT_DTABLES
+/**
+ * Returns the memory that a sparse array would need to store the entries in a
+ * compact dtable, in addition to the nodes shared with its base class.  This
+ * is one copy of each node on the path to each entry.
+ */
+static size_t compact_dtable_sparse_size(CompactDtable *dtable)
+{
+	size_t nodes = 1;
+	for (uint32_t shift=8 ; shift<dtable_depth ; shift+=8)
+	{
+		for (uint32_t i=0 ; i<=dtable->mask ; i++)
+		{
+			uintptr_t idx = dtable->entries[i].index;
+			if (idx == 0)
+			{
+				continue;
+			}
+			BOOL seen = NO;
+			for (uint32_t j=0 ; j<i ; j++)
+			{
+				uintptr_t other = dtable->entries[j].index;
+				if ((other != 0) && ((other >> shift) == (idx >> shift)))
+				{
+					seen = YES;
+					break;
+				}
+			}
+			if (!seen)
+			{
+				nodes++;
+			}
+		}
+	}
+	return nodes * sizeof(SparseArray);
+}
+#endif
+
+PRIVATE void log_dtable_memory_usage(void)
+{
+	unsigned sparse_count = 0;
+	size_t sparse_size = 0;
+#ifdef METHOD_CACHE
+	size_t cache_size = 0;
+#endif
+#ifdef COMPACT_DTABLES
+	unsigned compact_count = 0;
+	size_t compact_size = 0;
+	size_t compact_sparse_size = 0;
+#endif
+	LOCK_RUNTIME_FOR_SCOPE();
+	void *e = NULL;
+	struct objc_class *next;
+	while ((next = class_table_next(&e)))
+	{
+		dtable_t dtables[] = { next->dtable, next->isa->dtable };
+		for (int i=0 ; i<2 ; i++)
+		{
+			dtable_t dtable = dtables[i];
+			if ((NULL == dtable) || (uninstalled_dtable == dtable))
+			{
+				continue;
+			}
+#ifdef COMPACT_DTABLES
+			if (dtable_is_compact(dtable))
+			{
+				CompactDtable *compact = (CompactDtable*)dtable;
+				compact_count++;
+				compact_size += compact_dtable_size(compact);
+				compact_sparse_size += compact_dtable_sparse_size(compact);
+				continue;
+			}
+#endif
+			sparse_count++;
+			sparse_size += SparseArraySize(dtable);
+#ifdef METHOD_CACHE
+			if (NULL != dtable->cache)
+			{
+				cache_size += method_cache_size(dtable->cache);
+			}
+#endif
+		}
+	}
+	fprintf(stderr, "%u sparse dtables using %zu bytes.\n", sparse_count, sparse_size);
+#ifdef METHOD_CACHE
+	fprintf(stderr, "%zu bytes in method caches.\n", cache_size);
+#endif
+#ifdef COMPACT_DTABLES
+	fprintf(stderr, "%u compact dtables using %zu bytes (%zu bytes as sparse arrays).\n",
+	        compact_count, compact_size, compact_sparse_size);
+#endif
+}
+
 LEGACY void update_dispatch_table_for_class(Class cls)
 {
 	static BOOL warned = NO;
@@ -3,14 +3,224 @@
 #include "sarray2.h"
 #include "objc/slot.h"
 #include "visibility.h"
+#include "asmconstants.h"
 #include <stdint.h>
 #include <stdio.h>
 
+// Compact dtables must be understood by the message send fast paths, which
+// currently only handle them on x86-64 and AArch64.
+#if defined(COMPACT_DTABLES) && !(defined(__x86_64) || defined(__ARM_ARCH_ISA_A64))
+#	undef COMPACT_DTABLES
+#endif
+// Likewise for the per-class method caches.
+#if defined(METHOD_CACHE) && !(defined(__x86_64) || defined(__ARM_ARCH_ISA_A64))
+#	undef METHOD_CACHE
+#endif
+
 typedef SparseArray* dtable_t;
-#define objc_dtable_lookup SparseArrayLookup
 
 typedef struct objc_class *Class;
 
+/**
+ * An entry in a compact dtable.
+ */
+struct compact_dtable_entry
+{
+	/** The selector index, or 0 if this entry is unused. */
+	uintptr_t index;
+	/** The method for this selector. */
+	struct objc_method *method;
+};
+
+/**
+ * Compact dtable, used for classes that add only a few methods to their
+ * superclass.  Rather than copying the superclass's sparse array, these store
+ * the methods that differ from the base class in a small open-addressed hash
+ * table and fall back to the base class's dtable for everything else.
+ *
+ * Entries are never removed.  New entries are added by storing the method and
+ * then the index, so readers do not need to acquire any locks.  The `shift`
+ * field is at the same offset as in a sparse array, so compact dtables can be
+ * stored in the dtable field of a class and distinguished by its value.
+ */
+typedef struct
+{
+	/** Always COMPACT_DTABLE_SHIFT. */
+	uint32_t shift;
+	/** The number of entries minus one.  The capacity is a power of two. */
+	uint32_t mask;
+	/**
+	 * Always NULL.  Compact dtables do not have method caches, but this field
+	 * is at the same offset as the cache in a sparse array so that the
+	 * message send fast paths can check for a cache without first checking
+	 * the kind of dtable.
+	 */
+	void *cache;
+	/**
+	 * The class that provides any methods that are not in this table.  This
+	 * class always has an installed sparse dtable.
+	 */
+	struct objc_class *base;
+	/** The number of entries that are in use. */
+	uint32_t count;
+	/** The hash table. */
+	struct compact_dtable_entry entries[];
+} CompactDtable;
+
+/**
+ * Returns whether a dtable is a compact dtable.
+ */
+static inline int dtable_is_compact(dtable_t dtable)
+{
+#ifdef COMPACT_DTABLES
+	return dtable->shift == COMPACT_DTABLE_SHIFT;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * An entry in a method cache.
+ */
+struct objc_method_cache_entry
+{
+	/**
+	 * The selector index, 0 if this entry is empty, or method_cache_busy if
+	 * it is being filled.  Entries recording that the dtable has no method for
+	 * a selector store the index with method_cache_negative set.  Entries for
+	 * typed selectors that have no dtable entry may map to a method with a
+	 * different type encoding if the mismatch hook allowed it.
+	 */
+	uintptr_t index;
+	/** The method for this selector. */
+	struct objc_method *method;
+};
+
+/**
+ * Direct-mapped cache of methods, keyed by selector index.  Each class with a
+ * sparse dtable has one of these, stored in the root node of the dtable.  The
+ * message send fast paths check the cache before walking the dtable and call
+ * the slow path to fill empty entries.  Entries are written once and never
+ * modified: the cache is invalidated by replacing it with a new one, and
+ * replaced caches are kept until the dtable is freed.  Caches store method
+ * pointers, rather than IMPs, so that functions such as
+ * method_setImplementation() that modify methods in place do not need to
+ * invalidate them.
+ */
+struct objc_method_cache
+{
+	/** The number of entries minus one.  The capacity is a power of two. */
+	uint32_t mask;
+	/** The number of entries that have been filled. */
+	uint32_t count;
+	/** The cache entries. */
+	struct objc_method_cache_entry entries[];
+};
+
+/**
+ * Value stored in the index field of a method cache entry while it is being
+ * filled.  This is never a valid selector index.
+ */
+static const uintptr_t method_cache_busy = UINTPTR_MAX;
+
+/**
+ * Flag set in the index field of a method cache entry that records a lookup
+ * miss.  Selector indexes are 32 bits, so this never matches a valid index and
+ * the message send fast paths treat these entries as collisions and walk the
+ * dtable, without needing to know about negative entries.
+ */
+static const uintptr_t method_cache_negative = ~(UINTPTR_MAX >> 1);
+
+/**
+ * Returns the method cache for a dtable, or NULL if it does not have one.
+ */
+static inline struct objc_method_cache *dtable_method_cache(dtable_t dtable)
+{
+#ifdef METHOD_CACHE
+	return __atomic_load_n((struct objc_method_cache**)&dtable->cache, __ATOMIC_ACQUIRE);
+#else
+	return NULL;
+#endif
+}
+
+/**
+ * Looks up the method for the selector with index `idx` in a method cache.
+ * Returns NULL if there is no cache or the entry is not in the cache.
+ */
+static inline void *method_cache_lookup(struct objc_method_cache *cache,
+                                        uint32_t idx)
+{
+	if (NULL == cache)
+	{
+		return NULL;
+	}
+	struct objc_method_cache_entry *e = &cache->entries[idx & cache->mask];
+	if (__atomic_load_n(&e->index, __ATOMIC_ACQUIRE) == idx)
+	{
+		return e->method;
+	}
+	return NULL;
+}
+
+/**
+ * Returns whether a method cache records that its dtable contains no method
+ * for the selector with index `idx`.
+ */
+static inline BOOL method_cache_lookup_negative(struct objc_method_cache *cache,
+                                                uint32_t idx)
+{
+	if (NULL == cache)
+	{
+		return NO;
+	}
+	struct objc_method_cache_entry *e = &cache->entries[idx & cache->mask];
+	return __atomic_load_n(&e->index, __ATOMIC_ACQUIRE) ==
+		((uintptr_t)idx | method_cache_negative);
+}
+
+/**
+ * Returns the entry for the selector with index `idx` in a compact dtable, or
+ * NULL if the method is inherited from the base class.
+ */
+static inline struct compact_dtable_entry *compact_dtable_find(CompactDtable *compact,
+                                                               uint32_t idx)
+{
+	uint32_t mask = compact->mask;
+	for (uint32_t i=idx & mask ; ; i = (i + 1) & mask)
+	{
+		uintptr_t key = __atomic_load_n(&compact->entries[i].index, __ATOMIC_ACQUIRE);
+		if (key == idx)
+		{
+			return &compact->entries[i];
+		}
+		if (key == 0)
+		{
+			return NULL;
+		}
+	}
+}
+
+/**
+ * Looks up the method for the selector with index `idx` in a dtable.
+ */
+static inline void *dtable_lookup(dtable_t dtable, uint32_t idx)
+{
+#ifdef COMPACT_DTABLES
+	if (dtable_is_compact(dtable))
+	{
+		CompactDtable *compact = (CompactDtable*)dtable;
+		struct compact_dtable_entry *e = compact_dtable_find(compact, idx);
+		if (NULL != e)
+		{
+			return e->method;
+		}
+		dtable = compact->base->dtable;
+	}
+#endif
+	return SparseArrayLookup(dtable, idx);
+}
+#define objc_dtable_lookup dtable_lookup
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -48,6 +258,19 @@ static inline int classHasInstalledDtable(struct objc_class *cls)
 	return (cls->dtable != uninstalled_dtable);
 }
 
+/**
+ * Values returned by objc_sync_enter() and objc_sync_exit().
+ */
+enum
+{
+	OBJC_SYNC_SUCCESS = 0,
+	/**
+	 * objc_sync_exit() was called by a thread that has not entered the
+	 * object's monitor.
+	 */
+	OBJC_SYNC_NOT_OWNING_THREAD_ERROR = -1
+};
+
 OBJC_PUBLIC
 int objc_sync_enter(id object);
 OBJC_PUBLIC
@@ -137,6 +360,37 @@ void add_method_list_to_class(Class cls,
  */
 void free_dtable(dtable_t dtable);
 
+/**
+ * Adds a method to a dtable's method cache, if the corresponding entry is
+ * empty.  The cache must have been loaded from the dtable before looking up
+ * the method, so that a method that is looked up concurrently with the cache
+ * being invalidated is not added to the new cache.
+ */
+void method_cache_fill(dtable_t dtable,
+                       struct objc_method_cache *cache,
+                       uint32_t idx,
+                       struct objc_method *method);
+
+/**
+ * Adds an entry for the selector with index `idx`, which has no entry in the
+ * dtable, to the dtable's method cache if the corresponding entry is empty.
+ * The entry maps to `method` or, if `method` is NULL, records a miss.  The
+ * dtable is checked again after claiming the entry, so a method that is
+ * installed concurrently is either cached instead or invalidates the cache.
+ * As with method_cache_fill(), the cache must be loaded before any dtable
+ * lookup used to find `method`.
+ */
+void method_cache_fill_missing(dtable_t dtable,
+                               struct objc_method_cache *cache,
+                               uint32_t idx,
+                               struct objc_method *method);
+
+/**
+ * Logs the memory used by dtables.  Called on exit if LIBOBJC_MEMORY_PROFILE
+ * is set.
+ */
+void log_dtable_memory_usage(void);
+
 /**
  * Checks whether the class supports ARC.  This can be used before the dtable
  * is installed.
@@ -2,31 +2,39 @@
 #include "objc/runtime.h"
 #include "gc_ops.h"
 #include "class.h"
+#include "reclaim.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 static id allocate_class(Class cls, size_t extraBytes)
 {
-	size_t size = cls->instance_size + extraBytes + sizeof(intptr_t);
-	intptr_t *addr =
+	size_t header = arc_instance_header_size(cls);
+	size_t size = cls->instance_size + extraBytes + header;
+	char *addr =
 #ifdef _WIN32
 	// Malloc on Windows doesn't guarantee 32-byte alignment, but we
 	// require this for any class that may contain vectors
-		_aligned_malloc(size, 32);
+		_aligned_malloc(size, OBJECT_ALLOCATION_ALIGNMENT);
 	memset(addr, 0, size);
 #else
 		calloc(1, size);
 #endif
-	return (id)(addr + 1);
+	id obj = (id)(addr + header);
+	if (header > sizeof(intptr_t))
+	{
+		arc_init_biased_instance(obj);
+	}
+	return obj;
 }
 
 static void free_object(id obj)
 {
+	char *addr = (char*)obj - arc_object_header_size(obj);
 #ifdef _WIN32
-	_aligned_free((void*)(((intptr_t*)obj) - 1));
+	_aligned_free(addr);
 #else
-	free((void*)(((intptr_t*)obj) - 1));
+	free(addr);
 #endif
 }
 
@@ -35,8 +43,14 @@ static void *alloc(size_t size)
 	return calloc(1, size);
 }
 
-void objc_registerThreadWithCollector(void) {}
-void objc_unregisterThreadWithCollector(void) {}
+void objc_registerThreadWithCollector(void)
+{
+	reclaim_register_thread();
+}
+void objc_unregisterThreadWithCollector(void)
+{
+	reclaim_unregister_thread();
+}
 void objc_assertRegisteredThreadWithCollector() {}
 
 PRIVATE struct gc_ops gc_ops_none = 
@@ -58,3 +58,19 @@ enum objc_gc_mode
  */
 extern struct gc_ops *gc;
 
+/**
+ * Returns the number of bytes that ARC needs before an instance of `cls` for
+ * its reference count.
+ */
+size_t arc_instance_header_size(Class cls);
+/**
+ * Initialises the header of a new instance, for which
+ * arc_instance_header_size() returned more than one word.
+ */
+void arc_init_biased_instance(id obj);
+/**
+ * Returns the number of bytes before an object that were allocated for its
+ * reference count.
+ */
+size_t arc_object_header_size(id obj);
+
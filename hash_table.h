@@ -18,6 +18,9 @@
  * which has a static size.
  */
 #include "lock.h"
+#ifndef MAP_TABLE_SINGLE_THREAD
+#	include "reclaim.h"
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -200,6 +203,11 @@ static int PREFIX(_table_resize)(PREFIX(_table) *table)
 #	if !defined(ENABLE_GC) && defined(MAP_TABLE_SINGLE_THREAD)
 	free(copy->table);
 	free(copy);
+#	elif !defined(ENABLE_GC)
+	// Lookups in other threads may still be reading the old array.
+	reclaim_retire(copy->table, free,
+	               copy->table_size * sizeof(struct PREFIX(_table_cell_struct)));
+	reclaim_retire(copy, free, sizeof(PREFIX(_table)));
 #	endif
 	return 1;
 }
@@ -334,6 +342,11 @@ static int PREFIX(_insert)(PREFIX(_table) *table,
 
 static void *PREFIX(_table_get_cell)(PREFIX(_table) *table, const void *key)
 {
+#ifndef MAP_TABLE_SINGLE_THREAD
+	// Arrays replaced by a resize are retired, so lookups must be visible to
+	// reclamation.
+	reclaim_register_thread_once();
+#endif
 	uint32_t hash = MAP_TABLE_HASH_KEY(key);
 	PREFIX(_table_cell) cell = PREFIX(_table_lookup)(table, hash);
 	// Value does not exist.
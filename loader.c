@@ -7,6 +7,7 @@
 #include "loader.h"
 #include "visibility.h"
 #include "legacy.h"
+#include "reclaim.h"
 #ifdef ENABLE_GC
 #include <gc/gc.h>
 #endif
@@ -20,10 +21,13 @@ PRIVATE mutex_t runtime_mutex;
 LEGACY void *__objc_runtime_mutex = &runtime_mutex;
 
 void log_selector_memory_usage(void);
+void log_dtable_memory_usage(void);
 
 static void log_memory_stats(void)
 {
 	log_selector_memory_usage();
+	log_dtable_memory_usage();
+	log_reclaim_memory_usage();
 }
 
 /* Number of threads that are alive.  */
@@ -51,9 +55,12 @@ static void init_runtime(void)
 		// call dlopen() or equivalent, and the platform's implementation of
 		// this does not perform any synchronization.
 		INIT_LOCK(runtime_mutex);
+		// Set up memory reclamation before anything can retire memory.
+		init_reclaim();
 		// Create the various tables that the runtime needs.
 		init_selector_tables();
 		init_dispatch_tables();
+		init_hot_selectors();
 		init_protocol_table();
 		init_class_tables();
 		init_alias_table();
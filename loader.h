@@ -100,6 +100,11 @@ void init_protocol_table(void);
  */
 void init_selector_tables(void);
 
+/**
+ * Register the selectors from the hot selector profile, if there is one.
+ */
+void init_hot_selectors(void);
+
 /**
  * Initialise the trampolines for using blocks as methods.
  */
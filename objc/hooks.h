@@ -71,6 +71,11 @@ OBJC_HOOK Class (*_objc_class_for_boxing_foreign_exception)(int64_t exceptionCla
  * Hook called when selector type does not match the method type in the
  * receiver.  This should return the slot to use instead, although it may throw
  * an exception or perform some other action.
+ *
+ * If this returns the method's own implementation, then the mismatch is
+ * treated as tolerated and the method may be cached for the selector, so the
+ * hook is not called again for the same class and selector until the class's
+ * methods change.
  */
 OBJC_PUBLIC extern IMP (*_objc_selector_type_mismatch2)(Class cls, 
        SEL selector, struct objc_slot2 *result);
@@ -100,6 +100,46 @@ void objc_msgSend_stret2(id self, SEL _cmd, ...);
 OBJC_PUBLIC
 long double objc_msgSend_fpret(id self, SEL _cmd, ...);
 
+#if defined(__x86_64) || defined(__ARM_ARCH_ISA_A64)
+
+// Define __GNUSTEP_MSGSENDSUPER__ if available
+#ifndef __GNUSTEP_MSGSENDSUPER__
+#define __GNUSTEP_MSGSENDSUPER__
+#endif
+
+struct objc_super;
+
+/**
+ * Message sending function for calling superclass methods.  This function must
+ * be cast to the correct types for the function before use.  The first
+ * argument is a pointer to an objc_super structure, which provides the
+ * receiver and the class in which to start looking up the method.  The
+ * method is called with the receiver from this structure as its first
+ * argument.
+ *
+ * Note that this function is only available on x86-64 and AArch64.  For a
+ * portable solution, use objc_msg_lookup_super() and call the returned IMP
+ * directly.
+ *
+ * This version of the function is used for all messages that do not return a
+ * structure in memory.
+ */
+OBJC_PUBLIC
+id objc_msgSendSuper(struct objc_super *super, SEL _cmd, ...);
+/**
+ * Message sending function for calling superclass methods that return a
+ * structure in memory.  The arguments are the same as for
+ * objc_msgSendSuper(), after the structure return pointer.
+ */
+OBJC_PUBLIC
+#ifdef __cplusplus
+id objc_msgSendSuper_stret(struct objc_super *super, SEL _cmd, ...);
+#else
+void objc_msgSendSuper_stret(struct objc_super *super, SEL _cmd, ...);
+#endif
+
+#endif
+
 #endif
 
 #endif //_OBJC_MESSAGE_H_
@@ -125,6 +125,26 @@ OBJC_PUBLIC size_t object_getRetainCount_np(id obj) OBJC_NONPORTABLE;
  * Releases an object.  Equivalent to [obj release].
  */
 OBJC_PUBLIC void objc_release(id obj);
+/**
+ * Retains every object in an array of `count` objects.  Each element is
+ * replaced with the value that `objc_retain()` would return for it, which
+ * differs from the argument only for stack blocks.  This is faster than
+ * calling `objc_retain()` on each element when neighbouring objects have the
+ * same class.
+ */
+OBJC_PUBLIC void objc_retainArray_np(id *objects, size_t count) OBJC_NONPORTABLE;
+/**
+ * Releases every object in an array of `count` objects.  Adjacent copies of
+ * the same object are released with a single reference count update.
+ */
+OBJC_PUBLIC void objc_releaseArray_np(id *objects, size_t count) OBJC_NONPORTABLE;
+/**
+ * Equivalent to calling `objc_storeStrong()` for each of the `count` elements
+ * of `dest` with the corresponding element of `src`.  All of the new values
+ * are retained before any of the old values are released.  The arrays may
+ * overlap.
+ */
+OBJC_PUBLIC void objc_storeStrongArray_np(id *dest, id *src, size_t count) OBJC_NONPORTABLE;
 /**
  * Mark the object as about to begin deallocation.  All subsequent reads of
  * weak pointers will return 0.  This function should be called in -release,
@@ -144,6 +164,83 @@ OBJC_PUBLIC unsigned long objc_arc_autorelease_count_np(void);
  * this thread.
  */
 OBJC_PUBLIC unsigned long objc_arc_autorelease_count_for_object_np(id);
+/**
+ * Sets the maximum number of drained autorelease pool pages that each thread
+ * keeps for reuse and returns the previous limit.  Pages that a thread has
+ * already cached are kept until it reuses them or exits.  The default is 4,
+ * unless the LIBOBJC_AUTORELEASE_PAGE_CACHE environment variable is set.
+ */
+OBJC_PUBLIC unsigned objc_arc_set_autorelease_page_cache_limit_np(unsigned limit);
+/**
+ * Returns statistics for the calling thread's autorelease pool pages: the
+ * number of pages that it has allocated, the number of times that it has
+ * reused a drained page instead of allocating one, and the number of drained
+ * pages that it currently keeps for reuse.  Any of the arguments may be NULL.
+ */
+OBJC_PUBLIC void objc_arc_autorelease_page_stats_np(unsigned long *allocated,
+                                                    unsigned long *reused,
+                                                    unsigned long *cached);
+/**
+ * Enables or disables recording of autoreleases in the per-thread statistics
+ * returned by `objc_arc_autorelease_pool_stats_np()` and
+ * `objc_arc_autoreleased_classes_np()`, and returns the previous setting.
+ * Instrumentation is disabled by default, unless the
+ * LIBOBJC_AUTORELEASE_INSTRUMENTATION environment variable is set.  When it is
+ * enabled, each autorelease costs one hash table update.
+ */
+OBJC_PUBLIC BOOL objc_arc_set_autorelease_instrumentation_np(BOOL enabled);
+/**
+ * Returns statistics for the calling thread's autorelease pools: the number of
+ * pools that have been pushed and not popped, the number of pages that they
+ * use, the largest values of each since the statistics were last reset, and
+ * the number of objects autoreleased since then while instrumentation was
+ * enabled.  Any of the arguments may be NULL.
+ */
+OBJC_PUBLIC void objc_arc_autorelease_pool_stats_np(unsigned long *depth,
+                                                    unsigned long *pages,
+                                                    unsigned long *peakDepth,
+                                                    unsigned long *peakPages,
+                                                    unsigned long *autoreleases);
+/**
+ * Resets the calling thread's autorelease statistics.  The peak depth and page
+ * count are set to their current values.
+ */
+OBJC_PUBLIC void objc_arc_reset_autorelease_pool_stats_np(void);
+/**
+ * Stores up to `max` of the classes that the calling thread has autoreleased
+ * the most instances of since the statistics were reset, along with the number
+ * of instances, in order of decreasing count.  Returns the number of classes
+ * stored.  Only autoreleases made while instrumentation was enabled are
+ * counted.
+ */
+OBJC_PUBLIC unsigned objc_arc_autoreleased_classes_np(Class *classes,
+                                                      unsigned long *counts,
+                                                      unsigned max);
+/**
+ * Returns statistics for weak reference records, which are allocated for each
+ * object that is weakly referenced: the number that are currently in use, and
+ * the number that the runtime holds memory for.  Memory for records is reused
+ * but never returned to the system, so the second value is the sum of the
+ * largest number that have been in use at once in each part of the weak
+ * reference table.  Either argument may be NULL.
+ */
+OBJC_PUBLIC void objc_arc_weak_ref_stats_np(unsigned long *live,
+                                            unsigned long *peak);
+/**
+ * Enables or disables biased reference counting for instances of `cls` that
+ * are allocated later.  Subclasses are not affected.
+ *
+ * Each instance is owned by the thread that allocates it, which can retain
+ * and release it without atomic operations.  Other threads use atomic
+ * operations, as for other objects.  When the owner releases its last
+ * reference, it gives up ownership and the object then behaves like any
+ * other.  If other threads release references that the owner retained,
+ * deallocation may be deferred until the owner next pops an autorelease pool
+ * or exits.  Instances use two more words of memory.
+ *
+ * This has no effect on classes that implement their own reference counting.
+ */
+OBJC_PUBLIC void objc_arc_set_biased_refcount_np(Class cls, BOOL biased);
 
 #ifdef __cplusplus
 }
@@ -247,6 +247,26 @@ BOOL class_addIvar(Class cls,
 OBJC_PUBLIC
 BOOL class_addMethod(Class cls, SEL name, IMP imp, const char *types);
 
+/**
+ * Adds `count` methods to a class in a single operation.  The selector,
+ * implementation, and type encoding of each method are taken from the
+ * corresponding elements of `names`, `imps`, and `types`.  As with
+ * `class_addMethod()`, a method is not added if the class already has a method
+ * with the same name, or if an earlier element of the list does.
+ *
+ * This is equivalent to calling `class_addMethod()` for each method, but
+ * updates the dispatch tables of the class and its subclasses, and invalidates
+ * cached lookups, only once for the whole list.
+ *
+ * Returns the number of methods that were added.
+ */
+OBJC_PUBLIC
+unsigned class_addMethods_np(Class cls,
+                             unsigned count,
+                             const SEL *names,
+                             const IMP *imps,
+                             const char *const *types) OBJC_NONPORTABLE;
+
 /**
  * Adds a protocol to the class.
  */
@@ -780,6 +800,34 @@ OBJC_PUBLIC
 char *property_copyAttributeValue(objc_property_t property,
                                   const char *attributeName);
 
+/**
+ * Returns the index of the lock that protects atomic property accesses to the
+ * instance variable at the specified address.  Several addresses share each
+ * lock.
+ */
+OBJC_PUBLIC
+unsigned objc_propertyLockForAddress_np(const void *address) OBJC_NONPORTABLE;
+
+/**
+ * Stores the indexes of the most contended atomic property locks in `locks`,
+ * most contended first, along with the number of times that each was found
+ * held by another thread in `contended` and the number of times that a thread
+ * stopped spinning and waited for it in `waits`.  Any of the arrays may be
+ * NULL.  Returns the number of entries written, which is at most `max`.  Locks
+ * that have never been contended are not reported.
+ */
+OBJC_PUBLIC
+unsigned objc_propertyLockStats_np(unsigned *locks,
+                                   unsigned long *contended,
+                                   unsigned long *waits,
+                                   unsigned max) OBJC_NONPORTABLE;
+
+/**
+ * Resets the counters reported by objc_propertyLockStats_np().
+ */
+OBJC_PUBLIC
+void objc_resetPropertyLockStats_np(void) OBJC_NONPORTABLE;
+
 /**
  * Testswhether a protocol conforms to another protocol.
  */
@@ -951,6 +999,37 @@ unsigned sel_copyTypes_np(const char *selName, const char **types, unsigned coun
 OBJC_PUBLIC
 unsigned sel_copyTypedSelectors_np(const char *selName, SEL *const sels, unsigned count) OBJC_NONPORTABLE;
 
+/**
+ * Informs the runtime that the calling thread holds no references to
+ * runtime-internal data structures, for example between iterations of its run
+ * loop.  If the LIBOBJC_RECLAIM environment variable is set, then memory from
+ * superseded dispatch tables, method caches and hash tables is freed once
+ * every thread that uses the runtime has reached such a point.  Popping an
+ * autorelease pool has the same effect.
+ */
+OBJC_PUBLIC
+void objc_threadQuiescent_np(void) OBJC_NONPORTABLE;
+
+/**
+ * Returns the number of selectors that were given reserved dispatch indexes
+ * from the hot selector profile.  The profile is a file named by the
+ * LIBOBJC_HOT_SELECTORS environment variable, containing one selector name
+ * (optionally followed by a type encoding) per line.  Selectors listed there
+ * are registered before any code is loaded and given small, contiguous
+ * indexes, so that dispatching them touches few dispatch table nodes.
+ */
+OBJC_PUBLIC
+unsigned sel_getHotSelectorCount_np(void) OBJC_NONPORTABLE;
+
+/**
+ * Returns the number of distinct dispatch table leaf nodes that contain
+ * entries for the specified selectors.  Each leaf node holds 256 entries, so
+ * this is a measure of how many cache lines a class's dispatch table touches
+ * when sending these messages.  Unregistered selectors are ignored.
+ */
+OBJC_PUBLIC
+unsigned sel_countDtableLeaves_np(SEL *sels, unsigned count) OBJC_NONPORTABLE;
+
 /**
  * New ABI lookup function.  Receiver may be modified during lookup or proxy
  * forwarding and the sender may affect how lookup occurs.
@@ -987,6 +1066,19 @@ OBJC_PUBLIC
 extern struct objc_slot2 *objc_slot_lookup_version(id *receiver, SEL selector, uint64_t*)
 	OBJC_NONPORTABLE;
 
+/**
+ * Look up a slot, invoking any required forwarding mechanisms.  The third
+ * parameter is used to return the current value of the selector's version
+ * counter, or 0 if the slot is not cacheable.  If this value is equal to the
+ * value of the counter returned by `objc_selector_cache_version` then the
+ * slot is safe to reuse without performing another lookup.  Unlike
+ * `objc_method_cache_version`, this counter does not change when methods for
+ * unrelated selectors are added or replaced.
+ */
+OBJC_PUBLIC
+extern struct objc_slot2 *objc_slot_lookup_selector_version(id *receiver, SEL selector, uint64_t*)
+	OBJC_NONPORTABLE;
+
 /**
  * Look up a slot, invoking any required forwarding mechanisms.
  */
@@ -1079,6 +1171,18 @@ void objc_setAssociatedObject(id object, const void *key, id value, objc_Associa
  */
 OBJC_PUBLIC
 void objc_removeAssociatedObjects(id object);
+/**
+ * Enables or disables storing associated objects in a side table keyed by the
+ * object's address, and returns the previous setting.  By default, the first
+ * association set on an object creates a hidden subclass for it, which
+ * requires the runtime lock.  With the side table enabled, objects that use
+ * the runtime's reference count instead set a flag in it, and their
+ * associations are released when the object is destroyed with
+ * object_dispose().  Objects that already have a hidden class, and classes,
+ * continue to use hidden classes.
+ */
+OBJC_PUBLIC
+BOOL objc_setAssociationSideTable_np(BOOL enabled) OBJC_NONPORTABLE;
 
 /**
  * Converts a block into an IMP that can be used as a method.  The block should
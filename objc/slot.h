@@ -34,6 +34,18 @@ struct objc_slot2
 #if defined(__powerpc__) && !defined(__powerpc64__)
 #else
 OBJC_PUBLIC extern _Atomic(uint64_t) objc_method_cache_version;
+
+/**
+ * Returns the cache version counter for the specified selector.  This is
+ * shared with some other selectors, but is incremented only when cached slots
+ * for one of them become invalid, so is unaffected by most method changes
+ * elsewhere.  When you call `objc_slot_lookup_selector_version`, the final
+ * parameter is used to return the value of this counter or 0 if the slot is
+ * uncacheable.  The cached slot is safe to use while the counter still holds
+ * that value.  The returned pointer never changes for a given selector, so
+ * callers may store it alongside the cached slot.
+ */
+OBJC_PUBLIC _Atomic(uint64_t) *objc_selector_cache_version(SEL sel) OBJC_NONPORTABLE;
 #endif
 
 /**
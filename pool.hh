@@ -23,23 +23,97 @@ inline void *allocate_pages(size_t size)
 }
 #endif
 
+/**
+ * The default way of linking a free object into a pool's free list: the
+ * link is stored in the first word of the object.  Pools of types that must
+ * keep some fields valid after they have been freed can provide a different
+ * policy.
+ */
 template<typename T>
-class PoolAllocate
+struct PoolFreeListLink
 {
-	static constexpr size_t PageSize = 4096;
-	static constexpr size_t ChunkSize = sizeof(T) * PageSize;
-	static inline size_t index = PageSize;
-	static inline T *buffer = nullptr;
+	static T *&next(T *obj)
+	{
+		return *reinterpret_cast<T**>(obj);
+	}
+};
+
+/**
+ * Allocates objects of type T from chunks of pages.  Chunks are never returned
+ * to the operating system, but freed objects are kept on a free list and
+ * reused by later allocations.  This returns uninitialised storage and does
+ * not run constructors or destructors.  A pool does no locking, so callers
+ * must serialise access to it.
+ */
+template<typename T,
+         size_t ObjectsPerChunk = 4096,
+         typename Link = PoolFreeListLink<T>>
+class Pool
+{
+	static constexpr size_t ChunkSize = sizeof(T) * ObjectsPerChunk;
+	size_t index = ObjectsPerChunk;
+	T *buffer = nullptr;
+	T *freeList = nullptr;
+	size_t live = 0;
+	size_t peak = 0;
 	public:
-	static T *allocate()
+	T *allocate()
 	{
-		if (index == PageSize)
+		T *obj = freeList;
+		if (obj != nullptr)
 		{
-			index = 0;
-			buffer = static_cast<T*>(allocate_pages(ChunkSize));
+			freeList = Link::next(obj);
 		}
-		return &buffer[index++];
+		else
+		{
+			if (index == ObjectsPerChunk)
+			{
+				index = 0;
+				buffer = static_cast<T*>(allocate_pages(ChunkSize));
+			}
+			obj = &buffer[index++];
+		}
+		if (++live > peak)
+		{
+			peak = live;
+		}
+		return obj;
+	}
+	void deallocate(T *obj)
+	{
+		Link::next(obj) = freeList;
+		freeList = obj;
+		live--;
+	}
+	/**
+	 * The number of objects that are currently allocated.
+	 */
+	size_t liveCount() const
+	{
+		return live;
+	}
+	/**
+	 * The largest number of objects that have been allocated at once.  This is
+	 * also the number of objects that the pool holds memory for, excluding
+	 * the unused part of the current chunk.
+	 */
+	size_t peakCount() const
+	{
+		return peak;
 	}
 };
 
-
+template<typename T>
+class PoolAllocate
+{
+	static inline Pool<T> pool;
+	public:
+	static T *allocate()
+	{
+		return pool.allocate();
+	}
+	static void deallocate(T *obj)
+	{
+		pool.deallocate(obj);
+	}
+};
@@ -246,3 +246,28 @@ PRIVATE const char *constructPropertyAttributes(objc_property_t property,
 #ifdef __cplusplus
 }
 #endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Loads and retains the object in the atomic property at `addr` without
+ * acquiring a lock, storing it in `result`.  Returns NO, without modifying
+ * `result`, if the object does not use the runtime's reference count, in
+ * which case the caller must read the property while holding its lock.
+ * Setters must store to the property with an atomic exchange, while holding
+ * the lock, and call arc_wait_for_atomic_property_readers() before releasing
+ * the old value.
+ */
+PRIVATE BOOL arc_load_atomic_property(id *addr, id *result);
+
+/**
+ * Waits until no thread is retaining `obj` in arc_load_atomic_property().
+ * Readers only do this for a few instructions, so this should be brief.
+ */
+PRIVATE void arc_wait_for_atomic_property_readers(id obj);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include "class.h"
 #include "properties.h"
 #include "spinlock.h"
@@ -28,6 +29,7 @@ id objc_getProperty(id obj, SEL _cmd, ptrdiff_t offset, BOOL isAtomic)
 	id ret;
 	if (isAtomic)
 	{
+		if (!arc_load_atomic_property((id*)addr, &ret))
 		{
 			auto guard = acquire_locks_for_pointers(addr);
 			ret = *(id*)addr;
@@ -61,9 +63,11 @@ void objc_setProperty(id obj, SEL _cmd, ptrdiff_t offset, id arg, BOOL isAtomic,
 	id old;
 	if (isAtomic)
 	{
-		auto guard = acquire_locks_for_pointers(addr);
-		old = *(id*)addr;
-		*(id*)addr = arg;
+		{
+			auto guard = acquire_locks_for_pointers(addr);
+			old = __atomic_exchange_n((id*)addr, arg, __ATOMIC_SEQ_CST);
+		}
+		arc_wait_for_atomic_property_readers(old);
 	}
 	else
 	{
@@ -79,9 +83,12 @@ void objc_setProperty_atomic(id obj, SEL _cmd, id arg, ptrdiff_t offset)
 	char *addr = (char*)obj;
 	addr += offset;
 	arg = objc_retain(arg);
-	auto guard = acquire_locks_for_pointers(addr);
-	id old = *(id*)addr;
-	*(id*)addr = arg;
+	id old;
+	{
+		auto guard = acquire_locks_for_pointers(addr);
+		old = __atomic_exchange_n((id*)addr, arg, __ATOMIC_SEQ_CST);
+	}
+	arc_wait_for_atomic_property_readers(old);
 	objc_release(old);
 }
 
@@ -92,9 +99,12 @@ void objc_setProperty_atomic_copy(id obj, SEL _cmd, id arg, ptrdiff_t offset)
 	addr += offset;
 
 	arg = [arg copy];
-	auto guard = acquire_locks_for_pointers(addr);
-	id old = *(id*)addr;
-	*(id*)addr = arg;
+	id old;
+	{
+		auto guard = acquire_locks_for_pointers(addr);
+		old = __atomic_exchange_n((id*)addr, arg, __ATOMIC_SEQ_CST);
+	}
+	arc_wait_for_atomic_property_readers(old);
 	objc_release(old);
 }
 
@@ -212,6 +222,63 @@ void objc_setPropertyStruct(void *dest,
 	}
 }
 
+OBJC_PUBLIC
+unsigned objc_propertyLockForAddress_np(const void *address)
+{
+	return lock_for_pointer(address) - spinlocks;
+}
+
+OBJC_PUBLIC
+unsigned objc_propertyLockStats_np(unsigned *locks,
+                                   unsigned long *contended,
+                                   unsigned long *waits,
+                                   unsigned max)
+{
+	struct
+	{
+		unsigned lock;
+		uint32_t contended;
+		uint32_t waits;
+	} stats[spinlock_count];
+	unsigned found = 0;
+	for (unsigned i=0 ; i<spinlock_count ; i++)
+	{
+		uint32_t c = spinlocks[i].contended.load(std::memory_order_relaxed);
+		if (c != 0)
+		{
+			stats[found++] = { i, c, spinlocks[i].waits.load(std::memory_order_relaxed) };
+		}
+	}
+	unsigned count = std::min(found, max);
+	std::partial_sort(stats, stats + count, stats + found,
+		[](auto &a, auto &b) { return a.contended > b.contended; });
+	for (unsigned i=0 ; i<count ; i++)
+	{
+		if (locks)
+		{
+			locks[i] = stats[i].lock;
+		}
+		if (contended)
+		{
+			contended[i] = stats[i].contended;
+		}
+		if (waits)
+		{
+			waits[i] = stats[i].waits;
+		}
+	}
+	return count;
+}
+
+OBJC_PUBLIC
+void objc_resetPropertyLockStats_np(void)
+{
+	for (unsigned i=0 ; i<spinlock_count ; i++)
+	{
+		spinlocks[i].contended.store(0, std::memory_order_relaxed);
+		spinlocks[i].waits.store(0, std::memory_order_relaxed);
+	}
+}
 
 OBJC_PUBLIC
 objc_property_t class_getProperty(Class cls, const char *name)
@@ -0,0 +1,273 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "objc/runtime.h"
+#include "lock.h"
+#include "reclaim.h"
+
+/**
+ * Per-thread reclamation state.
+ */
+struct reclaim_thread
+{
+	/**
+	 * The value of the global epoch when this thread last passed through a
+	 * quiescent state.  Written only by the owning thread.
+	 */
+	_Atomic(uint64_t) epoch;
+	/** The next registered thread. */
+	struct reclaim_thread *next;
+};
+
+/**
+ * Memory that has been retired but not yet freed.
+ */
+struct retired
+{
+	/** The retired memory. */
+	void *ptr;
+	/** The function used to free it. */
+	void (*free_fn)(void*);
+	/** The size of the retired memory, for statistics. */
+	size_t size;
+	/** The global epoch immediately after this was retired. */
+	uint64_t epoch;
+	/** The next retired allocation. */
+	struct retired *next;
+};
+
+/**
+ * Lock protecting the list of threads and the list of retired memory.
+ */
+static mutex_t reclaim_lock;
+/**
+ * Global epoch.  Incremented each time memory is retired.
+ */
+static _Atomic(uint64_t) global_epoch = 1;
+/**
+ * List of registered threads.
+ */
+static struct reclaim_thread *threads;
+/**
+ * List of retired memory that has not yet been freed.
+ */
+static struct retired *retired_list;
+/**
+ * The number of entries in retired_list.  Read without the lock to avoid
+ * acquiring it in quiescent states when there is nothing to free.
+ */
+static _Atomic(unsigned) retired_count;
+/**
+ * Set if retired memory may be freed.
+ */
+static BOOL reclaim_enabled;
+/**
+ * The number of bytes that have been retired and freed.
+ */
+static size_t retired_bytes, reclaimed_bytes;
+
+/**
+ * The calling thread's reclamation state, or NULL if it is not registered.
+ */
+static __thread struct reclaim_thread *current_thread;
+
+PRIVATE __thread int reclaim_thread_checked;
+
+#ifdef _WIN32
+#	include "safewindows.h"
+static DWORD thread_exit_key;
+static void WINAPI thread_exit(void *t);
+#else
+static pthread_key_t thread_exit_key;
+static void thread_exit(void *t);
+#endif
+
+/**
+ * Frees all retired memory that was retired before every registered thread
+ * last passed through a quiescent state.  Must be called with reclaim_lock
+ * held.
+ */
+static void reclaim_retired(void)
+{
+	uint64_t safe_epoch = UINT64_MAX;
+	for (struct reclaim_thread *t=threads ; NULL != t ; t=t->next)
+	{
+		uint64_t epoch = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+		if (epoch < safe_epoch)
+		{
+			safe_epoch = epoch;
+		}
+	}
+	struct retired **prev = &retired_list;
+	while (NULL != *prev)
+	{
+		struct retired *r = *prev;
+		if (r->epoch > safe_epoch)
+		{
+			prev = &r->next;
+			continue;
+		}
+		*prev = r->next;
+		r->free_fn(r->ptr);
+		reclaimed_bytes += r->size;
+		free(r);
+		__atomic_fetch_sub(&retired_count, 1, __ATOMIC_RELAXED);
+	}
+}
+
+PRIVATE void init_reclaim(void)
+{
+	INIT_LOCK(reclaim_lock);
+	reclaim_enabled = (getenv("LIBOBJC_RECLAIM") != NULL);
+	if (!reclaim_enabled)
+	{
+		return;
+	}
+#ifdef _WIN32
+	thread_exit_key = FlsAlloc(thread_exit);
+#else
+	pthread_key_create(&thread_exit_key, thread_exit);
+#endif
+	reclaim_register_thread();
+}
+
+PRIVATE int reclaim_is_enabled(void)
+{
+	return reclaim_enabled;
+}
+
+PRIVATE void reclaim_register_thread(void)
+{
+	reclaim_thread_checked = 1;
+	if (!reclaim_enabled || (NULL != current_thread))
+	{
+		return;
+	}
+	struct reclaim_thread *t = calloc(1, sizeof(struct reclaim_thread));
+	LOCK(&reclaim_lock);
+	// A thread that has not yet loaded any pointers is quiescent.
+	t->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	t->next = threads;
+	threads = t;
+	UNLOCK(&reclaim_lock);
+	current_thread = t;
+#ifdef _WIN32
+	FlsSetValue(thread_exit_key, t);
+#else
+	pthread_setspecific(thread_exit_key, t);
+#endif
+}
+
+/**
+ * Removes a thread from the list of registered threads and frees anything
+ * that was waiting for it.
+ */
+static void remove_thread(struct reclaim_thread *t)
+{
+	LOCK(&reclaim_lock);
+	for (struct reclaim_thread **prev=&threads ; NULL != *prev ; prev=&(*prev)->next)
+	{
+		if (*prev == t)
+		{
+			*prev = t->next;
+			break;
+		}
+	}
+	reclaim_retired();
+	UNLOCK(&reclaim_lock);
+	free(t);
+}
+
+#ifdef _WIN32
+static void WINAPI thread_exit(void *t)
+#else
+static void thread_exit(void *t)
+#endif
+{
+	if (NULL != t)
+	{
+		remove_thread(t);
+	}
+}
+
+PRIVATE void reclaim_unregister_thread(void)
+{
+	struct reclaim_thread *t = current_thread;
+	if (NULL == t)
+	{
+		return;
+	}
+	current_thread = NULL;
+	reclaim_thread_checked = 0;
+#ifdef _WIN32
+	FlsSetValue(thread_exit_key, NULL);
+#else
+	pthread_setspecific(thread_exit_key, NULL);
+#endif
+	remove_thread(t);
+}
+
+PRIVATE void reclaim_quiescent_state(void)
+{
+	if (!reclaim_enabled)
+	{
+		return;
+	}
+	struct reclaim_thread *t = current_thread;
+	if (UNLIKELY(NULL == t))
+	{
+		reclaim_register_thread();
+		t = current_thread;
+	}
+	__atomic_store_n(&t->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+	                 __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&retired_count, __ATOMIC_RELAXED) == 0)
+	{
+		return;
+	}
+	LOCK(&reclaim_lock);
+	reclaim_retired();
+	UNLOCK(&reclaim_lock);
+}
+
+void objc_threadQuiescent_np(void)
+{
+	reclaim_quiescent_state();
+}
+
+PRIVATE void reclaim_retire(void *ptr, void (*free_fn)(void*), size_t size)
+{
+	if (NULL == ptr)
+	{
+		return;
+	}
+	__atomic_fetch_add(&retired_bytes, size, __ATOMIC_RELAXED);
+	if (!reclaim_enabled)
+	{
+		// Without reclamation, memory that other threads may be reading can
+		// never be freed.
+		return;
+	}
+	struct retired *r = malloc(sizeof(struct retired));
+	LOCK(&reclaim_lock);
+	r->ptr = ptr;
+	r->free_fn = free_fn;
+	r->size = size;
+	// Any thread that reaches a quiescent state after this increment can no
+	// longer see the retired memory.
+	r->epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+	r->next = retired_list;
+	retired_list = r;
+	__atomic_fetch_add(&retired_count, 1, __ATOMIC_RELAXED);
+	UNLOCK(&reclaim_lock);
+}
+
+PRIVATE void log_reclaim_memory_usage(void)
+{
+	LOCK(&reclaim_lock);
+	fprintf(stderr, "%zu bytes retired, %zu bytes reclaimed (%u allocations pending)%s.\n",
+	        __atomic_load_n(&retired_bytes, __ATOMIC_RELAXED), reclaimed_bytes,
+	        __atomic_load_n(&retired_count, __ATOMIC_RELAXED),
+	        reclaim_enabled ? "" : ", reclamation disabled");
+	UNLOCK(&reclaim_lock);
+}
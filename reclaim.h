@@ -0,0 +1,102 @@
+#ifndef __OBJC_RECLAIM_H_INCLUDED__
+#define __OBJC_RECLAIM_H_INCLUDED__
+#include "visibility.h"
+#include <stddef.h>
+
+/**
+ * Quiescent-state-based reclamation for runtime data structures that are read
+ * without locks, such as hash table arrays.  Readers do not perform any atomic
+ * operations or announce that they are doing so, so memory that they may be
+ * reading cannot be freed as soon as it has been replaced.  Instead, it is
+ * retired and freed once every registered thread has passed through a
+ * quiescent state, in which it holds no references to runtime-internal memory.
+ *
+ * This is only safe if every thread that may read retired memory is
+ * registered, so it is enabled only if the LIBOBJC_RECLAIM environment
+ * variable is set.  Threads are registered automatically the first time that
+ * they look up a method outside the message send fast path, look up a value
+ * in a runtime hash table, or use ARC, or when they are registered with
+ * objc_registerThreadWithCollector() (which libdispatch does for its worker
+ * threads).  The assembly message send fast paths can run in threads that
+ * have never done any of these, so nothing that they can reach is ever
+ * retired while its class is in use: replaced method caches and compact
+ * dtables are instead kept until the class's dtable is freed.  If
+ * reclamation is disabled, memory that may be read without locks is leaked,
+ * as it was before this mechanism existed, and memory that can't be is freed
+ * immediately by its owner.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Initialise reclamation and register the calling thread.
+ */
+PRIVATE void init_reclaim(void);
+
+/**
+ * Registers the calling thread, so that memory is not reclaimed until it has
+ * passed through a quiescent state.  A thread must register before it loads
+ * any pointer to memory that may be retired.
+ */
+PRIVATE void reclaim_register_thread(void);
+
+/**
+ * Nonzero once the calling thread has been passed to reclaim_register_thread().
+ */
+PRIVATE extern __thread int reclaim_thread_checked;
+
+/**
+ * Registers the calling thread if it has not already been registered.  This
+ * is called on the paths that a thread takes when it first uses the runtime:
+ * message lookups that are not satisfied by the assembly fast path, runtime
+ * hash table lookups, and the first use of ARC or autorelease pools.  It is cheap enough to call on every
+ * slow-path lookup, whether or not reclamation is enabled.
+ */
+static inline void reclaim_register_thread_once(void)
+{
+	if (UNLIKELY(!reclaim_thread_checked))
+	{
+		reclaim_register_thread();
+	}
+}
+
+/**
+ * Returns nonzero if retired memory will be freed.  When it is not, callers
+ * that can free memory immediately, because no other thread can be reading
+ * it, should do so rather than retiring it.
+ */
+PRIVATE int reclaim_is_enabled(void);
+
+/**
+ * Unregisters the calling thread.  The thread must not hold any references to
+ * memory that may be retired.  Called automatically when a registered thread
+ * exits.
+ */
+PRIVATE void reclaim_unregister_thread(void);
+
+/**
+ * Announces that the calling thread is in a quiescent state and frees any
+ * retired memory that no thread can still be reading.  Registers the calling
+ * thread if it is not already registered.
+ */
+PRIVATE void reclaim_quiescent_state(void);
+
+/**
+ * Retires `ptr`, which must already be unreachable for any thread that has
+ * not yet loaded it.  `free_fn` is called with `ptr` once no thread can still
+ * be reading it.  `size` is used only for statistics.
+ */
+PRIVATE void reclaim_retire(void *ptr, void (*free_fn)(void*), size_t size);
+
+/**
+ * Logs the memory that has been retired and reclaimed.  Called on exit if
+ * LIBOBJC_MEMORY_PROFILE is set.
+ */
+PRIVATE void log_reclaim_memory_usage(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // __OBJC_RECLAIM_H_INCLUDED__
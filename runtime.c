@@ -7,6 +7,7 @@
 #include "lock.h"
 #include "dtable.h"
 #include "gc_ops.h"
+#include "associate.h"
 
 /* Make glibc export strdup() */
 
@@ -35,6 +36,9 @@ PRIVATE void call_cxx_destruct(id obj)
 	{
 		cxx_destruct = sel_registerName(".cxx_destruct");
 	}
+	// Associations in the side table are released first, as they would be if
+	// they were stored in a hidden class.
+	remove_side_table_associations(obj);
 	// Don't call object_getClass(), because we want to get hidden classes too
 	Class cls = classForObject(obj);
 
@@ -190,6 +194,72 @@ BOOL class_addMethod(Class cls, SEL name, IMP imp, const char *types)
 	return YES;
 }
 
+unsigned class_addMethods_np(Class cls,
+                             unsigned count,
+                             const SEL *names,
+                             const IMP *imps,
+                             const char *const *types)
+{
+	CHECK_ARG(cls);
+	CHECK_ARG(names);
+	CHECK_ARG(imps);
+	CHECK_ARG(types);
+	if (count == 0) { return 0; }
+
+	struct objc_method_list *methods =
+		malloc(sizeof(struct objc_method_list) + count * sizeof(struct objc_method));
+	methods->size = sizeof(struct objc_method);
+	methods->count = 0;
+	for (unsigned i=0 ; i<count ; i++)
+	{
+		if ((NULL == names[i]) || (NULL == imps[i]) || (NULL == types[i]))
+		{
+			continue;
+		}
+		const char *methodName = sel_getName(names[i]);
+		BOOL exists = NO;
+		// Skip methods that the class already has, as class_addMethod() does.
+		for (struct objc_method_list *l=cls->methods ; l!=NULL && !exists ; l=l->next)
+		{
+			for (int j=0 ; j<l->count ; j++)
+			{
+				if (strcmp(sel_getName(method_at_index(l, j)->selector), methodName) == 0)
+				{
+					exists = YES;
+					break;
+				}
+			}
+		}
+		// Skip duplicates within the list, keeping the first.
+		for (int j=0 ; j<methods->count && !exists ; j++)
+		{
+			exists = strcmp(sel_getName(method_at_index(methods, j)->selector), methodName) == 0;
+		}
+		if (exists) { continue; }
+
+		struct objc_method *m = method_at_index(methods, methods->count++);
+		m->selector = sel_registerTypedName_np(methodName, types[i]);
+		m->types = strdup(types[i]);
+		m->imp = imps[i];
+	}
+	if (methods->count == 0)
+	{
+		free(methods);
+		return 0;
+	}
+
+	methods->next = cls->methods;
+	cls->methods = methods;
+	// Install the whole list at once, so that subclass dtables are only walked
+	// and caches only invalidated once.
+	if (classHasDtable(cls))
+	{
+		add_method_list_to_class(cls, methods);
+	}
+
+	return methods->count;
+}
+
 BOOL class_addProtocol(Class cls, Protocol *protocol)
 {
 	CHECK_ARG(cls);
@@ -821,6 +891,20 @@ Class object_setClass(id obj, Class cls)
 	// If this is a small object, then don't set its class.
 	if (isSmallObject(obj)) { return classForObject(obj); }
 	Class oldClass =  obj->isa;
+	// Weak references to the object are only cleared on deallocation if its
+	// class is marked as weakly referenced, so keep the mark.  The mark is
+	// kept in the real class, not in any hidden class.
+	Class markedClass = oldClass;
+	while ((Nil != markedClass) &&
+	       objc_test_class_flag(markedClass, objc_class_flag_hidden_class))
+	{
+		markedClass = markedClass->super_class;
+	}
+	if ((Nil != markedClass) && (Nil != cls) &&
+	    objc_test_class_flag(markedClass, objc_class_flag_weakly_referenced))
+	{
+		objc_set_class_flag(cls, objc_class_flag_weakly_referenced);
+	}
 	obj->isa = cls;
 	return oldClass;
 }
@@ -6,10 +6,10 @@
 #include "sarray2.h"
 #include "visibility.h"
 
-const static SparseArray EmptyArray = { 0, 0, .data[0 ... 255] = 0 };
-const static SparseArray EmptyArray8 = { 8, 0, .data[0 ... 255] = (void*)&EmptyArray};
-const static SparseArray EmptyArray16 = { 16, 0, .data[0 ... 255] = (void*)&EmptyArray8};
-const static SparseArray EmptyArray24 = { 24, 0, .data[0 ... 255] = (void*)&EmptyArray16};
+const static SparseArray EmptyArray = { 0, 0, 0, .data[0 ... 255] = 0 };
+const static SparseArray EmptyArray8 = { 8, 0, 0, .data[0 ... 255] = (void*)&EmptyArray};
+const static SparseArray EmptyArray16 = { 16, 0, 0, .data[0 ... 255] = (void*)&EmptyArray8};
+const static SparseArray EmptyArray24 = { 24, 0, 0, .data[0 ... 255] = (void*)&EmptyArray16};
 
 #define MAX_INDEX(sarray) (0xff)
 
@@ -69,6 +69,8 @@ PRIVATE SparseArray *SparseArrayExpandingArray(SparseArray *sarray, uint32_t new
 	SparseArray *new = calloc(1, sizeof(SparseArray));
 	new->refCount = 1;
 	new->shift = sarray->shift + 8;
+	// The cache belongs to the root node, so it moves to the new root.
+	new->cache = sarray->cache;
 	new->data[0] = sarray;
 	void *data = EmptyChildForShift(new->shift);
 	for(unsigned i=1 ; i<=MAX_INDEX(sarray) ; i++)
@@ -186,6 +188,7 @@ PRIVATE SparseArray *SparseArrayCopy(SparseArray * sarray)
 	SparseArray *copy = calloc(1, sizeof(SparseArray));
 	memcpy(copy, sarray, sizeof(SparseArray));
 	copy->refCount = 1;
+	copy->cache = NULL;
 	// If the sarray has children, increase their refcounts and link them
 	if (sarray->shift > 0)
 	{
@@ -228,22 +231,25 @@ PRIVATE void SparseArrayDestroy(SparseArray * sarray)
 	free(sarray);
 }
 
-#if 0
-// Unused function, but helpful when debugging.
-PRIVATE int SparseArraySize(SparseArray *sarray)
+PRIVATE size_t SparseArraySize(SparseArray *sarray)
 {
-	int size = 0;
+	size_t size = sizeof(SparseArray);
 	if (sarray->shift == 0)
 	{
-		return 256*sizeof(void*) + sizeof(SparseArray);
+		return size;
 	}
-	size += 256*sizeof(void*) + sizeof(SparseArray);
 	for(unsigned i=0 ; i<=MAX_INDEX(sarray) ; i++)
 	{
 		SparseArray *child = sarray->data[i];
-		if (child == &EmptyArray || 
-		    child == &EmptyArray8 || 
-		    child == &EmptyArray16)
+		if (child == &EmptyArray ||
+		    child == &EmptyArray8 ||
+		    child == &EmptyArray16 ||
+		    child == &EmptyArray24)
+		{
+			continue;
+		}
+		// Nodes shared with copies are not owned by this array.
+		if (child->refCount > 1)
 		{
 			continue;
 		}
@@ -251,4 +257,3 @@ PRIVATE int SparseArraySize(SparseArray *sarray)
 	}
 	return size;
 }
-#endif
@@ -49,6 +49,11 @@ typedef struct
 	 * we copy if its reference count is greater than one.
 	 */
 	uint32_t refCount;
+	/**
+	 * Lookup cache owned by the user of this sparse array.  Only meaningful
+	 * in the root node.  Copies of a sparse array do not share the cache.
+	 */
+	void *cache;
 	/**
 	 * The data stored in this sparse array node.
 	 */
@@ -143,8 +148,10 @@ void * SparseArrayNext(SparseArray * sarray, uint32_t * index);
 SparseArray *SparseArrayCopy(SparseArray * sarray);
 
 /**
- * Returns the total memory usage of a sparse array.  
+ * Returns the memory usage of a sparse array.  Nodes that are shared with
+ * other sparse arrays as a result of copy-on-write are not counted, so the sum
+ * of the sizes of a set of copies is a lower bound on their real usage.
  */
-int SparseArraySize(SparseArray *sarray);
+size_t SparseArraySize(SparseArray *sarray);
 
 #endif //_SARRAY_H_INCLUDED_
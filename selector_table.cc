@@ -11,6 +11,7 @@
 #include <vector>
 #include <mutex>
 #include <forward_list>
+#include <algorithm>
 #include <tsl/robin_set.h>
 #include "class.h"
 #include "lock.h"
@@ -334,6 +335,24 @@ using SelectorTable = tsl::robin_set<objc_selector*, SelectorHash, SelectorEqual
 static SelectorTable *selector_table;
 
 static int selector_name_copies;
+
+/**
+ * Selector indexes below this value are never handed out in registration
+ * order, so are available for selectors from the hot selector profile.
+ */
+const uint32_t hot_selector_limit = 1<<16;
+
+/**
+ * The next index to give to a selector from the hot selector profile, or 0
+ * if the profile is not currently being loaded.
+ */
+uint32_t next_hot_index;
+
+/**
+ * The number of selectors that were registered from the hot selector
+ * profile.
+ */
+uint32_t hot_selector_count;
 }
 
 extern "C" PRIVATE void log_selector_memory_usage(void)
@@ -346,6 +365,11 @@ extern "C" PRIVATE void log_selector_memory_usage(void)
 	fprintf(stderr, "%d selectors registered.\n", selector_count);
 	fprintf(stderr, "%d hash table cells per selector (%.2f%% full)\n", sel_table->table_size / selector_count,  ((float)selector_count) /  sel_table->table_size * 100);
 #endif
+	if (hot_selector_count > 0)
+	{
+		fprintf(stderr, "%u hot selectors in %u dtable leaves.\n",
+		        hot_selector_count, (hot_selector_count >> 8) + 1);
+	}
 }
 
 
@@ -377,6 +401,16 @@ static SEL selector_lookup(const char *name, const char *types)
 
 static inline void add_selector_to_table(SEL aSel)
 {
+	if ((next_hot_index != 0) && (next_hot_index < hot_selector_limit))
+	{
+		// Selectors from the hot selector profile get the next reserved index,
+		// so that they are contiguous.
+		(*selector_list)[next_hot_index] = {aSel->name};
+		aSel->index = next_hot_index++;
+		hot_selector_count++;
+		selector_table->insert(aSel);
+		return;
+	}
 	// Store the name at the head of the list.
 	if (selector_list->capacity() == selector_list->size())
 	{
@@ -499,12 +533,113 @@ SEL objc_register_selector_copy(UnregisteredSelector &aSel, BOOL copyArgs)
 	return copy;
 }
 
+/**
+ * Registers the selectors listed in the hot selector profile, if one is
+ * specified by the LIBOBJC_HOT_SELECTORS environment variable.  These are
+ * given small, contiguous indexes so that the dtable entries for them are in
+ * as few sparse array leaves as possible.  The profile contains one selector
+ * per line, as a name optionally followed by whitespace and a type encoding.
+ * Blank lines and lines starting with # are ignored.  Malformed lines, which
+ * have more than two fields or are too long, are reported and skipped.
+ *
+ * This must be called after the dispatch tables are initialised and before
+ * any selectors are registered.
+ */
+extern "C" PRIVATE void init_hot_selectors(void)
+{
+	const char *path = getenv("LIBOBJC_HOT_SELECTORS");
+	if (nullptr == path)
+	{
+		return;
+	}
+	FILE *profile = fopen(path, "r");
+	if (nullptr == profile)
+	{
+		fprintf(stderr, "Unable to open hot selector profile %s\n", path);
+		return;
+	}
+	LockGuard g{selector_table_lock};
+	// Index 0 is never used for a selector.
+	next_hot_index = 1;
+	char line[1024];
+	unsigned lineNumber = 0;
+	while (fgets(line, sizeof(line), profile))
+	{
+		lineNumber++;
+		// If the buffer filled up without reaching the end of the line, skip
+		// the rest of it.
+		if ((strlen(line) == sizeof(line) - 1) && (line[sizeof(line) - 2] != '\n'))
+		{
+			int c = fgetc(profile);
+			if ((c != EOF) && (c != '\n'))
+			{
+				fprintf(stderr, "Ignoring over-long line %u in hot selector profile %s\n",
+				        lineNumber, path);
+				while (((c = fgetc(profile)) != EOF) && (c != '\n')) {}
+				continue;
+			}
+		}
+		char *name = line + strspn(line, " \t");
+		name[strcspn(name, "\r\n")] = '\0';
+		if ((*name == '\0') || (*name == '#'))
+		{
+			continue;
+		}
+		char *types = strpbrk(name, " \t");
+		if (nullptr != types)
+		{
+			*(types++) = '\0';
+			types += strspn(types, " \t");
+			char *end = types + strcspn(types, " \t");
+			if (end[strspn(end, " \t")] != '\0')
+			{
+				fprintf(stderr, "Ignoring malformed line %u in hot selector profile %s\n",
+				        lineNumber, path);
+				continue;
+			}
+			*end = '\0';
+			if (*types == '\0')
+			{
+				types = nullptr;
+			}
+		}
+		UnregisteredSelector sel = {name, types};
+		objc_register_selector_copy(sel, YES);
+	}
+	next_hot_index = 0;
+	fclose(profile);
+}
+
 /**
  * Public API functions.
  */
 extern "C"
 {
 
+unsigned sel_getHotSelectorCount_np(void)
+{
+	return hot_selector_count;
+}
+
+unsigned sel_countDtableLeaves_np(SEL *sels, unsigned count)
+{
+	if (nullptr == sels)
+	{
+		return 0;
+	}
+	std::vector<uintptr_t> leaves;
+	leaves.reserve(count);
+	for (unsigned i=0 ; i<count ; i++)
+	{
+		if ((nullptr != sels[i]) && isSelRegistered(sels[i]))
+		{
+			leaves.push_back(sels[i]->index >> 8);
+		}
+	}
+	std::sort(leaves.begin(), leaves.end());
+	return std::unique(leaves.begin(), leaves.end()) - leaves.begin();
+}
+
 const char *sel_getName(SEL sel)
 {
 	if (nullptr == sel) { return "<null selector>"; }
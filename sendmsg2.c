@@ -4,6 +4,7 @@
 #include "selector.h"
 #include "loader.h"
 #include "objc/hooks.h"
+#include "reclaim.h"
 #include <stdint.h>
 #include <stdio.h>
 
@@ -85,11 +86,123 @@ static IMP call_mismatch_hook(Class cls, SEL sel, struct objc_slot2 *slot)
 	return _objc_selector_type_mismatch2(cls, sel, slot);
 }
 
+/**
+ * Looks up the method for the selector with index `idx` in a class's dtable,
+ * checking the method cache first and filling it on a miss.  This does the
+ * same thing as the message send fast paths.
+ */
+static inline struct objc_slot2 *dtable_lookup_cached(dtable_t dtable,
+                                                      uint32_t idx)
+{
+#ifdef COMPACT_DTABLES
+	if (dtable_is_compact(dtable))
+	{
+		CompactDtable *compact = (CompactDtable*)dtable;
+		struct compact_dtable_entry *e = compact_dtable_find(compact, idx);
+		if (NULL != e)
+		{
+			return (struct objc_slot2*)e->method;
+		}
+		dtable = compact->base->dtable;
+	}
+#endif
+	// Load the cache before the dtable, so that we don't add a stale method
+	// to a cache that replaced this one.
+	struct objc_method_cache *cache = dtable_method_cache(dtable);
+	struct objc_slot2 *result = method_cache_lookup(cache, idx);
+	if (LIKELY(NULL != result))
+	{
+		return result;
+	}
+	// Repeated misses, for example for selectors that are forwarded, don't
+	// need to walk the dtable.
+	if (method_cache_lookup_negative(cache, idx))
+	{
+		return NULL;
+	}
+	result = SparseArrayLookup(dtable, idx);
+	if (NULL != result)
+	{
+		method_cache_fill(dtable, cache, idx, (struct objc_method*)result);
+	}
+	return result;
+}
+
+/**
+ * Returns whether the method cache for `dtable` records that it has no method
+ * for either the typed or untyped form of `selector`.
+ */
+static inline BOOL dtable_cached_miss(dtable_t dtable, SEL selector)
+{
+	struct objc_method_cache *cache = dtable_method_cache(dtable);
+	return method_cache_lookup_negative(cache, selector->index) &&
+		method_cache_lookup_negative(cache, get_untyped_idx(selector));
+}
+
+/**
+ * Records in the method cache for `dtable` that it has no method for either
+ * the typed or untyped form of `selector`.
+ */
+static void dtable_record_miss(dtable_t dtable, SEL selector)
+{
+	if (dtable == uninstalled_dtable)
+	{
+		return;
+	}
+	struct objc_method_cache *cache = dtable_method_cache(dtable);
+	uint32_t untyped_idx = get_untyped_idx(selector);
+	method_cache_fill_missing(dtable, cache, selector->index, NULL);
+	if (untyped_idx != selector->index)
+	{
+		method_cache_fill_missing(dtable, cache, untyped_idx, NULL);
+	}
+}
+
+/**
+ * Calls the type mismatch hook for `method`, found by looking up the untyped
+ * form of `selector` in `dtable`.  If the hook tolerates the mismatch by
+ * returning the method's own implementation, then the method is cached for
+ * the typed selector so that later sends take the fast path.  Otherwise,
+ * returns an uncacheable slot for the implementation that the hook returned.
+ * `cache` must have been loaded from `dtable` before looking up the method.
+ */
+static struct objc_slot2 *resolve_type_mismatch(Class cls,
+                                                dtable_t dtable,
+                                                struct objc_method_cache *cache,
+                                                SEL selector,
+                                                struct objc_slot2 *method)
+{
+	IMP imp = call_mismatch_hook(cls, selector, method);
+	if (imp == method->method)
+	{
+		method_cache_fill_missing(dtable, cache, selector->index,
+		                          (struct objc_method*)method);
+		return method;
+	}
+	uncacheable_slot.imp = imp;
+	return (struct objc_slot2*)&uncacheable_slot;
+}
+
+/**
+ * Returns whether `result`, the slot for `selector`, is a method with a
+ * different type encoding.  Slots for these may be cached in method caches,
+ * but not by callers, because adding a method with the correct types does not
+ * increment the selector's cache version.
+ */
+static inline BOOL is_type_mismatch(struct objc_slot2 *result, SEL selector)
+{
+	return (NULL != selector->types) &&
+		(((struct objc_method*)result)->selector->index != selector->index);
+}
+
 static
 // Uncomment for debugging
 //__attribute__((noinline))
 __attribute__((always_inline))
-struct objc_slot2 *objc_msg_lookup_internal(id *receiver, SEL selector, uint64_t *version)
+struct objc_slot2 *objc_msg_lookup_internal(id *receiver,
+                                            SEL selector,
+                                            _Atomic(uint64_t) *counter,
+                                            uint64_t *version)
 {
 	if (version)
 	{
@@ -97,15 +210,25 @@ struct objc_slot2 *objc_msg_lookup_internal(id *receiver, SEL selector, uint64_t
 		// Always write 0 to version, marking the slot as uncacheable.
 		*version = 0;
 #else
-		*version = objc_method_cache_version;
+		*version = *counter;
 #endif
 	}
+	reclaim_register_thread_once();
 	Class class = classForObject((*receiver));
 retry:;
-	struct objc_slot2 * result = objc_dtable_lookup(class->dtable, selector->index);
+	struct objc_slot2 * result = dtable_lookup_cached(class->dtable, selector->index);
+#ifndef NO_SAFE_CACHING
+	if (version && result && is_type_mismatch(result, selector))
+	{
+		*version = 0;
+	}
+#endif
 	if (UNLIKELY(0 == result))
 	{
 		dtable_t dtable = dtable_for_class(class);
+		// Load the cache before the dtable, as in dtable_lookup_cached().
+		struct objc_method_cache *cache = dtable_method_cache(dtable);
+		BOOL cachedMiss = NO;
 		/* Install the dtable if it hasn't already been initialized. */
 		if (dtable == uninstalled_dtable)
 		{
@@ -113,7 +236,7 @@ retry:;
 			dtable = dtable_for_class(class);
 			result = objc_dtable_lookup(dtable, selector->index);
 		}
-		else
+		else if (!(cachedMiss = dtable_cached_miss(dtable, selector)))
 		{
 			// Check again incase another thread updated the dtable while we
 			// weren't looking
@@ -121,7 +244,8 @@ retry:;
 		}
 		if (0 == result)
 		{
-			if ((result = objc_dtable_lookup(dtable, get_untyped_idx(selector))))
+			if (!cachedMiss &&
+			    (result = objc_dtable_lookup(dtable, get_untyped_idx(selector))))
 			{
 #ifndef NO_SAFE_CACHING
 				if (version)
@@ -129,8 +253,11 @@ retry:;
 					*version = 0;
 				}
 #endif
-				uncacheable_slot.imp = call_mismatch_hook(class, selector, result);
-				result = (struct objc_slot2*)&uncacheable_slot;
+				result = resolve_type_mismatch(class, dtable, cache, selector, result);
+			}
+			else if (!cachedMiss)
+			{
+				dtable_record_miss(dtable, selector);
 			}
 			id newReceiver = objc_proxy_lookup(*receiver, selector);
 			// If some other library wants us to play forwarding games, try
@@ -160,7 +287,7 @@ PRIVATE IMP slowMsgLookup(id *receiver, SEL cmd)
 {
 	// By the time we've got here, the assembly version of this function has
 	// already done the nil checks.
-	return objc_msg_lookup_internal(receiver, cmd, NULL)->method;
+	return objc_msg_lookup_internal(receiver, cmd, NULL, NULL)->method;
 }
 
 PRIVATE void logInt(void *a)
@@ -199,7 +326,7 @@ struct objc_slot *objc_msg_lookup_sender(id *receiver, SEL selector, id sender)
 		return &nil_slot_v1;
 	}
 
-	struct objc_slot2 *slot = objc_msg_lookup_internal(receiver, selector, NULL);
+	struct objc_slot2 *slot = objc_msg_lookup_internal(receiver, selector, NULL, NULL);
 	uncacheable_slot_v1.owner = Nil;
 	uncacheable_slot_v1.types = sel_getType_np(((struct objc_method*)slot)->selector);
 	uncacheable_slot_v1.selector = selector;
@@ -235,10 +362,14 @@ static struct objc_slot2* objc_slot_lookup(id *receiver, SEL selector)
 		return (struct objc_slot2*)&nil_slot;
 	}
 
-	return objc_msg_lookup_internal(receiver, selector, NULL);
+	return objc_msg_lookup_internal(receiver, selector, NULL, NULL);
 }
 
-struct objc_slot2 *objc_slot_lookup_version(id *receiver, SEL selector, uint64_t *version)
+static inline
+struct objc_slot2 *slot_lookup_versioned(id *receiver,
+                                         SEL selector,
+                                         _Atomic(uint64_t) *counter,
+                                         uint64_t *version)
 {
 	// Returning a nil slot allows the caller to cache the lookup for nil too,
 	// although this is not particularly useful because the nil method can be
@@ -271,7 +402,22 @@ struct objc_slot2 *objc_slot_lookup_version(id *receiver, SEL selector, uint64_t
 		return (struct objc_slot2*)&nil_slot;
 	}
 
-	return objc_msg_lookup_internal(receiver, selector, version);
+	return objc_msg_lookup_internal(receiver, selector, counter, version);
+}
+
+struct objc_slot2 *objc_slot_lookup_version(id *receiver, SEL selector, uint64_t *version)
+{
+#ifdef NO_SAFE_CACHING
+	return slot_lookup_versioned(receiver, selector, NULL, version);
+#else
+	return slot_lookup_versioned(receiver, selector, &objc_method_cache_version, version);
+#endif
+}
+
+struct objc_slot2 *objc_slot_lookup_selector_version(id *receiver, SEL selector, uint64_t *version)
+{
+	return slot_lookup_versioned(receiver, selector,
+	                             objc_selector_cache_version(selector), version);
 }
 
 IMP objc_msg_lookup2(id *receiver, SEL selector)
@@ -286,7 +432,9 @@ struct objc_slot2 *objc_slot_lookup_super2(struct objc_super *super, SEL selecto
 	if (receiver)
 	{
 		Class class = super->class;
-		struct objc_slot2 * result = objc_dtable_lookup(dtable_for_class(class),
+		// Use the method cache, so that objc_msgSendSuper() finds the method
+		// there next time.
+		struct objc_slot2 * result = dtable_lookup_cached(dtable_for_class(class),
 				selector->index);
 		if (0 == result)
 		{
@@ -314,6 +462,15 @@ struct objc_slot2 *objc_slot_lookup_super2(struct objc_super *super, SEL selecto
 	return (struct objc_slot2*)&nil_slot;
 }
 
+/**
+ * Slow path for objc_msgSendSuper().  The assembly passes a pointer to the
+ * spilled first argument, which is the objc_super structure, not the receiver.
+ */
+PRIVATE IMP slowMsgLookupSuper(id *super, SEL cmd)
+{
+	return objc_slot_lookup_super2(*(struct objc_super**)super, cmd)->method;
+}
+
 OBJC_PUBLIC
 struct objc_slot *objc_slot_lookup_super(struct objc_super *super, SEL selector)
 {
@@ -367,10 +524,23 @@ struct objc_slot2 *objc_get_slot2(Class cls, SEL selector, uint64_t *version)
 		*version = objc_method_cache_version;
 	}
 #endif
-	struct objc_slot2 * result = objc_dtable_lookup(cls->dtable, selector->index);
+	struct objc_slot2 * result = dtable_lookup_cached(cls->dtable, selector->index);
+#ifndef NO_SAFE_CACHING
+	if (version && result && is_type_mismatch(result, selector))
+	{
+		*version = 0;
+	}
+#endif
 	if (0 == result)
 	{
 		void *dtable = dtable_for_class(cls);
+		struct objc_method_cache *cache = dtable_method_cache(dtable);
+		// Classes that don't respond to a selector usually don't respond to it
+		// the next time that they are asked either.
+		if (dtable_cached_miss(dtable, selector))
+		{
+			return NULL;
+		}
 		/* Install the dtable if it hasn't already been initialized. */
 		if (dtable == uninstalled_dtable)
 		{
@@ -385,7 +555,11 @@ struct objc_slot2 *objc_get_slot2(Class cls, SEL selector, uint64_t *version)
 		}
 		if (NULL == result)
 		{
-			if ((result = objc_dtable_lookup(dtable, get_untyped_idx(selector))))
+			if (NULL == (result = objc_dtable_lookup(dtable, get_untyped_idx(selector))))
+			{
+				dtable_record_miss(dtable, selector);
+			}
+			else
 			{
 #ifndef NO_SAFE_CACHING
 				if (version)
@@ -393,8 +567,7 @@ struct objc_slot2 *objc_get_slot2(Class cls, SEL selector, uint64_t *version)
 					*version = 0;
 				}
 #endif
-				uncacheable_slot.imp = call_mismatch_hook(cls, selector, result);
-				result = (struct objc_slot2*)&uncacheable_slot;
+				result = resolve_type_mismatch(cls, dtable, cache, selector, result);
 			}
 		}
 	}
@@ -477,7 +650,7 @@ IMP objc_msg_lookup(id receiver, SEL selector)
 	if (nil == receiver) { return (IMP)nil_method; }
 
 	id self = receiver;
-	struct objc_slot2 * slot = objc_msg_lookup_internal(&self, selector, NULL);
+	struct objc_slot2 * slot = objc_msg_lookup_internal(&self, selector, NULL, NULL);
 	// If the receiver is changed by the lookup mechanism then we have to fall
 	// back to old-style forwarding.
 	if (self != receiver)
@@ -5,6 +5,18 @@
 #include <thread>
 
 
+/**
+ * Hint to the CPU that we are in a spin-wait loop.
+ */
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__arm__) && (__ARM_ARCH >= 7))
+	__asm__ volatile("yield");
+#endif
+}
+
 // Not all supported targets implement the wait / notify instructions on
 // atomics.  Provide simple spinning fallback for ones that don't.
 template<typename T>
@@ -15,7 +27,9 @@ concept Waitable = requires(T t)
 
 /**
  * Lightweight spinlock that falls back to using the operating system's futex
- * abstraction if one exists.
+ * abstraction if one exists.  A thread that finds the lock held spins briefly,
+ * with exponential backoff, before waiting, because most of the critical
+ * sections protected by these locks are a few instructions long.
  */
 class ThinLock
 {
@@ -60,17 +74,61 @@ class ThinLock
 		std::this_thread::sleep_for(1ms);
 	}
 
+	// The maximum number of pause instructions between two checks of the lock
+	// word while spinning.  Spinning is pointless if there is only one CPU,
+	// because the thread holding the lock can't run until we stop.
+	static inline const unsigned spinLimit =
+		std::thread::hardware_concurrency() > 1 ? 64 : 0;
+
 	public:
+	// Try to acquire the lock without waiting.
+	bool try_lock()
+	{
+		auto old = LockState::Unlocked;
+		return lockWord.compare_exchange_strong(old, LockState::Locked);
+	}
+
 	// Acquire the lock
 	void lock()
 	{
+		if (!try_lock())
+		{
+			lockSlow();
+		}
+	}
+
+	/**
+	 * Acquire the lock after try_lock() has failed.  Returns the number of
+	 * times that the calling thread waited for the lock to be released.
+	 */
+	unsigned lockSlow()
+	{
+		unsigned waits = 0;
+		for (unsigned delay=1 ; delay<=spinLimit ; delay*=2)
+		{
+			for (unsigned i=0 ; i<delay ; i++)
+			{
+				cpu_relax();
+			}
+			auto old = lockWord.load(std::memory_order_relaxed);
+			if ((old == LockState::Unlocked) && try_lock())
+			{
+				return waits;
+			}
+			// If other threads have given up spinning then the lock is held
+			// for a long time and we should wait as well.
+			if (old == LockState::LockedWithWaiters)
+			{
+				break;
+			}
+		}
 		while (true)
 		{
 			auto old     = LockState::Unlocked;
 			// CAS in the locked state.
 			if (lockWord.compare_exchange_strong(old, LockState::Locked))
 			{
-				return;
+				return waits;
 			}
 			// If the CAS failed add the waiters flag.
 			if (old != LockState::LockedWithWaiters)
@@ -81,6 +139,7 @@ class ThinLock
 					continue;
 				}
 			}
+			waits++;
 			wait(lockWord, LockState::LockedWithWaiters);
 		}
 	}
@@ -108,27 +167,72 @@ class ThinLock
 	}
 };
 
+/**
+ * ThinLock that may be reacquired by the thread that already holds it.  This
+ * is for locks that are held while calling code outside the runtime, which
+ * may call back into functions that acquire the same lock.
+ */
+class RecursiveThinLock
+{
+	// The underlying lock.
+	ThinLock innerLock;
+	// The thread that holds the lock.  Only ever set to the current thread's
+	// ID by the current thread, so a relaxed load will only see the current
+	// thread's ID if this thread holds the lock.
+	std::atomic<std::thread::id> owner;
+	// The number of times that the owner has acquired the lock.
+	unsigned depth = 0;
+
+	public:
+	// Acquire the lock
+	void lock()
+	{
+		auto self = std::this_thread::get_id();
+		if (owner.load(std::memory_order_relaxed) == self)
+		{
+			depth++;
+			return;
+		}
+		innerLock.lock();
+		owner.store(self, std::memory_order_relaxed);
+		depth = 1;
+	}
+
+	// Release the lock
+	void unlock()
+	{
+		if (--depth == 0)
+		{
+			owner.store(std::thread::id(), std::memory_order_relaxed);
+			innerLock.unlock();
+		}
+	}
+};
+
 /**
  * Deadlock-free lock guard.  Acquires the two locks in order defined by their
  * sort order.  If the two locks are the same, does not acquire the second.
  */
+template<typename Lock>
 class DoubleLockGuard
 {
 	// The first lock
-	ThinLock *lock1;
+	Lock *lock1;
 	// The second lock
-	ThinLock *lock2;
+	Lock *lock2;
 	public:
-	DoubleLockGuard(ThinLock *lock1, ThinLock *lock2) : lock1(lock1), lock2(lock2)
+	DoubleLockGuard(Lock *lock1, Lock *lock2) : lock1(lock1), lock2(lock2)
 	{
-		if (lock2 < lock1)
+		// Sort the members, not the arguments, so that the destructor sees
+		// them in the same order.
+		if (this->lock2 < this->lock1)
 		{
-			std::swap(lock1, lock2);
+			std::swap(this->lock1, this->lock2);
 		}
-		lock1->lock();
-		if (lock1 != lock2)
+		this->lock1->lock();
+		if (this->lock1 != this->lock2)
 		{
-			lock2->lock();
+			this->lock2->lock();
 		}
 	}
 	~DoubleLockGuard()
@@ -142,15 +246,72 @@ class DoubleLockGuard
 	}
 };
 
+#ifdef PADDED_PROPERTY_LOCKS
+#	define PROPERTY_LOCK_ALIGNMENT alignas(64)
+#else
+#	define PROPERTY_LOCK_ALIGNMENT
+#endif
+
 /**
- * Number of spinlocks.  This allocates one page with a 32-bit lock.
+ * Lock used for atomic property access, with counters recording how often it
+ * was contended.  The counters are updated only when the lock is already
+ * held, so they cost nothing when it is not contended.  If
+ * PADDED_PROPERTY_LOCKS is defined then each lock has its own cache line, so
+ * that unrelated properties whose locks are adjacent don't contend.
+ */
+class PROPERTY_LOCK_ALIGNMENT PropertyLock
+{
+	// The underlying lock.
+	ThinLock innerLock;
+
+	public:
+	// The number of times that a thread found this lock held.
+	std::atomic<uint32_t> contended;
+	// The number of times that a thread waited for this lock after spinning.
+	std::atomic<uint32_t> waits;
+
+	// Acquire the lock
+	void lock()
+	{
+		if (!innerLock.try_lock())
+		{
+			contended.fetch_add(1, std::memory_order_relaxed);
+			if (unsigned waited = innerLock.lockSlow())
+			{
+				waits.fetch_add(waited, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Release the lock
+	void unlock()
+	{
+		innerLock.unlock();
+	}
+};
+
+/**
+ * Number of spinlocks.
  */
 #define spinlock_count (1<<10)
 static const int spinlock_mask = spinlock_count - 1;
 /**
- * Integers used as spinlocks for atomic property access.
+ * Locks for atomic property access.
+ */
+PRIVATE inline PropertyLock spinlocks[spinlock_count];
+
+/**
+ * Hashes the address of an object, or of a variable that holds a pointer, for
+ * use as an index into a table of locks or shards.  The low bits of the
+ * result are well distributed.
  */
-PRIVATE inline ThinLock spinlocks[spinlock_count];
+static inline size_t hash_for_pointer(const void *ptr)
+{
+	uintptr_t hash = (uintptr_t)ptr;
+	// Objects are at least pointer aligned.
+	hash >>= sizeof(void*) == 4 ? 2 : 4;
+	return hash ^ (hash >> 10) ^ (hash >> 20);
+}
 
 /**
  * Get a spin lock from a pointer.  We want to prevent lock contention between
@@ -160,7 +321,7 @@ PRIVATE inline ThinLock spinlocks[spinlock_count];
  * contention between the same property in different objects, so we can't just
  * use the ivar offset.
  */
-static inline ThinLock *lock_for_pointer(const void *ptr)
+static inline PropertyLock *lock_for_pointer(const void *ptr)
 {
 	intptr_t hash = (intptr_t)ptr;
 	// Most properties will be pointers, so disregard the lowest few bits
@@ -176,7 +337,7 @@ static inline ThinLock *lock_for_pointer(const void *ptr)
  */
 inline auto acquire_locks_for_pointers(const void *ptr)
 {
-	return std::lock_guard<ThinLock>{*lock_for_pointer(ptr)};
+	return std::lock_guard<PropertyLock>{*lock_for_pointer(ptr)};
 }
 
 /**
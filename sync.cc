@@ -0,0 +1,156 @@
+/**
+ * Monitors for @synchronized.
+ *
+ * Each object that is currently locked with objc_sync_enter() has a monitor in
+ * a striped table, keyed by the object's address.  Monitors are only in the
+ * table while some thread has entered them or is waiting to, so objects do
+ * not need any cleanup when they are deallocated and locking an object does
+ * not modify it.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <tsl/robin_map.h>
+#include "objc/runtime.h"
+#include "class.h"
+#include "dtable.h"
+#include "lock.h"
+#include "spinlock.h"
+#include "visibility.h"
+
+namespace {
+
+/**
+ * A monitor for one object.
+ */
+struct Monitor
+{
+	/**
+	 * The recursive mutex that is held by the thread inside the @synchronized
+	 * block.
+	 */
+	mutex_t lock;
+	/**
+	 * The thread that holds `lock`, identified by threadIdentity(), or NULL
+	 * if no thread holds it.  Written only by the owning thread, while it
+	 * holds `lock`.
+	 */
+	std::atomic<const void*> owner;
+	/**
+	 * The number of times that the owning thread has entered this monitor
+	 * without exiting it.  Protected by `lock`.
+	 */
+	unsigned long recursion;
+	/**
+	 * The number of calls to objc_sync_enter() for this object, from any
+	 * thread, that have not yet been matched by a call to objc_sync_exit().
+	 * This includes threads that are waiting for the lock.  Protected by the
+	 * stripe lock.
+	 */
+	unsigned long users;
+	/**
+	 * The next monitor in the stripe's free list.
+	 */
+	Monitor *next;
+};
+
+/**
+ * The number of stripes in the monitor table.  Must be a power of two.
+ */
+static const size_t monitor_stripe_count = 64;
+
+/**
+ * One stripe of the monitor table.  The lock is held only while looking up or
+ * updating a monitor, never while waiting for one.  Stripes are padded to
+ * avoid false sharing.
+ */
+struct alignas(64) MonitorStripe
+{
+	ThinLock lock;
+	tsl::robin_map<const void*, Monitor*> monitors;
+	/**
+	 * Monitors that are not in use.  These are never freed, so that their
+	 * mutexes only need to be initialised once.
+	 */
+	Monitor *freeList;
+};
+
+MonitorStripe &monitorStripe(const void *obj)
+{
+	static MonitorStripe stripes[monitor_stripe_count];
+	return stripes[hash_for_pointer(obj) & (monitor_stripe_count - 1)];
+}
+
+/**
+ * Returns a value that uniquely identifies the calling thread among all
+ * running threads.
+ */
+const void *threadIdentity()
+{
+	static thread_local char identity;
+	return &identity;
+}
+
+}
+
+extern "C" OBJC_PUBLIC int objc_sync_enter(id object)
+{
+	if ((object == 0) || isSmallObject(object)) { return OBJC_SYNC_SUCCESS; }
+	MonitorStripe &stripe = monitorStripe(object);
+	Monitor *monitor;
+	{
+		std::lock_guard<ThinLock> guard{stripe.lock};
+		Monitor *&entry = stripe.monitors[object];
+		if (NULL == entry)
+		{
+			entry = stripe.freeList;
+			if (NULL != entry)
+			{
+				stripe.freeList = entry->next;
+			}
+			else
+			{
+				entry = static_cast<Monitor*>(calloc(1, sizeof(Monitor)));
+				INIT_LOCK(entry->lock);
+			}
+		}
+		monitor = entry;
+		monitor->users++;
+	}
+	LOCK(&monitor->lock);
+	monitor->owner.store(threadIdentity(), std::memory_order_relaxed);
+	monitor->recursion++;
+	return OBJC_SYNC_SUCCESS;
+}
+
+extern "C" OBJC_PUBLIC int objc_sync_exit(id object)
+{
+	if ((object == 0) || isSmallObject(object)) { return OBJC_SYNC_SUCCESS; }
+	MonitorStripe &stripe = monitorStripe(object);
+	std::lock_guard<ThinLock> guard{stripe.lock};
+	auto found = stripe.monitors.find(object);
+	if (found == stripe.monitors.end())
+	{
+		return OBJC_SYNC_NOT_OWNING_THREAD_ERROR;
+	}
+	Monitor *monitor = found->second;
+	// Only the owner can have stored its own identity, so other threads can
+	// read a stale value here but never a matching one.
+	if (monitor->owner.load(std::memory_order_relaxed) != threadIdentity())
+	{
+		return OBJC_SYNC_NOT_OWNING_THREAD_ERROR;
+	}
+	if (--monitor->recursion == 0)
+	{
+		monitor->owner.store(NULL, std::memory_order_relaxed);
+	}
+	UNLOCK(&monitor->lock);
+	if (--monitor->users == 0)
+	{
+		stripe.monitors.erase(found);
+		monitor->next = stripe.freeList;
+		stripe.freeList = monitor;
+	}
+	return OBJC_SYNC_SUCCESS;
+}